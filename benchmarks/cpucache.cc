@@ -0,0 +1,56 @@
+/* Scaling of the per-cpu cache.
+ * Each thread repeatedly mallocs a burst of small objects and then frees them all.
+ * The burst is much bigger than a thread cache, so nearly every thread-cache miss and
+ * overflow goes to the cpu cache.  Compare the rseq cpu cache with the locked one
+ * and the lock-free one:
+ *   SUPERMALLOC_MODE=pthread_mutex SUPERMALLOC_RSEQ=0 ./cpucache-supermalloc
+ *   SUPERMALLOC_MODE=pthread_mutex SUPERMALLOC_RSEQ=1 ./cpucache-supermalloc
+ *   SUPERMALLOC_MODE=lockfree SUPERMALLOC_RSEQ=0 ./cpucache-supermalloc
+ * (make run-cpucache does all three.)
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <unistd.h>
+
+const int n_iterations = 2000;
+const int burst = 1024;
+const size_t size = 64;
+
+void worker(void) {
+  void **objects = new void*[burst];
+  for (int iter = 0 ; iter < n_iterations; iter++) {
+    for (int i = 0; i < burst; i++) {
+      objects[i] = malloc(size);
+    }
+    for (int i = 0; i < burst; i++) {
+      free(objects[i]);
+    }
+  }
+  delete [] objects;
+}
+
+int main(int argc __attribute__((unused)), const char *argv[] __attribute__((unused))) {
+  const char *mode = getenv("SUPERMALLOC_MODE");
+  const char *rseq = getenv("SUPERMALLOC_RSEQ");
+  long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  printf("mode=%s rseq=%s size=%ld burst=%d n_iterations=%d\n", mode ? mode : "default", rseq ? rseq : "default", size, burst, n_iterations);
+  for (int tcount = 1; tcount <= 2*n_cpus; tcount*=2) {
+    std::thread *threads = new std::thread[tcount];
+    struct timespec start,end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int tnum = 0; tnum < tcount; tnum++) {
+      threads[tnum] = std::thread(worker);
+    }
+    for (int tnum = 0; tnum < tcount; tnum++) {
+      threads[tnum].join();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    delete[] threads;
+    double rtime = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    double n_ops = 2.0 * tcount * n_iterations * burst;
+    printf("%3d threads %7.2fs runtime %8.2f Mops/s\n", tcount, rtime, n_ops/rtime*1e-6);
+  }
+}
@@ -3,28 +3,51 @@
  *  not doing any system calls (not mmap() on allocation, neither munmap() nor madvise() on deallocation)
  *  so it cannot be that.  The problem, if there is one, is something else.
  * For size=20000K, things look just fine, even if I turn off the madvise inside huge_malloc.cc, it just doesn't matter much.
+ *
+ *   ./dementiev [size_in_K [n_iterations [n_live]]]
+ *
+ * Each iteration allocates n_live objects, writes them, and frees them.  With a large size (say 256K)
+ *  and enough live objects to get past the caches, this measures the churn of large objects, for
+ *  which the page faults depend on how long we keep freed pages resident (see SUPERMALLOC_LARGE_DECAY_MS).
  */
 
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <algorithm>
 #include <thread>
+#include <sys/resource.h>
 #include <sys/time.h>
 
-const int n_iterations = 300;
-const size_t size = 20000*1024;
+static int n_iterations = 300;
+static size_t size = 20000*1024;
+static const int max_live = 64;
+static int n_live = 1;
 
 void worker(void) {
+  void *p[max_live];
   for (int iter = 0 ; iter < n_iterations; iter++) {
-    void *p = malloc(size);
-    memset(p, 0, size);
-    free(p);
+    for (int i = 0; i < n_live; i++) {
+      p[i] = malloc(size);
+      memset(p[i], 1, size); // Not 0, or the compiler turns the malloc and memset into a calloc.
+      asm volatile("" : : "r"(p[i]) : "memory"); // And don't let it elide the malloc and free.
+    }
+    for (int i = 0; i < n_live; i++) {
+      free(p[i]);
+    }
   }
 }
 
-int main(int argc __attribute__((unused)), const char *argv[] __attribute__((unused))) {
-  printf("size=%ld n_iterations=%d\n", size, n_iterations);
+int main(int argc, const char *argv[]) {
+  if (argc > 1) size = atol(argv[1])*1024;
+  if (argc > 2) n_iterations = atoi(argv[2]);
+  if (argc > 3) n_live = std::min(max_live, atoi(argv[3]));
+  printf("size=%ld n_iterations=%d n_live=%d\n", size, n_iterations, n_live);
   for (int tcount = 1; tcount < 64; tcount*=2) {
     std::thread *threads = new std::thread[tcount];
     struct timespec start,end;
+    struct rusage ru_start, ru_end;
+    getrusage(RUSAGE_SELF, &ru_start);
     clock_gettime(CLOCK_MONOTONIC, &start);
     for (int tnum = 0; tnum < tcount; tnum++) {
       threads[tnum] = std::thread(worker);
@@ -33,8 +56,9 @@ int main(int argc __attribute__((unused)), const char *argv[] __attribute__((unu
       threads[tnum].join();
     }
     clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &ru_end);
     delete[] threads;
     double rtime = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
-    printf("%2d threads %7.2fs runtime\n", tcount, rtime);
+    printf("%2d threads %7.2fs runtime %9ld minor faults\n", tcount, rtime, ru_end.ru_minflt - ru_start.ru_minflt);
   }
 }
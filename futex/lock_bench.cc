@@ -0,0 +1,81 @@
+// Contention benchmark: 1 to 128 threads take the same lock over and
+// over, doing a little work inside and outside the critical section.
+// Compares pthread_mutex, the futex mutex, and the queued mutex.
+//
+//   ./lock_bench [seconds_per_run]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <immintrin.h>
+#include <thread>
+
+#include "../src/futex_mutex.h"
+#include "../src/queue_mutex.h"
+
+static pthread_mutex_t pm = PTHREAD_MUTEX_INITIALIZER;
+static futex_mutex_t   fm = FUTEX_MUTEX_INITIALIZER;
+static queue_mutex_t   qm = QUEUE_MUTEX_INITIALIZER;
+
+static void p_lock()   { pthread_mutex_lock(&pm); }
+static void p_unlock() { pthread_mutex_unlock(&pm); }
+static void f_lock()   { futex_mutex_lock(&fm); }
+static void f_unlock() { futex_mutex_unlock(&fm); }
+static void q_lock()   { queue_mutex_lock(&qm); }
+static void q_unlock() { queue_mutex_unlock(&qm); }
+
+static const int work_inside  = 20; // pauses
+static const int work_outside = 100;
+
+static volatile bool stop;
+static volatile uint64_t shared_count __attribute__((aligned(64)));
+
+static void worker(void (*lock)(), void (*unlock)(), uint64_t *n_ops) {
+  uint64_t n = 0;
+  while (!stop) {
+    lock();
+    shared_count++;
+    for (int i = 0; i < work_inside; i++) _mm_pause();
+    unlock();
+    for (int i = 0; i < work_outside; i++) _mm_pause();
+    n++;
+  }
+  *n_ops = n;
+}
+
+static double run(void (*lock)(), void (*unlock)(), int n_threads, double seconds) {
+  stop = false;
+  shared_count = 0;
+  std::thread *x = new std::thread[n_threads];
+  uint64_t *n_ops = new uint64_t[n_threads * 8]; // A cache line each.
+  for (int i = 0; i < n_threads; i++) x[i] = std::thread(worker, lock, unlock, &n_ops[i*8]);
+  struct timespec ts = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+  nanosleep(&ts, NULL);
+  stop = true;
+  uint64_t total = 0;
+  for (int i = 0; i < n_threads; i++) {
+    x[i].join();
+    total += n_ops[i*8];
+  }
+  if (total != shared_count) {
+    fprintf(stderr, "lost updates: %lu ops, count=%lu\n", total, shared_count);
+    abort();
+  }
+  delete [] x;
+  delete [] n_ops;
+  return total / seconds;
+}
+
+int main(int argc, char *argv[]) {
+  double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+  printf("%8s %14s %14s %14s   (lock acquisitions/s)\n", "threads", "pthread", "futex", "queued");
+  for (int n = 1; n <= 128; n *= 2) {
+    double p = run(p_lock, p_unlock, n, seconds);
+    double f = run(f_lock, f_unlock, n, seconds);
+    double q = run(q_lock, q_unlock, n, seconds);
+    printf("%8d %14.0f %14.0f %14.0f\n", n, p, f, q);
+    fflush(stdout);
+  }
+  return 0;
+}
@@ -0,0 +1,229 @@
+#ifdef TESTING
+#include <stdio.h>
+#endif
+
+#include <pthread.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "atomically.h"
+#include "malloc_internal.h"
+#include "thread_block.h"
+
+atomic_site *atomic_sites[max_atomic_sites];
+uint32_t n_atomic_sites = 0;
+__thread atomic_site_counts_block *atomic_site_counts_for_thread = NULL;
+
+static void forget_atomic_site_counts_block() {
+  atomic_site_counts_for_thread = NULL;
+}
+
+// A dead thread's counts stay in its block until the next thread to
+// get the block adds them in.
+static thread_block_pool atomic_site_counts_blocks = THREAD_BLOCK_POOL_INITIALIZER(sizeof(atomic_site_counts_block), forget_atomic_site_counts_block);
+
+atomic_site_counts_block *get_atomic_site_counts_block() {
+  atomic_site_counts_block *b = reinterpret_cast<atomic_site_counts_block*>(thread_block_get(&atomic_site_counts_blocks));
+  atomic_site_counts_for_thread = b;
+  return b;
+}
+
+// Registration happens once per site, so a lock is fine.  Taking the
+// id under the lock means that threads racing to register the same
+// site don't use up ids.
+static lock_t atomic_site_lock = LOCK_INITIALIZER;
+
+uint32_t atomic_site_register(atomic_site *site) {
+  mylock_raii m(&atomic_site_lock);
+  uint32_t id = site->id;
+  if (id != 0) return id; // Someone else registered it while we waited.
+  id = n_atomic_sites + 1;
+  bassert(id < max_atomic_sites);
+  atomic_store(&atomic_sites[id], site);
+  atomic_store(&n_atomic_sites, id);
+  atomic_store(&site->id, id);
+  return id;
+}
+
+void atomic_site_start_probe(atomic_site *site, atomic_site_counts *sc) {
+  __sync_fetch_and_add(&site->n_direct, sc->direct);
+  sc->direct = 0;
+  sc->probing = true;
+}
+
+void atomic_site_end_probe(atomic_site *site, atomic_site_counts *sc, bool committed) {
+  sc->probing = false;
+  if (committed && atomic_load(&site->use_lock)) {
+    atomic_store(&site->use_lock, 0);
+    __sync_fetch_and_add(&site->n_switches, 1);
+  }
+}
+
+static void add_atomic_site_counts(atomic_site *site, atomic_site_counts *sc) {
+  __sync_fetch_and_add(&site->n_calls,     sc->calls);
+  __sync_fetch_and_add(&site->n_aborts,    sc->aborts);
+  __sync_fetch_and_add(&site->n_fallbacks, sc->fallbacks);
+  for (uint32_t c = 0; c < abort_cause_limit; c++) {
+    if (sc->causes[c]) __sync_fetch_and_add(&site->n_causes[c], sc->causes[c]);
+    sc->causes[c] = 0;
+  }
+  if (sc->backoff_cycles) __sync_fetch_and_add(&site->backoff_cycles, sc->backoff_cycles);
+  sc->backoff_cycles = 0;
+}
+
+void atomic_site_end_window(atomic_site *site, atomic_site_counts *sc) {
+  add_atomic_site_counts(site, sc);
+  if (sc->aborts >= atomic_site_aborts_per_call_limit * sc->calls
+      && !atomic_load(&site->use_lock)) {
+    atomic_store(&site->use_lock, 1);
+    __sync_fetch_and_add(&site->n_switches, 1);
+  }
+  sc->calls = 0;
+  sc->aborts = 0;
+  sc->fallbacks = 0;
+}
+
+void flush_atomic_site_counts() {
+  atomic_site_counts_block *b = atomic_site_counts_for_thread;
+  if (b == NULL) return;
+  for (uint32_t i = 1; i <= std::min(atomic_load(&n_atomic_sites), max_atomic_sites-1); i++) {
+    atomic_site *site = atomic_load(&atomic_sites[i]);
+    if (site == NULL) continue;
+    atomic_site_counts *sc = &b->sc[i];
+    // This starts a new window, so the policy decision at the end of
+    // the window looks only at the calls after the flush.
+    add_atomic_site_counts(site, sc);
+    sc->calls = sc->aborts = sc->fallbacks = 0;
+  }
+}
+
+void atomic_site_sum(const atomic_site *site, atomic_site *sum) {
+  memcpy(sum, site, sizeof(*sum));
+  uint32_t id = atomic_load(&site->id);
+  if (id == 0) return;
+  // We don't care if the other threads' counts are slightly stale.
+  for (thread_block *t = thread_block_all(&atomic_site_counts_blocks); t; t = t->next_all) {
+    const atomic_site_counts *sc = &thread_block_data<atomic_site_counts_block>(t)->sc[id];
+    sum->n_calls     += sc->calls;
+    sum->n_aborts    += sc->aborts;
+    sum->n_fallbacks += sc->fallbacks;
+    sum->n_direct    += sc->direct;
+    for (uint32_t c = 0; c < abort_cause_limit; c++) sum->n_causes[c] += sc->causes[c];
+    sum->backoff_cycles += sc->backoff_cycles;
+  }
+}
+
+#ifdef TESTING
+#include <thread>
+
+static atomic_site *test_racing_sites[8];
+
+static void register_test_sites(uint32_t *ids) {
+  for (uint32_t i = 0; i < 8; i++) ids[i] = atomic_site_register(test_racing_sites[i]);
+}
+
+static void test_atomic_site_races() {
+  // Many threads registering the same sites at once use one id per site.
+  static atomic_site sites[8];
+  for (uint32_t i = 0; i < 8; i++) {
+    sites[i].name = "test_atomic_site_races";
+    test_racing_sites[i] = &sites[i];
+  }
+  const int n_threads = 16;
+  uint32_t before = n_atomic_sites;
+  uint32_t ids[n_threads][8];
+  std::thread x[n_threads];
+  for (int t = 0; t < n_threads; t++) x[t] = std::thread(register_test_sites, ids[t]);
+  for (int t = 0; t < n_threads; t++) x[t].join();
+  bassert(n_atomic_sites == before + 8);
+  for (uint32_t i = 0; i < 8; i++) {
+    bassert(sites[i].id > before && sites[i].id <= before + 8);
+    bassert(atomic_sites[sites[i].id] == &sites[i]);
+    for (int t = 0; t < n_threads; t++) bassert(ids[t][i] == sites[i].id);
+  }
+}
+
+static volatile int test_thread_stage = 0;
+
+static void note_calls_and_wait(atomic_site *site) {
+  for (int i = 0; i < 5; i++) atomic_site_note(site, atomic_site_should_elide(site), 1, false);
+  test_thread_stage = 1;
+  while (test_thread_stage != 2) sched_yield();
+}
+
+extern "C" void test_atomic_sites() {
+  test_atomic_site_races();
+
+  atomic_site *site = ATOMIC_SITE("test_atomic_sites");
+  atomic_site_counts *sc = atomic_site_should_elide(site);
+  bassert(site->id != 0 && atomic_sites[site->id] == site);
+  bassert(sc == &atomic_site_counts_for_thread->sc[site->id]);
+
+  // A window of transactions that mostly commit keeps the site eliding.
+  for (uint32_t i = 0; i < atomic_site_window; i++) {
+    bassert(atomic_site_should_elide(site) == sc);
+    atomic_site_note(site, sc, i%2, false);
+  }
+  bassert(site->use_lock == 0);
+  bassert(site->n_calls == atomic_site_window && site->n_aborts == atomic_site_window/2);
+
+  // A window in which everything falls back to the lock switches to the lock.
+  for (uint32_t i = 0; i < atomic_site_window; i++) {
+    bassert(atomic_site_should_elide(site) == sc);
+    atomic_site_note(site, sc, 10, true);
+  }
+  bassert(site->use_lock == 1 && site->n_switches == 1);
+  bassert(site->n_fallbacks == atomic_site_window);
+
+  // Now we go straight to the lock until it's time to probe.
+  for (uint32_t i = 0; i < atomic_site_probe_interval; i++) {
+    bassert(atomic_site_should_elide(site) == NULL);
+  }
+  // A failed probe leaves the site locked.
+  bassert(atomic_site_should_elide(site) == sc && sc->probing);
+  atomic_site_note(site, sc, 10, true);
+  bassert(site->use_lock == 1 && !sc->probing);
+  bassert(site->n_direct == atomic_site_probe_interval);
+  for (uint32_t i = 0; i < atomic_site_probe_interval; i++) {
+    bassert(atomic_site_should_elide(site) == NULL);
+  }
+  // A successful one goes back to eliding.
+  bassert(atomic_site_should_elide(site) == sc);
+  atomic_site_note(site, sc, 0, false);
+  bassert(site->use_lock == 0 && site->n_switches == 2);
+
+  // Aborts are counted by cause, and flushed on demand.
+  bassert(atomic_abort_cause_of(_XABORT_EXPLICIT | (XABORT_LOCK_HELD << 24)) == abort_lock_held);
+  bassert(atomic_abort_cause_of(_XABORT_EXPLICIT | (1 << 24)) == abort_other);
+  bassert(atomic_abort_cause_of(_XABORT_CAPACITY | _XABORT_RETRY) == abort_capacity);
+  bassert(atomic_abort_cause_of(_XABORT_CONFLICT | _XABORT_RETRY) == abort_conflict);
+  bassert(atomic_abort_cause_of(_XABORT_RETRY) == abort_retry);
+  bassert(atomic_abort_cause_of(0) == abort_other);
+  atomic_site_note_abort(sc, _XABORT_CONFLICT | _XABORT_RETRY);
+  atomic_site_note_abort(sc, _XABORT_CONFLICT);
+  atomic_site_note_abort(sc, _XABORT_CAPACITY);
+  atomic_backoff(sc, 3);
+  uint64_t calls = site->n_calls + sc->calls;
+  flush_atomic_site_counts();
+  bassert(site->n_causes[abort_conflict] == 2 && site->n_causes[abort_capacity] == 1 && site->n_causes[abort_retry] == 0);
+  bassert(site->backoff_cycles > 0 && site->n_calls == calls);
+  bassert(sc->calls == 0 && sc->causes[abort_conflict] == 0 && sc->backoff_cycles == 0);
+
+  // The sum includes another thread's partial window, both while the
+  // thread is alive and after it exits.
+  atomic_site sum;
+  test_thread_stage = 0;
+  std::thread t(note_calls_and_wait, site);
+  while (test_thread_stage != 1) sched_yield();
+  atomic_site_sum(site, &sum);
+  bassert(sum.n_calls == site->n_calls + 5 && sum.n_aborts == site->n_aborts + 5);
+  uint64_t calls_before_exit = sum.n_calls;
+  test_thread_stage = 2;
+  t.join();
+  // (The thread may or may not have flushed its counts on the way out.)
+  atomic_site_sum(site, &sum);
+  bassert(sum.n_calls == calls_before_exit);
+  bassert(atomic_load(&atomic_site_counts_blocks.free.value) != NULL);
+}
+#endif
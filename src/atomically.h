@@ -6,20 +6,35 @@
 #include <immintrin.h>
 
 #include "bassert.h"
+#include "latency.h"
 #include "rng.h"
 
 #include <pthread.h>
 #include "futex_mutex.h"
+#include "queue_mutex.h"
 
 union lock_t {
   pthread_mutex_t pt_m __attribute__((aligned(64)));
   futex_mutex_t f_m __attribute((aligned(64)));
+  queue_mutex_t q_m __attribute((aligned(64)));
 };
 
-enum mutex_mode_t { MODE_PTHREAD_MUTEX, MODE_TSX };
+// MODE_LOCKFREE uses compare-and-swap for the hottest critical
+// sections (the cpu and global caches, and popping the large and huge
+// free lists), and pthread mutexes for everything else.
+// MODE_QUEUED is MODE_TSX with a queued (MCS) lock instead of the
+// futex mutex, for when the transactions fall back to the lock.
+enum mutex_mode_t { MODE_PTHREAD_MUTEX, MODE_TSX, MODE_LOCKFREE, MODE_QUEUED };
 
 extern mutex_mode_t mode;
 
+static inline bool mode_elides() {
+  return mode == MODE_TSX || mode == MODE_QUEUED;
+}
+
+#define atomic_load(addr) __atomic_load_n(addr, __ATOMIC_CONSUME)
+#define atomic_store(addr, val) __atomic_store_n(addr, val, __ATOMIC_RELEASE)
+
 // Pthread mutexes are larger than Futex mutexes, and the first two fields
 // get initialized to zero, covering what the Futex needs to be initialized
 // as.  This is highly implementation dependent, but it's hard to change
@@ -27,13 +42,15 @@ extern mutex_mode_t mode;
 // probably pretty safe doing this.
 #define LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER // Pthread Mutex.
 
-// Used only in the case of a Futex.
+// Used only in the case of a Futex or a queued mutex.
 static inline bool mylock_hold(lock_t *l) {
+  if (mode == MODE_QUEUED) return queue_mutex_hold(&l->q_m);
   return futex_mutex_hold(&l->f_m);
 }
 
-// Used only in the case of a Futex.
+// Used only in the case of a Futex or a queued mutex.
 static inline bool mylock_subscribe(lock_t *l) {
+  if (mode == MODE_QUEUED) return queue_mutex_subscribe(&l->q_m);
   return futex_mutex_subscribe(&l->f_m);
 }
 
@@ -44,11 +61,15 @@ public:
   mylock_raii(lock_t *mylock) : mylock(mylock) {
     switch (mode) {
     case MODE_PTHREAD_MUTEX:
+    case MODE_LOCKFREE:
       pthread_mutex_lock(&mylock->pt_m);
       break;
     case MODE_TSX:
       futex_mutex_lock(&mylock->f_m);
       break;
+    case MODE_QUEUED:
+      queue_mutex_lock(&mylock->q_m);
+      break;
     default:
       abort();
     }
@@ -56,11 +77,15 @@ public:
   ~mylock_raii() {
     switch (mode) {
     case MODE_PTHREAD_MUTEX:
+    case MODE_LOCKFREE:
       pthread_mutex_unlock(&mylock->pt_m);
       break;
     case MODE_TSX:
       futex_mutex_unlock(&mylock->f_m);
       break;
+    case MODE_QUEUED:
+      queue_mutex_unlock(&mylock->q_m);
+      break;
     default:
       abort();
     }
@@ -75,43 +100,168 @@ extern bool do_predo;
 extern bool has_tsx;
 #define have_rtm (has_tsx && use_transactions)
 
-//#define DO_FAILED_COUNTS
-#ifdef DO_FAILED_COUNTS
-struct atomic_stats_s {
-  uint64_t atomic_count __attribute__((aligned(64)));
-  uint64_t locked_count;
+// Adaptive elision.  Each call site of atomically() has an
+// atomic_site (made by ATOMIC_SITE("name")).  Each thread counts, for
+// each site, its calls and its aborted transactions.  After every
+// atomic_site_window calls, it adds those counts into the site and, if
+// the transactions aborted too often, sets the site's use_lock, after
+// which calls go straight to the lock instead of burning cycles on
+// transactions that are likely to abort anyway.  Once every
+// atomic_site_probe_interval locked calls, a thread tries a
+// transaction again, and if it commits, the site goes back to eliding.
+//
+// The counts also say why the transactions aborted (see
+// atomic_abort_cause) and how many cycles we spent backing off, so
+// that the stats can show which critical sections need restructuring.
+// They are kept whether or not SUPERMALLOC_STATS is set: they cost
+// nothing on a call whose transaction commits.
+
+enum atomic_abort_cause {
+  abort_conflict,  // Another thread touched our read or write set.
+  abort_capacity,  // The transaction touched too much memory.
+  abort_lock_held, // We aborted ourselves because the lock was held.
+  abort_retry,     // The hardware says a retry might succeed (and it wasn't one of the above).
+  abort_other,     // Interrupts, system calls, page faults, ...
+  abort_cause_limit
 };
-extern struct atomic_stats_s atomic_stats;
 
-struct failed_counts_s {
+static inline atomic_abort_cause atomic_abort_cause_of(unsigned int xr) {
+  if ((xr & _XABORT_EXPLICIT) && _XABORT_CODE(xr) == XABORT_LOCK_HELD) return abort_lock_held;
+  if (xr & _XABORT_CAPACITY) return abort_capacity;
+  if (xr & _XABORT_CONFLICT) return abort_conflict;
+  if (xr & _XABORT_RETRY)    return abort_retry;
+  return abort_other;
+}
+
+struct atomic_site {
   const char *name;
-  unsigned int  code;
-  uint64_t count;
+  uint32_t    id;       // 0 until the site is first used.
+  uint8_t     use_lock; // The policy.
+  // Totals for the stats, updated once per window.
+  uint64_t n_calls __attribute__((aligned(64)));
+  uint64_t n_aborts, n_fallbacks, n_direct, n_switches;
+  uint64_t n_causes[abort_cause_limit];
+  uint64_t backoff_cycles;
 };
-extern lock_t  failed_counts_mutex;
-static const int max_failed_counts = 100;
-extern int    failed_counts_n;
-extern struct failed_counts_s failed_counts [max_failed_counts];
-#endif
+
+#define ATOMIC_SITE(name) ({ static atomic_site site_ = {name, 0, 0, 0, 0, 0, 0, 0, {0}, 0}; &site_; })
+
+struct atomic_site_counts {
+  uint32_t calls, aborts, fallbacks, direct;
+  bool probing;
+  uint32_t causes[abort_cause_limit];
+  uint64_t backoff_cycles;
+};
+
+static const uint32_t max_atomic_sites = 64;
+static const uint32_t atomic_site_window = 64;
+static const uint32_t atomic_site_aborts_per_call_limit = 2;
+static const uint32_t atomic_site_probe_interval = 1024;
+
+extern atomic_site *atomic_sites[max_atomic_sites];
+extern uint32_t n_atomic_sites; // The largest id handed out so far.
+
+// Each thread keeps its counts in a block from a thread_block_pool (see
+// thread_block.h), so that the stats can add in the counts that haven't
+// made it into the sites yet.
+struct atomic_site_counts_block {
+  atomic_site_counts sc[max_atomic_sites];
+};
+extern __thread atomic_site_counts_block *atomic_site_counts_for_thread;
+
+atomic_site_counts_block *get_atomic_site_counts_block();
+// Effect: Give this thread a block, and return it (or NULL if we are
+//  out of memory).
+
+uint32_t atomic_site_register(atomic_site *site);
+// Effect: Give site an id, and return it.
+
+void atomic_site_start_probe(atomic_site *site, atomic_site_counts *sc);
+void atomic_site_end_probe(atomic_site *site, atomic_site_counts *sc, bool committed);
+void atomic_site_end_window(atomic_site *site, atomic_site_counts *sc);
+// Effect: Add this thread's counts for site into the totals, and
+//  decide whether the site should use the lock.
+
+void flush_atomic_site_counts();
+// Effect: Add this thread's counts for all the sites into the totals
+//  (without deciding anything).
+
+void atomic_site_sum(const atomic_site *site, atomic_site *sum);
+// Effect: Set *sum to site's totals plus the counts that every thread
+//  (living or dead) has yet to add in.  The answer may be slightly
+//  stale.
+
+static inline atomic_site_counts *atomic_site_should_elide(atomic_site *site)
+// Effect: Return this thread's counts for site if we should try
+//  transactions (possibly as a probe), or NULL if we should go
+//  straight to the lock.
+{
+  uint32_t id = site->id;
+  if (__builtin_expect(id == 0, 0)) id = atomic_site_register(site);
+  atomic_site_counts_block *b = atomic_site_counts_for_thread;
+  if (__builtin_expect(b == NULL, 0)) {
+    b = get_atomic_site_counts_block();
+    if (b == NULL) return NULL;
+  }
+  atomic_site_counts *sc = &b->sc[id];
+  if (atomic_load(&site->use_lock)) {
+    if (sc->direct < atomic_site_probe_interval) {
+      sc->direct++;
+      return NULL;
+    }
+    atomic_site_start_probe(site, sc);
+  }
+  return sc;
+}
+
+static inline void atomic_site_note(atomic_site *site, atomic_site_counts *sc, uint32_t aborts, bool fell_back)
+// Effect: Count a call that tried transactions.
+{
+  if (__builtin_expect(sc->probing, 0)) atomic_site_end_probe(site, sc, !fell_back);
+  sc->aborts += aborts;
+  sc->fallbacks += fell_back;
+  if (++sc->calls >= atomic_site_window) atomic_site_end_window(site, sc);
+}
+
+static inline void atomic_site_note_abort(atomic_site_counts *sc, unsigned int xr)
+// Effect: Count an aborted transaction by its cause.
+{
+  sc->causes[atomic_abort_cause_of(xr)]++;
+}
+
+static inline void atomic_backoff(atomic_site_counts *sc, int count)
+// Effect: Spin for about 2^count pauses (yielding now and then), and
+//  count the cycles.
+{
+  uint64_t start = rdtsc();
+  //int backoff = (prandnum()%16) << count;
+  for (int i = 1; i < (1<<count); i++) {
+    if (0 == (prandnum()&1023)) {
+      sched_yield();
+    } else {
+      __asm__ volatile("pause");
+    }
+  }
+  sc->backoff_cycles += rdtsc() - start;
+}
 
 //#define LATE_LOCK_SUBSCRIPTION
 
 template<typename ReturnType, typename... Arguments>
 static inline ReturnType atomically(lock_t *mylock,
-				    const char *name __attribute__((unused)),
+				    atomic_site *site,
 			            void (*predo)(Arguments... args),
 				    ReturnType (*fun)(Arguments... args),
 				    Arguments... args) {
-  if (mode == MODE_PTHREAD_MUTEX) {
+  if (!mode_elides()) {
     mylock_raii m(mylock);
     ReturnType r = fun(args...);
     return r;
   }
-#ifdef DO_FAILED_COUNTS
-  __sync_fetch_and_add(&atomic_stats.atomic_count, 1);
-#endif
   unsigned int xr = 0xfffffff2;
-  if (have_rtm) {
+  atomic_site_counts *sc = NULL;
+  uint32_t aborts = 0;
+  if (have_rtm && (sc = atomic_site_should_elide(site))) {
     // Be a little optimistic: try to run the function without the predo if we the lock looks good
     if (mylock_subscribe(mylock) == 0) {
       xr = _xbegin();
@@ -124,8 +274,11 @@ static inline ReturnType atomically(lock_t *mylock,
 	if (mylock_subscribe(mylock)) _xabort(XABORT_LOCK_HELD);
 #endif
 	_xend();
+	atomic_site_note(site, sc, aborts, false);
 	return r;
       }
+      aborts++;
+      atomic_site_note_abort(sc, xr);
     }
 
     int count = 0;
@@ -146,40 +299,22 @@ static inline ReturnType atomically(lock_t *mylock,
 	if (mylock_subscribe(mylock)) _xabort(XABORT_LOCK_HELD);
 #endif
 	_xend();
+	atomic_site_note(site, sc, aborts, false);
 	return r;
-      } else if ((xr & _XABORT_EXPLICIT) && (_XABORT_CODE(xr) == XABORT_LOCK_HELD)) {
+      }
+      aborts++;
+      atomic_site_note_abort(sc, xr);
+      if ((xr & _XABORT_EXPLICIT) && (_XABORT_CODE(xr) == XABORT_LOCK_HELD)) {
 	count = 0; // reset the counter if we had an explicit lock contention abort.
 	continue;
       } else {
 	count++;
-	//int backoff = (prandnum()%16) << count;
-	for (int i = 1; i < (1<<count); i++) {
-	  if (0 == (prandnum()&1023)) {
-	    sched_yield();
-	  } else {
-	    __asm__ volatile("pause");
-	  }
-	}
+	atomic_backoff(sc, count);
       }
     }
   }
   // We finally give up and acquire the lock.
-#ifdef DO_FAILED_COUNTS
-  {
-    mylock_raii m(&failed_counts_mutex);
-    for (int i = 0; i < failed_counts_n; i++) {
-      if (failed_counts[i].name == name && failed_counts[i].code == xr) {
-	failed_counts[i].count++;
-	goto didit;
-      }
-    }
-    bassert(failed_counts_n < max_failed_counts);
-    failed_counts[failed_counts_n++] = (struct failed_counts_s){name, xr, 1};
- didit:;
-  }
-
-   __sync_fetch_and_add(&atomic_stats.locked_count, 1);
-#endif
+  if (sc) atomic_site_note(site, sc, aborts, true);
   if (do_predo) predo(args...);
   mylock_raii mr(mylock);
   ReturnType r = fun(args...);
@@ -189,21 +324,20 @@ static inline ReturnType atomically(lock_t *mylock,
 template<typename ReturnType, typename... Arguments>
 static inline ReturnType atomically2(lock_t *lock0,
 				     lock_t *lock1,
-				     const char *name __attribute__((unused)),
+				     atomic_site *site,
 				     void (*predo)(Arguments... args),
 				     ReturnType (*fun)(Arguments... args),
 				     Arguments... args) {
-  if (mode == MODE_PTHREAD_MUTEX) {
+  if (!mode_elides()) {
     mylock_raii m0(lock0);
     mylock_raii m1(lock1);
     ReturnType r = fun(args...);
     return r;
   }
-#ifdef DO_FAILED_COUNTS
-  __sync_fetch_and_add(&atomic_stats.atomic_count, 1);
-#endif
   unsigned int xr = 0xfffffff2;
-  if (have_rtm) {
+  atomic_site_counts *sc = NULL;
+  uint32_t aborts = 0;
+  if (have_rtm && (sc = atomic_site_should_elide(site))) {
     // Be a little optimistic: try to run the function without the predo if we the lock looks good
     if (mylock_subscribe(lock0) == 0 &&
 	mylock_subscribe(lock1) == 0) {
@@ -217,8 +351,11 @@ static inline ReturnType atomically2(lock_t *lock0,
 	if (mylock_subscribe(lock0) || mylock_subscribe(lock1)) _xabort(XABORT_LOCK_HELD);
 #endif
 	_xend();
+	atomic_site_note(site, sc, aborts, false);
 	return r;
       }
+      aborts++;
+      atomic_site_note_abort(sc, xr);
     }
 
     int count = 0;
@@ -240,40 +377,22 @@ static inline ReturnType atomically2(lock_t *lock0,
 	if (mylock_subscribe(lock0) || mylock_subscribe(lock1)) _xabort(XABORT_LOCK_HELD);
 #endif
 	_xend();
+	atomic_site_note(site, sc, aborts, false);
 	return r;
-      } else if ((xr & _XABORT_EXPLICIT) && (_XABORT_CODE(xr) == XABORT_LOCK_HELD)) {
+      }
+      aborts++;
+      atomic_site_note_abort(sc, xr);
+      if ((xr & _XABORT_EXPLICIT) && (_XABORT_CODE(xr) == XABORT_LOCK_HELD)) {
 	count = 0; // reset the counter if we had an explicit lock contention abort.
 	continue;
       } else {
 	count++;
-	//int backoff = (prandnum()%16) << count;
-	for (int i = 1; i < (1<<count); i++) {
-	  if (0 == (prandnum()&1023)) {
-	    sched_yield();
-	  } else {
-	    __asm__ volatile("pause");
-	  }
-	}
+	atomic_backoff(sc, count);
       }
     }
   }
   // We finally give up and acquire the lock.
-#ifdef DO_FAILED_COUNTS
-  {
-    mylock_raii m(&failed_counts_mutex);
-    for (int i = 0; i < failed_counts_n; i++) {
-      if (failed_counts[i].name == name && failed_counts[i].code == xr) {
-	failed_counts[i].count++;
-	goto didit;
-      }
-    }
-    bassert(failed_counts_n < max_failed_counts);
-    failed_counts[failed_counts_n++] = (struct failed_counts_s){name, xr, 1};
- didit:;
-  }
-
-   __sync_fetch_and_add(&atomic_stats.locked_count, 1);
-#endif
+  if (sc) atomic_site_note(site, sc, aborts, true);
   if (do_predo) predo(args...);
   mylock_raii mr0(lock0);
   mylock_raii mr1(lock1);
@@ -288,9 +407,6 @@ struct lock {
 #endif
 
 
-#define atomic_load(addr) __atomic_load_n(addr, __ATOMIC_CONSUME)
-#define atomic_store(addr, val) __atomic_store_n(addr, val, __ATOMIC_RELEASE)
-
 #define prefetch_read(addr) __builtin_prefetch(addr, 0, 3)
 #define prefetch_write(addr) __builtin_prefetch(addr, 1, 3)
 #define load_and_prefetch_write(addr) ({ __typeof__(*addr) ignore __attribute__((unused)) = atomic_load(addr); prefetch_write(addr); })
@@ -303,4 +419,92 @@ static inline void fetch_and_max(uint64_t * ptr, uint64_t val) {
   }
 }
 
+// A tagged_head is the head of a lock-free stack.  Every pop
+// increments the tag.  Without the tag, a pop could read the head h
+// and h->next, lose the processor while other threads pop h, pop
+// h->next, and push h again, and then successfully swap in the stale
+// h->next (the ABA problem).  With the tag, that compare-and-swap
+// fails.  Pushes don't need to change the tag since they change the
+// value.
+template <typename T>
+struct tagged_head {
+  T        value;
+  uint64_t tag;
+} __attribute__((aligned(16)));
+
+static inline bool cas128(void *p,
+			  uint64_t old_lo, uint64_t old_hi,
+			  uint64_t new_lo, uint64_t new_hi)
+// Effect: Compare and swap 16 aligned bytes.  (We use cmpxchg16b
+//  directly since __sync_bool_compare_and_swap on an __int128 needs
+//  -mcx16.)
+{
+  bool ok;
+  __asm__ __volatile__("lock cmpxchg16b %1"
+		       : "=@ccz"(ok), "+m"(*reinterpret_cast<unsigned __int128*>(p)), "+a"(old_lo), "+d"(old_hi)
+		       : "b"(new_lo), "c"(new_hi)
+		       : "memory");
+  return ok;
+}
+
+template <typename T>
+static inline tagged_head<T> tagged_load(tagged_head<T> *h)
+// Effect: Read the tag and then the value.  The two reads aren't
+//  atomic together, but if another pop comes between them, the tag we
+//  read is stale and our compare-and-swap will fail.
+{
+  tagged_head<T> r;
+  r.tag   = atomic_load(&h->tag);
+  r.value = atomic_load(&h->value);
+  return r;
+}
+
+template <typename T>
+static inline bool tagged_cas(tagged_head<T> *h, tagged_head<T> old_h, tagged_head<T> new_h) {
+  static_assert(sizeof(T) == 8, "tagged_cas swaps a 64-bit value and a 64-bit tag");
+  uint64_t old_v, new_v;
+  __builtin_memcpy(&old_v, &old_h.value, 8);
+  __builtin_memcpy(&new_v, &new_h.value, 8);
+  return cas128(h, old_v, old_h.tag, new_v, new_h.tag);
+}
+
+template <typename T>
+static inline void lockfree_push(tagged_head<T*> *h, T *first, T *last)
+// Effect: Push the list first..last (linked through next) onto h.
+{
+  while (1) {
+    tagged_head<T*> old_h = tagged_load(h);
+    last->next = old_h.value;
+    tagged_head<T*> new_h = {first, old_h.tag};
+    if (tagged_cas(h, old_h, new_h)) return;
+  }
+}
+
+template <typename T>
+static inline T* lockfree_pop(tagged_head<T*> *h)
+// Effect: Pop the first element off h, or return NULL if h is empty.
+// Requires: The elements are never unmapped, since we may read the
+//  next pointer of an element that another thread has already popped.
+{
+  while (1) {
+    tagged_head<T*> old_h = tagged_load(h);
+    if (old_h.value == NULL) return NULL;
+    tagged_head<T*> new_h = {atomic_load(&old_h.value->next), old_h.tag+1};
+    if (tagged_cas(h, old_h, new_h)) return old_h.value;
+  }
+}
+
+template <class T>
+static inline T* lockfree_pop_all(tagged_head<T*> *h)
+// Effect: Empty h, and return its first element (which is still
+//  linked to the rest through next), or NULL if h was empty.
+{
+  while (1) {
+    tagged_head<T*> old_h = tagged_load(h);
+    if (old_h.value == NULL) return NULL;
+    tagged_head<T*> new_h = {NULL, old_h.tag+1};
+    if (tagged_cas(h, old_h, new_h)) return old_h.value;
+  }
+}
+
 #endif // ATOMICALLY_H
@@ -1,9 +1,14 @@
 #include <stdio.h>
+#include <sys/mman.h>
 
 #include "malloc_internal.h"
 #include "atomically.h"
 #include "generated_constants.h"
 #include "bassert.h"
+#include "latency.h"
+#include "rseq.h"
+#include "stats.h"
+#include "topology.h"
 
 #ifdef ENABLE_LOG_CHECKING
 static void clog_command(char command, const void *ptr, size_t size);
@@ -38,24 +43,108 @@ int getcpu(void) {
 
 #elif 1
 static __thread uint32_t cached_cpu, cached_cpu_count;
-static uint32_t getcpu(void) {
+uint32_t getcpu(void) {
   if ((cached_cpu_count++)%16  ==0) { cached_cpu = sched_getcpu(); if (0) printf("cpu=%d\n", cached_cpu); }
   return cached_cpu;
 }
 #elif 0
-static uint32_t getcpu(void) {
+uint32_t getcpu(void) {
   return sched_getcpu();
 }
 #endif
 
-struct linked_list {
-  linked_list *next;
+// The thread cache keeps the objects for each bin in magazines:
+// fixed-capacity arrays of pointers.  Popping an object doesn't have
+// to read a link out of the (possibly cold) object, and pushing one
+// doesn't have to write into it.  A thread hands a magazine to the cpu
+// and global caches whole, and those caches keep lists of magazines
+// linked through magazine::next.
+//
+// A magazine is a page.  The magazines are carved out of chunks that
+// are never unmapped (which lockfree_pop() requires of free_magazines).
+
+static const uint32_t magazine_capacity = 510;
+
+struct magazine {
+  magazine *next;
+  uint64_t n;   // The objects are objects[0] to objects[n-1].
+  void *objects[magazine_capacity];
 };
+static_assert(sizeof(magazine) == 4096, "a magazine is a page");
+
+static tagged_head<magazine*> free_magazines;
+
+static magazine* get_magazine()
+// Effect: Return an empty magazine, or NULL if we are out of memory.
+{
+  while (1) {
+    magazine *m = lockfree_pop(&free_magazines);
+    if (m) {
+      m->n = 0;
+      return m;
+    }
+    magazine *mags = reinterpret_cast<magazine*>(mmap_chunk_aligned_block(1));
+    if (mags == NULL) return NULL;
+    const size_t n_mags = chunksize / sizeof(magazine);
+    for (size_t i = 1; i+1 < n_mags; i++) {
+      mags[i].next = &mags[i+1];
+    }
+    lockfree_push(&free_magazines, &mags[1], &mags[n_mags-1]);
+    mags[0].n = 0;
+    return &mags[0];
+  }
+}
+
+static void put_magazine(magazine *m) {
+  lockfree_push(&free_magazines, m, m);
+}
+
+static const uint64_t per_cpu_cache_bytecount_limit = 1024*1024;
+static const uint64_t thread_cache_bytecount_limit = 2*4096;
+
+static inline uint64_t magazine_limit(uint64_t siz)
+// Effect: Return how many objects of size siz a thread's magazine
+//  starts out holding.  As with the linked lists we used to have, we
+//  keep adding objects until there are at least
+//  thread_cache_bytecount_limit bytes.
+{
+  uint64_t n = ceil(thread_cache_bytecount_limit, siz);
+  return n < magazine_capacity ? n : magazine_capacity;
+}
+
+// The limit for each bin of each thread cache adapts: a bin that keeps
+// missing (more than once between sweeps) doubles its limit, up to
+// thread_cache_max_bytecount, and a bin that sees no misses or
+// overflows between two sweeps halves it, and gives back what it is
+// holding beyond the new limit.  The clock is the number of misses and
+// overflows the thread has had, so a thread that is just hitting in
+// its cache pays nothing for this.
+
+static const uint64_t thread_cache_max_bytecount = 16*thread_cache_bytecount_limit;
+static const uint64_t thread_cache_sweep_interval = 256;
+
+static inline uint32_t max_magazine_limit(uint64_t siz) {
+  uint64_t n = thread_cache_max_bytecount / siz;
+  if (n < 1) return 1;
+  return n < magazine_capacity ? n : magazine_capacity;
+}
+
+static void free_objects(binnumber_t bin, void **objects, uint32_t n)
+// Effect: Really free n objects.  Small objects are freed a folio at a time.
+{
+  if (bin < first_large_bin_number) {
+    small_free_batch(bin, objects, n);
+  } else {
+    for (uint32_t i = 0; i < n; i++) {
+      large_free(objects[i]);
+    }
+  }
+}
 
 struct cached_objects {
-  uint64_t bytecount __attribute__((aligned(32)));
-  linked_list *head;
-  linked_list *tail;
+  uint64_t bytecount __attribute__((aligned(32))); // The total size of the objects in the magazines.
+  magazine *head;
+  magazine *tail;
 };
 
 static const cached_objects empty_cached_objects = {0, NULL, NULL};
@@ -65,36 +154,55 @@ struct CacheForBin {
 } __attribute__((aligned(64)));  // it's OK if the cached objects are on the same cacheline as the lock, but we don't want the cached objects to cross a cache boundary.  Since the CacheForBin has gotten to be 48 bytes, we might as well just align the struct to the cache.
 
 struct CacheForCpu {
-#ifdef ENABLE_STATS
-  uint64_t attempt_count, success_count;
-#endif
   CacheForBin cb[first_huge_bin_number];
 } __attribute__((aligned(64)));
 
-static __thread CacheForCpu cache_for_thread ;
+// Each thread has two magazines per bin (either may be NULL until we
+// first need it).  We push and pop the loaded one, and when it's full
+// (or empty) we swap it with the previous one if that helps, before
+// going to the cpu cache.
+struct ThreadCacheForBin {
+  magazine *loaded;
+  magazine *previous;
+  uint32_t limit;      // How many objects a magazine holds.  0 until we first need the magazines.
+  uint64_t last_event; // The clock of the last miss or overflow.
+};
+
+struct CacheForThread {
+  uint64_t clock;      // The number of misses and overflows so far.
+  uint64_t last_sweep; // The clock when we last shrank the idle bins.
+  uint64_t hits;       // Thread cache hits not yet added to the counters (when use_stats).
+  ThreadCacheForBin cb[first_huge_bin_number];
+};
+
+static __thread CacheForThread cache_for_thread ;
+
+// Used only when use_threadcache is false, to start a new magazine in the cpu cache.
+static __thread magazine *spare_magazine;
 
 static __thread bool cache_inited = false;
 static pthread_key_t key;
 static pthread_once_t once_control = PTHREAD_ONCE_INIT;
 void cache_destructor(void* v) {
   bassert(v == (void*)(&cache_inited));
+  flush_thread_cache_stats();
+  flush_atomic_site_counts();
   //unsigned long recovered = 0;
   for (binnumber_t bin = 0 ; bin < first_huge_bin_number; bin++) {
+    magazine **mags[2] = {&cache_for_thread.cb[bin].loaded, &cache_for_thread.cb[bin].previous};
     for (int j = 0; j < 2; j++) {
-      //recovered += cache_for_thread.cb[bin].co[j].bytecount;
-      linked_list *next;
-      for (linked_list *head = cache_for_thread.cb[bin].co[j].head;
-	   head;
-	   head = next) {
-	next = head->next;
-	if (bin < first_large_bin_number) {
-	  small_free(head);
-	} else {
-	  large_free(head);
-	}
-      }
+      magazine *m = *mags[j];
+      if (m == NULL) continue;
+      //recovered += m->n * bin_2_size(bin);
+      free_objects(bin, m->objects, m->n);
+      put_magazine(m);
+      *mags[j] = NULL;
     }
   }
+  if (spare_magazine) {
+    put_magazine(spare_magazine);
+    spare_magazine = NULL;
+  }
   //printf("recovered %ld\n", recovered);
 }
 static void make_key() {
@@ -109,45 +217,271 @@ void init_cache() {
   pthread_setspecific(key, &cache_inited);
 }
 
-static CacheForCpu cache_for_cpu[cpulimit];
+// The per-cpu caches are indexed by cpu slot (see topology.h), and
+// are allocated by init_cpu_caches() once we know how many slots there
+// are.
+
+static CacheForCpu *cache_for_cpu;
+
+static lock_t (*cpu_cache_locks)[first_huge_bin_number]; // these locks could less aligned, as long as the the first one for each cpu is aligned.
 
-static const int global_cache_depth = 8;
+// When the thread has an rseq area (see rseq.h) the cpu cache is
+// different: each cpu has, for each bin, a stack of lists of
+// magazines, which the threads running on that cpu push and pop with
+// restartable sequences instead of locks.  The locked cache_for_cpu
+// is used only by threads that couldn't register an rseq area.
 
-struct GlobalCacheForBin {
-  uint8_t n_nonempty_caches __attribute__((aligned(64)));
-  cached_objects co[global_cache_depth];
+static const uint64_t rseq_cache_depth = 16; // 16 thread magazines is up to 128KiB per bin per cpu.
+
+struct RseqCacheForBin {
+  uint64_t n __attribute__((aligned(64)));
+  cached_objects co[rseq_cache_depth];
 };
 
-struct GlobalCache {
-  GlobalCacheForBin gb[first_huge_bin_number];
+struct RseqCacheForCpu {
+  RseqCacheForBin cb[first_huge_bin_number];
 };
 
-static GlobalCache global_cache;
+static RseqCacheForCpu *rseq_cache_for_cpu;
 
-static const uint64_t per_cpu_cache_bytecount_limit = 1024*1024;
-static const uint64_t thread_cache_bytecount_limit = 2*4096;
+static_assert(sizeof(cached_objects) == 32, "rseq_stack_push32 copies 32-byte records");
+
+// The global cache is a lock-free stack of batches for each bin, so
+// that moving a list between a cpu cache and the global cache holds
+// at most the one cpu cache lock.  In MODE_LOCKFREE, threads without
+// an rseq area use a cpu cache made of lock-free stacks of batches
+// too.  (When use_threadcache is false, the cpu cache is still the
+// locked one, with pthread mutexes.)
+//
+// A batch is a list of magazines, held in a batch_node.  The
+// batch_nodes are carved out of chunks that are never unmapped, which
+// lockfree_pop() requires.
+
+struct batch_node {
+  batch_node *next;
+  cached_objects co;
+};
+
+struct BatchStack {
+  tagged_head<batch_node*> head __attribute__((aligned(64)));
+  uint64_t n; // The number of batches in the stack, plus pushes in progress.
+};
+
+struct LockfreeCacheForCpu {
+  BatchStack cb[first_huge_bin_number];
+};
 
-lock_t cpu_cache_locks[cpulimit][first_huge_bin_number]; // these locks could less aligned, as long as the the first one for each cpu is aligned.
-lock_t global_cache_locks[first_huge_bin_number];
+static LockfreeCacheForCpu *lockfree_cache_for_cpu;
+static const uint64_t global_cache_depth = 8;
+static BatchStack global_cache[first_huge_bin_number];
+static tagged_head<batch_node*> free_batch_nodes;
+
+void init_cpu_caches() {
+  // One block holds all the per-cpu caches.  Like chunk_infos, it's
+  // mapped with MAP_NORESERVE, so the pages of the slots that no thread
+  // ever runs on are never touched.
+  size_t locked_size   = ceil(n_cpu_slots*sizeof(*cache_for_cpu),          pagesize)*pagesize;
+  size_t locks_size    = ceil(n_cpu_slots*sizeof(*cpu_cache_locks),        pagesize)*pagesize;
+  size_t rseq_size     = ceil(n_cpu_slots*sizeof(*rseq_cache_for_cpu),     pagesize)*pagesize;
+  size_t lockfree_size = ceil(n_cpu_slots*sizeof(*lockfree_cache_for_cpu), pagesize)*pagesize;
+  char *p = reinterpret_cast<char*>(mmap_chunk_aligned_block(ceil(locked_size + locks_size + rseq_size + lockfree_size, chunksize)));
+  bassert(p);
+  cache_for_cpu          = reinterpret_cast<CacheForCpu*>(p);
+  cpu_cache_locks        = reinterpret_cast<lock_t(*)[first_huge_bin_number]>(p + locked_size);
+  rseq_cache_for_cpu     = reinterpret_cast<RseqCacheForCpu*>(p + locked_size + locks_size);
+  lockfree_cache_for_cpu = reinterpret_cast<LockfreeCacheForCpu*>(p + locked_size + locks_size + rseq_size);
+}
+
+static batch_node* get_batch_node() {
+  while (1) {
+    batch_node *b = lockfree_pop(&free_batch_nodes);
+    if (b) return b;
+    batch_node *nodes = reinterpret_cast<batch_node*>(mmap_chunk_aligned_block(1));
+    if (nodes == NULL) return NULL;
+    const size_t n_nodes = chunksize / sizeof(batch_node);
+    for (size_t i = 1; i+1 < n_nodes; i++) {
+      nodes[i].next = &nodes[i+1];
+    }
+    lockfree_push(&free_batch_nodes, &nodes[1], &nodes[n_nodes-1]);
+    return &nodes[0];
+  }
+}
 
-static void* try_get_cached(cached_objects *co, uint64_t siz) {
-  linked_list *result = co->head;
-  if (result) {
-    co->bytecount -= siz;
-    co->head = result->next;
-    // tail is the right value.
+static bool batch_stack_push(BatchStack *s, cached_objects *co, uint64_t limit)
+// Effect: Push co onto s, unless s already has limit batches in it.
+//  Return false if we didn't push.
+{
+  if (__sync_fetch_and_add(&s->n, 1) >= limit) {
+    __sync_fetch_and_sub(&s->n, 1);
+    return false;
   }
+  batch_node *b = get_batch_node();
+  if (b == NULL) {
+    __sync_fetch_and_sub(&s->n, 1);
+    return false;
+  }
+  b->co = *co;
+  lockfree_push(&s->head, b, b);
+  return true;
+}
+
+static bool batch_stack_pop(BatchStack *s, cached_objects *co)
+// Effect: Pop a batch off s into co.  Return false if s is empty.
+{
+  if (atomic_load(&s->head.value) == NULL) return false;
+  batch_node *b = lockfree_pop(&s->head);
+  if (b == NULL) return false;
+  *co = b->co;
+  __sync_fetch_and_sub(&s->n, 1);
+  lockfree_push(&free_batch_nodes, b, b);
+  return true;
+}
+
+static bool global_batch_push(binnumber_t bin, cached_objects *co) {
+  return batch_stack_push(&global_cache[bin], co, global_cache_depth);
+}
+
+static bool global_batch_pop(binnumber_t bin, cached_objects *co) {
+  return batch_stack_pop(&global_cache[bin], co);
+}
+
+// On a machine with more than one last-level cache domain (see
+// topology.h), there is a tier between the cpu caches and the global
+// cache: each domain has a stack of batches for each bin.  A cpu
+// whose cache overflows pushes onto its domain's stack, and a cpu that
+// misses pops its domain's stack and then steals from the other cpus
+// in its domain, before going to the global cache, so that the objects
+// don't have to cross to another socket.  (With a single domain, the
+// global cache is the domain cache, and we skip this tier.)
+
+static const uint64_t llc_cache_depth = 8;
+static const uint32_t llc_steal_limit = 8; // How many sibling cpu caches a miss looks at.
+// Unlike the cpu caches, these are indexed by domain, not by slot, and
+// there are at most llc_domain_limit domains (more share), so a static
+// array does.
+static BatchStack llc_cache[llc_domain_limit][first_huge_bin_number];
+
+static inline BatchStack* llc_cache_for(uint32_t cpu, binnumber_t bin) {
+  if (n_llc_domains <= 1) return NULL;
+  return &llc_cache[llc_domain_of_slot[cpu]][bin];
+}
+
+static bool shared_batch_push(uint32_t cpu, binnumber_t bin, cached_objects *co)
+// Effect: Push co onto cpu's llc domain cache, or else onto the global
+//  cache.  Return false if both are full.
+{
+  BatchStack *l = llc_cache_for(cpu, bin);
+  if (l && batch_stack_push(l, co, llc_cache_depth)) return true;
+  return global_batch_push(bin, co);
+}
+
+static bool shared_cache_full(uint32_t cpu, binnumber_t bin) {
+  BatchStack *l = llc_cache_for(cpu, bin);
+  if (l && atomic_load(&l->n) < llc_cache_depth) return false;
+  return atomic_load(&global_cache[bin].n) >= global_cache_depth;
+}
+
+static inline void* pop_magazine(magazine *m) {
+  uint64_t n = m->n - 1;
+  void *result = m->objects[n];
+  m->n = n;
+  if (n > 0) prefetch_write(m->objects[n-1]); // The next object we will hand out.
   return result;
 }
-static void* try_get_cached_both(CacheForBin *cb,
-				 uint64_t siz) {
-  void *r = try_get_cached(&cb->co[0], siz);
-  if (r) return r;
-  return try_get_cached(&cb->co[1], siz);
+
+static void* try_get_cached_both(ThreadCacheForBin *tc)
+// Effect: Pop an object from the loaded magazine, or else from the
+//  previous one (which then becomes the loaded one).  Return NULL if
+//  both are empty.
+{
+  magazine *m = tc->loaded;
+  if (m && m->n > 0) return pop_magazine(m);
+  magazine *p = tc->previous;
+  if (p && p->n > 0) {
+    tc->previous = m;
+    tc->loaded   = p;
+    return pop_magazine(p);
+  }
+  return NULL;
+}
+
+static void install_magazine(ThreadCacheForBin *tc, magazine *m)
+// Effect: Make m (which is nonempty) the loaded magazine.  The thread
+//  cache is empty, so the old loaded magazine (if any) goes back to the
+//  pool of free magazines.
+{
+  bassert(m->n > 0);
+  if (tc->loaded) {
+    bassert(tc->loaded->n == 0);
+    put_magazine(tc->loaded);
+  }
+  tc->loaded = m;
+}
+
+static void trim_thread_cache(binnumber_t bin, ThreadCacheForBin *tc)
+// Effect: Really free whatever the thread cache for bin holds beyond
+//  its limit, and give back the magazines it no longer needs.
+{
+  magazine *p = tc->previous;
+  if (p) {
+    free_objects(bin, p->objects, p->n);
+    put_magazine(p);
+    tc->previous = NULL;
+  }
+  magazine *m = tc->loaded;
+  if (m) {
+    if (m->n > tc->limit) {
+      free_objects(bin, &m->objects[tc->limit], m->n - tc->limit);
+      m->n = tc->limit;
+    }
+    if (m->n == 0) {
+      put_magazine(m);
+      tc->loaded = NULL;
+    }
+  }
+}
+
+static void sweep_thread_cache() {
+  CacheForThread *ct = &cache_for_thread;
+  for (binnumber_t bin = 0; bin < first_huge_bin_number; bin++) {
+    ThreadCacheForBin *tc = &ct->cb[bin];
+    if (tc->limit > 0 && tc->last_event <= ct->last_sweep) {
+      if (tc->limit > 1) tc->limit /= 2;
+      trim_thread_cache(bin, tc);
+    }
+  }
+  ct->last_sweep = ct->clock;
+}
+
+static void note_thread_cache_event(binnumber_t bin, uint64_t siz, bool miss)
+// Effect: The thread cache for bin missed (if miss) or overflowed.
+//  Adjust its limit, and every so often shrink the idle bins.
+{
+  CacheForThread *ct = &cache_for_thread;
+  ThreadCacheForBin *tc = &ct->cb[bin];
+  if (tc->limit == 0) {
+    tc->limit = magazine_limit(siz);
+  } else if (miss && tc->last_event > ct->last_sweep) {
+    uint32_t max = max_magazine_limit(siz);
+    tc->limit = 2*tc->limit < max ? 2*tc->limit : max;
+  }
+  tc->last_event = ++ct->clock;
+  if (ct->clock - ct->last_sweep >= thread_cache_sweep_interval) {
+    sweep_thread_cache();
+  }
 }
 
 #ifdef TESTING
-static void assert_equal(const cached_objects *co, uint64_t bytecount, linked_list *h, linked_list *t) {
+static magazine* test_magazine(uint64_t n, void *base) {
+  magazine *m = get_magazine();
+  bassert(m);
+  for (uint64_t i = 0; i < n; i++) m->objects[i] = reinterpret_cast<char*>(base) + i;
+  m->n = n;
+  m->next = NULL;
+  return m;
+}
+
+static void assert_equal(const cached_objects *co, uint64_t bytecount, magazine *h, magazine *t) {
   bassert(co->bytecount == bytecount);
   bassert(co->head == h);
   if (co->head) {
@@ -157,87 +491,105 @@ static void assert_equal(const cached_objects *co, uint64_t bytecount, linked_li
 
 static void test_try_get_cached_both()
 {
+  char base[2];
   {
-    CacheForBin c = {{{0,NULL,NULL},{0,NULL,NULL}}};
-    void *r = try_get_cached_both(&c, 1024);
+    ThreadCacheForBin c = {NULL, NULL, 0, 0};
+    void *r = try_get_cached_both(&c);
     bassert(r==NULL);
   }
   {
-    linked_list item1 = {NULL};
-    linked_list item2 = {&item1};
-    CacheForBin c = {{{2048, &item2, &item1},{0,NULL,NULL}}};
-    void *r = try_get_cached_both(&c, 1024);
-    bassert(r = reinterpret_cast<void*>(&item2));
-    assert_equal(&c.co[0], 1024, &item1, &item1);
-    assert_equal(&c.co[1], 0, NULL, NULL);
-    void *r2 = try_get_cached_both(&c, 1024);
-    bassert(r2 = reinterpret_cast<void*>(&item1));
-    assert_equal(&c.co[0], 0, NULL, NULL);
-    assert_equal(&c.co[1], 0, NULL, NULL);
+    magazine *m1 = test_magazine(2, base);
+    ThreadCacheForBin c = {m1, NULL, 0, 0};
+    void *r = try_get_cached_both(&c);
+    bassert(r == &base[1]);
+    bassert(m1->n == 1);
+    void *r2 = try_get_cached_both(&c);
+    bassert(r2 == &base[0]);
+    bassert(m1->n == 0);
+    bassert(try_get_cached_both(&c) == NULL);
+    put_magazine(m1);
   }
   {
-    linked_list item1 = {NULL};
-    linked_list item2 = {&item1};
-    CacheForBin c = {{{0,NULL,NULL},{2048, &item2, &item1}}};
-    void *r = try_get_cached_both(&c, 1024);
-    bassert(r = reinterpret_cast<void*>(&item2));
-    assert_equal(&c.co[1], 1024, &item1, &item1);
-    assert_equal(&c.co[0], 0, NULL, NULL);
-    void *r2 = try_get_cached_both(&c, 1024);
-    bassert(r2 = reinterpret_cast<void*>(&item1));
-    assert_equal(&c.co[1], 0, NULL, NULL);
-    assert_equal(&c.co[0], 0, NULL, NULL);
+    magazine *m1 = test_magazine(0, base);
+    magazine *m2 = test_magazine(2, base);
+    ThreadCacheForBin c = {m1, m2, 0, 0};
+    void *r = try_get_cached_both(&c);
+    bassert(r == &base[1]);
+    bassert(c.loaded == m2 && c.previous == m1);
+    bassert(m2->n == 1);
+    void *r2 = try_get_cached_both(&c);
+    bassert(r2 == &base[0]);
+    bassert(c.loaded == m2 && c.previous == m1);
+    bassert(try_get_cached_both(&c) == NULL);
+    put_magazine(m1);
+    put_magazine(m2);
   }
 }
 #endif
 
-static void predo_remove_a_cache_from_cpu(CacheForBin *cc,
-					  cached_objects *co) {
-  prefetch_write(cc);
-  prefetch_write(co);
+static void predo_remove_a_magazine_from_cpu(CacheForBin *cc,
+					     uint64_t siz __attribute__((unused))) {
+  for (int i = 0; i < 2; i++) {
+    magazine *m = atomic_load(&cc->co[i].head);
+    if (m) {
+      prefetch_write(&cc->co[i]);
+      load_and_prefetch_write(&m->next);
+      return;
+    }
+  }
 }
 
-static ignore do_remove_a_cache_from_cpu(CacheForBin *cc,
-				       cached_objects *co) {
-  if (cc->co[0].head) {
-    *co = cc->co[0];
-    cc->co[0] = empty_cached_objects;
-  } else if (cc->co[1].head) {
-    *co = cc->co[1];
-    cc->co[1] = empty_cached_objects;
-  } else {
-    *co = empty_cached_objects;
+static magazine* do_remove_a_magazine_from_cpu(CacheForBin *cc,
+					       uint64_t siz)
+// Effect: Unlink the first magazine from the cpu cache and return it,
+//  or return NULL if the cpu cache is empty.
+{
+  for (int i = 0; i < 2; i++) {
+    magazine *m = cc->co[i].head;
+    if (m) {
+      magazine *next = m->next;
+      cc->co[i].head = next;
+      if (next == NULL) cc->co[i].tail = NULL;
+      cc->co[i].bytecount -= m->n * siz;
+      return m;
+    }
   }
-  return true;
+  return NULL;
 }
 
 #ifdef TESTING
-static void test_remove_a_cache_from_cpu() {
-  linked_list item1= {NULL};
-  linked_list item2= {NULL};
-  CacheForBin c = {{{1024, &item1, &item1}, {1024, &item2, &item2}}};
-  cached_objects co = {0,NULL,NULL};
+static void test_remove_a_magazine_from_cpu() {
+  char base[3];
+  magazine *m1 = test_magazine(1, base);
+  magazine *m2 = test_magazine(2, base);
+  magazine *m3 = test_magazine(3, base);
+  m1->next = m2;
+  CacheForBin c = {{{3*1024, m1, m2}, {3*1024, m3, m3}}};
   {
-    predo_remove_a_cache_from_cpu(&c, &co);
-    do_remove_a_cache_from_cpu(&c, &co);
-    assert_equal(&co, 1024, &item1, &item1);
-    assert_equal(&c.co[0],  0, NULL, NULL);
-    assert_equal(&c.co[1], 1024, &item2, &item2);
+    predo_remove_a_magazine_from_cpu(&c, 1024);
+    bassert(do_remove_a_magazine_from_cpu(&c, 1024) == m1);
+    assert_equal(&c.co[0], 2*1024, m2, m2);
+    assert_equal(&c.co[1], 3*1024, m3, m3);
+  }
+  {
+    predo_remove_a_magazine_from_cpu(&c, 1024);
+    bassert(do_remove_a_magazine_from_cpu(&c, 1024) == m2);
+    assert_equal(&c.co[0], 0, NULL, NULL);
+    assert_equal(&c.co[1], 3*1024, m3, m3);
   }
   {
-    predo_remove_a_cache_from_cpu(&c, &co);
-    do_remove_a_cache_from_cpu(&c, &co);
-    assert_equal(&co, 1024, &item2, &item2);
-    assert_equal(&c.co[0],  0, NULL, NULL);
-    assert_equal(&c.co[1],  0, NULL, NULL);
+    predo_remove_a_magazine_from_cpu(&c, 1024);
+    bassert(do_remove_a_magazine_from_cpu(&c, 1024) == m3);
+    assert_equal(&c.co[0], 0, NULL, NULL);
+    assert_equal(&c.co[1], 0, NULL, NULL);
   }
   {
-    predo_remove_a_cache_from_cpu(&c, &co);
-    do_remove_a_cache_from_cpu(&c, &co);
-    assert_equal(&co,       0, NULL, NULL);
-    assert_equal(&c.co[0],  0, NULL, NULL);
-    assert_equal(&c.co[1],  0, NULL, NULL);
+    predo_remove_a_magazine_from_cpu(&c, 1024);
+    bassert(do_remove_a_magazine_from_cpu(&c, 1024) == NULL);
   }
+  put_magazine(m1);
+  put_magazine(m2);
+  put_magazine(m3);
 }
 #endif
 
@@ -283,100 +635,87 @@ static ignore do_add_a_cache_to_cpu(CacheForBin *cc,
 
 #ifdef TESTING
 static void test_add_a_cache_to_cpu() {
+  char base[1];
+  magazine *m = test_magazine(1, base);
+  magazine *m2 = test_magazine(1, base);
+  magazine *m3 = test_magazine(1, base);
   {
     CacheForBin cc = {{{0,0,0},{0,0,0}}};
-    linked_list item={0};
-    cached_objects co = {1024, &item, &item};
+    cached_objects co = {1024, m, m};
     do_add_a_cache_to_cpu(&cc, &co);
-    assert_equal(&cc.co[0], 1024, &item, &item);
+    assert_equal(&cc.co[0], 1024, m, m);
     assert_equal(&cc.co[1],0,0,0);
-    bassert(item.next == 0);
+    bassert(m->next == 0);
   }
   {
-    linked_list item2;
-    CacheForBin cc = {{{2048, &item2, &item2},{0,0,0}}};
-    linked_list item;
-    cached_objects co = {1024,&item,&item};
+    CacheForBin cc = {{{2048, m2, m2},{0,0,0}}};
+    cached_objects co = {1024,m,m};
     do_add_a_cache_to_cpu(&cc, &co);
-    assert_equal(&cc.co[0], 2048, &item2, &item2);
-    assert_equal(&cc.co[1], 1024, &item,  &item);
+    assert_equal(&cc.co[0], 2048, m2, m2);
+    assert_equal(&cc.co[1], 1024, m,  m);
   }
   {
-    linked_list item3={0};
-    linked_list item2={0};
-    CacheForBin cc = {{{1024, &item2, &item2},{2048,&item3,&item3}}};
-    linked_list item={0};
-    cached_objects co = {1024,&item,&item};
+    CacheForBin cc = {{{1024, m2, m2},{2048,m3,m3}}};
+    cached_objects co = {1024,m,m};
     do_add_a_cache_to_cpu(&cc, &co);
-    assert_equal(&cc.co[0], 2048, &item2, &item);
-    bassert(item2.next  == &item);
-    bassert(item.next == NULL);
-    assert_equal(&cc.co[1], 2048, &item3,  &item3);
-    bassert(item3.next == NULL);
+    assert_equal(&cc.co[0], 2048, m2, m);
+    bassert(m2->next  == m);
+    bassert(m->next == NULL);
+    assert_equal(&cc.co[1], 2048, m3,  m3);
+    bassert(m3->next == NULL);
   }
+  m2->next = NULL;
   {
-    linked_list item3={0};
-    linked_list item2={0};
-    CacheForBin cc = {{{2048,&item3,&item3},{1024, &item2, &item2}}};
-    linked_list item={0};
-    cached_objects co = {1024,&item,&item};
+    CacheForBin cc = {{{2048,m3,m3},{1024, m2, m2}}};
+    cached_objects co = {1024,m,m};
     do_add_a_cache_to_cpu(&cc, &co);
-    assert_equal(&cc.co[1], 2048, &item2, &item);
-    bassert(item2.next  == &item);
-    bassert(item.next == NULL);
-    assert_equal(&cc.co[0], 2048, &item3,  &item3);
-    bassert(item3.next == NULL);
+    assert_equal(&cc.co[1], 2048, m2, m);
+    bassert(m2->next  == m);
+    bassert(m->next == NULL);
+    assert_equal(&cc.co[0], 2048, m3,  m3);
+    bassert(m3->next == NULL);
   }
+  put_magazine(m);
+  put_magazine(m2);
+  put_magazine(m3);
 }
 #endif
 
-static void collect_objects_for_thread_cache(cached_objects *objects,
-					     cached_objects *first_n_objects,
-					     uint64_t siz) {
-  if (objects->bytecount < thread_cache_bytecount_limit) {
-    *first_n_objects = *objects;
-    *objects = empty_cached_objects;
-  } else {
-    first_n_objects->head = objects->head;
-    linked_list *ptr =      objects->head;
-    uint64_t bytecount = siz;
-    while (bytecount < thread_cache_bytecount_limit) {
-      bytecount += siz;
-      bassert(ptr);
-      ptr = ptr->next;
-    }
-    bassert(ptr);
-    first_n_objects->tail = ptr;
-    first_n_objects->bytecount = bytecount;
-    objects->head = ptr->next;
-    if (objects->head == NULL) objects->tail = NULL;
-    objects->bytecount -= bytecount;
-    ptr->next = NULL;
-  }
-}
-
 __attribute__((optimize("unroll-loops")))
-static void predo_fetch_one_from_cpu(CacheForBin *cc, size_t siz __attribute__((unused))) {
+static void predo_fetch_one_from_cpu(CacheForBin *cc,
+				     size_t siz __attribute__((unused)),
+				     magazine **emptied __attribute__((unused))) {
   for (int i = 0; i < 2 ; i++) {
-    linked_list *result = cc->co[i].head;
-    if (result) {
+    magazine *m = cc->co[i].head;
+    if (m) {
       prefetch_write(&cc->co[i]);
-      prefetch_read(result);
+      uint64_t n = atomic_load(&m->n);
+      prefetch_write(&m->n);
+      if (n > 0) prefetch_read(&m->objects[n-1]);
       return;
     }
   }
 }
 
 __attribute__((optimize("unroll-loops")))
-static void* do_fetch_one_from_cpu(CacheForBin *cc, size_t siz) {
+static void* do_fetch_one_from_cpu(CacheForBin *cc, size_t siz, magazine **emptied)
+// Effect: Pop one object out of the first magazine in the cpu cache.
+//  If that empties the magazine, unlink it and return it in *emptied.
+{
   for (int i = 0; i < 2; i++) {
-    linked_list *result = cc->co[i].head;
-    if (result) {
+    magazine *m = cc->co[i].head;
+    if (m) {
       cc->co[i].bytecount -= siz;
-      linked_list *next = result->next;
-      cc->co[i].head = next;
-      if (next == NULL) {
-	cc->co[i].tail = NULL;
+      uint64_t n = m->n - 1;
+      void *result = m->objects[n];
+      m->n = n;
+      if (n == 0) {
+	magazine *next = m->next;
+	cc->co[i].head = next;
+	if (next == NULL) {
+	  cc->co[i].tail = NULL;
+	}
+	*emptied = m;
       }
       return result;
     }
@@ -389,461 +728,664 @@ static void* try_get_cpu_cached(int processor,
 				uint64_t siz) {
 
   if (use_threadcache) {
-    // Implementation notes:
-    // 1) Atomically remove stuff from the cpu cache.
-    // 2) Grab thread_cache_bytecount_limit worth of items of that list (which can be done without holding a lock, see we will have exclusive ownership of that list)
-    // 3) Atomically put everything else back into the cpu cache (this requires maintaining tail in the cpu cache after all)
-    // 4) Return the one object.
-
+    // Take a whole magazine from the cpu cache, make it the thread's
+    // loaded magazine, and return one object out of it.
     init_cache();
-    CacheForBin *tc = &cache_for_thread.cb[bin];
-    CacheForBin *cc = &cache_for_cpu[processor].cb[bin];
-
-    // Step 1
-    cached_objects my_co;
-    atomically(&cpu_cache_locks[processor][bin], "remove_a_cache_from_cpu",
-	       predo_remove_a_cache_from_cpu,
-	       do_remove_a_cache_from_cpu,
-	       cc,
-	       &my_co);
-
-    linked_list *result = my_co.head;
-    if (!result) return NULL;
-    my_co.head = result->next;
-    my_co.bytecount -= siz;
-
-    // Step 2 (this doesn't need to be atomic)
-    {
-      cached_objects first_n_objects;
-      collect_objects_for_thread_cache(&my_co, &first_n_objects, siz);
-    
-      if (tc->co[0].head == NULL) {
-	tc->co[0] = first_n_objects;
-      } else {
-	bassert(tc->co[1].head == NULL);
-	tc->co[1] = first_n_objects;
-      }
-    }
-    
-    if (my_co.head != NULL) {
-      // This one doesn't have the option of failing.  It's possible that
-      // the CPU cache got really big while we were doing that stuff, but
-      // there's no point of trying to put stuff into the global cache (it
-      // might be full too) and the prospect of freeing all those objects
-      // sounds unappetizingly slow.  Just let the cpu cache get too big.
-      atomically(&cpu_cache_locks[processor][bin], "add_a_cache_to_cpu",
-		 predo_add_a_cache_to_cpu,
-		 do_add_a_cache_to_cpu,
-		 cc,
-		 &my_co);
-    }
-    return result;
+    magazine *m = atomically(&cpu_cache_locks[processor][bin], ATOMIC_SITE("remove_a_magazine_from_cpu"),
+			     predo_remove_a_magazine_from_cpu,
+			     do_remove_a_magazine_from_cpu,
+			     &cache_for_cpu[processor].cb[bin],
+			     siz);
+    if (m == NULL) return NULL;
+    ThreadCacheForBin *tc = &cache_for_thread.cb[bin];
+    install_magazine(tc, m);
+    return pop_magazine(m);
   } else {
     // no threadcache.  Just try to get one thing out of the cpu cache and return it.
-    return atomically(&cpu_cache_locks[processor][bin], "fetch_one_from_cpu",
-		      predo_fetch_one_from_cpu,
-		      do_fetch_one_from_cpu,
-		      &cache_for_cpu[processor].cb[bin],
-		      siz);
-  }
-}
-
-static void predo_get_global_cached(CacheForBin *cb,
-				    GlobalCacheForBin *gb,
-				    uint64_t siz __attribute__((unused))) {
-  uint8_t n = atomic_load(&gb->n_nonempty_caches);
-  if (n > 0) {
-    linked_list *result = gb->co[n-1].head;
-    if (result == NULL) return;  // result could be NULL if we see things in an invalid state
-    linked_list *result_next = result->next;
-    if (result_next) {
-      cached_objects *co0 = &cb->co[0];
-      cached_objects *co1 = &cb->co[1];
-      cached_objects *co  = co0->bytecount < co1->bytecount ? co0 : co1;
-      if (co->head == NULL) {
-	linked_list *ignore __attribute__((unused)) = atomic_load(&gb->co[n-1].tail);
-	prefetch_write(&co->tail); // already fetched as part of co->head
-      } else {
-	load_and_prefetch_write(&gb->co[n-1].tail->next);
-      }
-      prefetch_write(&co->head);
-    }
-    prefetch_write(&gb->n_nonempty_caches);
+    magazine *emptied = NULL;
+    void *result = atomically(&cpu_cache_locks[processor][bin], ATOMIC_SITE("fetch_one_from_cpu"),
+			      predo_fetch_one_from_cpu,
+			      do_fetch_one_from_cpu,
+			      &cache_for_cpu[processor].cb[bin],
+			      siz,
+			      &emptied);
+    if (emptied) put_magazine(emptied);
+    return result;
   }
 }
 
+static void* use_shared_list(int processor,
+			     binnumber_t bin,
+			     uint64_t siz,
+			     cached_objects *co_in)
+// Effect: We popped the list of magazines co_in off the llc domain or
+//  global cache.  With a thread cache, the first magazine becomes the
+//  thread's loaded magazine; the rest go onto the cpu cache, and then
+//  we get an object out of the cpu cache.
+{
+  cached_objects co = *co_in;
+  magazine *m = NULL;
+  if (use_threadcache) {
+    m = co.head;
+    co.head = m->next;
+    co.bytecount -= m->n * siz;
+  }
+  if (co.head) {
+    atomically(&cpu_cache_locks[processor][bin], ATOMIC_SITE("add_a_cache_to_cpu"),
+	       predo_add_a_cache_to_cpu,
+	       do_add_a_cache_to_cpu,
+	       &cache_for_cpu[processor].cb[bin],
+	       &co);
+  }
+  if (m) {
+    install_magazine(&cache_for_thread.cb[bin], m);
+    return pop_magazine(m);
+  }
+  return try_get_cpu_cached(processor, bin, siz);
+}
 
-static void* do_get_global_cached(CacheForBin *cb,
-				  GlobalCacheForBin *gb,
-				  uint64_t siz) {
-  int n = gb->n_nonempty_caches;
-  if (n > 0) {
-    linked_list *result = gb->co[n-1].head;
-    linked_list *result_next = result->next;
-    if (result_next) {
-      // if there was only one result in the list, then don't modify the cpu cache.
-      cached_objects *co0 = &cb->co[0];
-      cached_objects *co1 = &cb->co[1];
-      cached_objects *co  = co0->bytecount < co1->bytecount ? co0 : co1;
+static void* try_steal_from_siblings(int processor,
+				     binnumber_t bin,
+				     uint64_t siz)
+// Effect: Get an object out of the locked cpu cache of another cpu in
+//  our llc domain.  We peek at a sibling's cache before taking its
+//  lock, so empty siblings cost a cache miss apiece.
+{
+  if (n_llc_domains <= 1) return NULL;
+  uint32_t s = llc_next_sibling[processor];
+  for (uint32_t i = 0; i < llc_steal_limit && s != static_cast<uint32_t>(processor); i++, s = llc_next_sibling[s]) {
+    CacheForBin *cc = &cache_for_cpu[s].cb[bin];
+    if (atomic_load(&cc->co[0].head) == NULL && atomic_load(&cc->co[1].head) == NULL) continue;
+    void *result = try_get_cpu_cached(s, bin, siz);
+    if (result) return result;
+  }
+  return NULL;
+}
 
-      linked_list *co_head = co->head;
-      if (co_head == NULL) {
-	co->tail = gb->co[n-1].tail;
-      } else {
-	gb->co[n-1].tail->next = co_head;
-      }
-      co->head = result_next;
-      co->bytecount = gb->co[n-1].bytecount - siz;
+static void* try_get_shared_cached(int processor,
+				   binnumber_t bin,
+				   uint64_t siz)
+// Effect: Get an object from our llc domain's cache, or a sibling
+//  cpu's cache, or else the global cache.
+{
+  cached_objects co;
+  BatchStack *l = llc_cache_for(processor, bin);
+  if (l && batch_stack_pop(l, &co)) return use_shared_list(processor, bin, siz, &co);
+  void *result = try_steal_from_siblings(processor, bin, siz);
+  if (result) return result;
+  if (global_batch_pop(bin, &co)) return use_shared_list(processor, bin, siz, &co);
+  return NULL;
+}
+
+static bool rseq_push_cached(rseq_abi *r, binnumber_t bin, cached_objects *co)
+// Effect: Push co onto the rseq cache of the cpu we are running on.
+//  Return false if that cache is full.
+{
+  while (1) {
+    uint32_t cpu = rseq_cpu_start(r);
+    int32_t slot = exact_cpu_slot(cpu); // Two cpus can't share an rseq cache.
+    if (slot < 0) return false;
+    RseqCacheForBin *rb = &rseq_cache_for_cpu[slot].cb[bin];
+    int result = rseq_stack_push32(r, cpu, &rb->n, rseq_cache_depth, rb->co, co);
+    if (result >= 0) return result == 0;
+    // We were preempted or migrated, so go around and find out which cpu we are on now.
+  }
+}
+
+static bool rseq_pop_cached(rseq_abi *r, binnumber_t bin, cached_objects *co)
+// Effect: Pop a list of magazines off the rseq cache of the cpu we are
+//  running on into co.  Return false if that cache is empty.
+{
+  while (1) {
+    uint32_t cpu = rseq_cpu_start(r);
+    int32_t slot = exact_cpu_slot(cpu); // Two cpus can't share an rseq cache.
+    if (slot < 0) return false;
+    RseqCacheForBin *rb = &rseq_cache_for_cpu[slot].cb[bin];
+    int result = rseq_stack_pop32(r, cpu, &rb->n, rb->co, co);
+    if (result >= 0) return result == 0;
+  }
+}
+
+static bool cpu_batch_push(rseq_abi *r, binnumber_t bin, cached_objects *co)
+// Effect: Push co onto the rseq cache (if r is non-NULL) or the
+//  lock-free cache of this cpu.  Return false if that cache is full.
+{
+  if (r) return rseq_push_cached(r, bin, co);
+  return batch_stack_push(&lockfree_cache_for_cpu[cpu_slot(getcpu())].cb[bin], co, rseq_cache_depth);
+}
+
+static bool cpu_batch_pop(rseq_abi *r, binnumber_t bin, cached_objects *co) {
+  if (r) return rseq_pop_cached(r, bin, co);
+  return batch_stack_pop(&lockfree_cache_for_cpu[cpu_slot(getcpu())].cb[bin], co);
+}
+
+static void* fill_thread_cache_from_batch(rseq_abi *r,
+					  binnumber_t bin,
+					  cached_objects *co,
+					  uint64_t siz)
+// Effect: We own the nonempty list of magazines co, and the thread
+//  cache for bin is empty.  Make the first magazine the loaded one,
+//  push the rest back onto the cpu cache (or, if that is full, the llc
+//  domain cache or the global cache), and return an object.
+{
+  ThreadCacheForBin *tc = &cache_for_thread.cb[bin];
+  magazine *m = co->head;
+  co->head = m->next;
+  co->bytecount -= m->n * siz;
+  install_magazine(tc, m);
+  if (co->head != NULL
+      && !cpu_batch_push(r, bin, co)
+      && !shared_batch_push(cpu_slot(r ? rseq_cpu_start(r) : getcpu()), bin, co)) {
+    // The cpu cache filled up while we had the list (or we migrated
+    // to a full cpu), and so did the shared caches.  Only now do the
+    // objects go back to the underlying allocator.
+    for (magazine *rest = co->head, *next; rest; rest = next) {
+      next = rest->next;
+      free_objects(bin, rest->objects, rest->n);
+      put_magazine(rest);
     }
-    gb->n_nonempty_caches = n-1;
-    return result;
+  }
+  return pop_magazine(m);
+}
+
+static bool steal_batch_from_siblings(uint32_t cpu, binnumber_t bin, cached_objects *co)
+// Effect: Pop a batch off the lock-free cpu cache of another cpu in
+//  cpu's llc domain.  (A thread can't pop another cpu's rseq cache,
+//  so threads with rseq areas don't steal.)
+{
+  if (n_llc_domains <= 1) return false;
+  uint32_t s = llc_next_sibling[cpu];
+  for (uint32_t i = 0; i < llc_steal_limit && s != cpu; i++, s = llc_next_sibling[s]) {
+    if (batch_stack_pop(&lockfree_cache_for_cpu[s].cb[bin], co)) return true;
+  }
+  return false;
+}
+
+static void* try_get_batch_cached(rseq_abi *r,
+				  binnumber_t bin,
+				  uint64_t siz,
+				  latency_path *path)
+// Effect: Get an object from this cpu's rseq or lock-free cache, or
+//  else from the llc domain cache (or a sibling cpu) or the global
+//  cache, refilling the thread cache along the way.  Set *path to
+//  say which.
+{
+  cached_objects co;
+  if (cpu_batch_pop(r, bin, &co)) {
+    *path = latency_malloc_cpu_cache;
+    return fill_thread_cache_from_batch(r, bin, &co, siz);
+  }
+  uint32_t cpu = cpu_slot(r ? rseq_cpu_start(r) : getcpu());
+  BatchStack *l = llc_cache_for(cpu, bin);
+  if ((l && batch_stack_pop(l, &co))
+      || (r == NULL && steal_batch_from_siblings(cpu, bin, &co))
+      || global_batch_pop(bin, &co)) {
+    *path = latency_malloc_shared_cache;
+    return fill_thread_cache_from_batch(r, bin, &co, siz);
+  }
+  return NULL;
+}
+
+static void* underlying_malloc(binnumber_t bin, uint64_t siz) {
+  if (bin < first_large_bin_number) {
+    return small_malloc(bin);
   } else {
-    return 0;
+    return large_malloc(siz);
   }
 }
 
-static void* try_get_global_cached(int processor,
-				   binnumber_t bin,
-				   uint64_t siz) {
-  // Try moving stuff from a global cache to a cpu cache.  Grab one of the objects while we are there.
-  return atomically2(&global_cache_locks[bin], &cpu_cache_locks[processor][bin], "get_global_cached",
-		     predo_get_global_cached,
-		     do_get_global_cached,
-		     &cache_for_cpu[processor].cb[bin],
-		     &global_cache.gb[bin],
-		     siz);
-}
-
-#ifdef ENABLE_STATS
-uint64_t global_cache_attempt_count = 0;
-uint64_t global_cache_success_count = 0;
-#endif
+static void* refill_thread_cache_from_small_malloc(binnumber_t bin)
+// Effect: The thread cache for bin is empty, and so are the cpu and
+//  global caches.  Fill the loaded magazine out of small_malloc in one
+//  go (rather than taking the small_malloc lock again on every miss),
+//  and return one of the objects.
+{
+  ThreadCacheForBin *tc = &cache_for_thread.cb[bin];
+  if (tc->loaded == NULL) {
+    tc->loaded = get_magazine();
+    if (tc->loaded == NULL) return NULL;
+  }
+  magazine *m = tc->loaded;
+  bassert(m->n == 0);
+  uint32_t n_got = small_malloc_batch(bin, tc->limit, m->objects);
+  if (n_got == 0) return NULL;
+  m->n = n_got;
+  return pop_magazine(m);
+}
+
+static const uint64_t thread_cache_hits_per_flush = 1024;
+
+static void note_thread_cache_hit()
+// Effect: Count a thread cache hit.  Hits are the commonest event, so
+//  we count them in the thread and add them to the (per-cpu) counters
+//  in batches.
+{
+  if (++cache_for_thread.hits >= thread_cache_hits_per_flush) flush_thread_cache_stats();
+}
+
+void flush_thread_cache_stats() {
+  if (cache_for_thread.hits == 0) return;
+  counter_add(counter_thread_cache_hits, cache_for_thread.hits);
+  cache_for_thread.hits = 0;
+}
+
+static void note_cache_tier_stats(latency_path path, bool freeing)
+// Effect: Count the cpu and shared cache hits and misses of a malloc
+//  (or free) that went through the rseq or lock-free caches and ended
+//  up on path.
+{
+  if (__builtin_expect(!use_stats, 1)) return;
+  if (path == (freeing ? latency_free_cpu_cache : latency_malloc_cpu_cache)) {
+    counter_add(freeing ? counter_cpu_cache_free_hits : counter_cpu_cache_hits, 1);
+    return;
+  }
+  counter_add(freeing ? counter_cpu_cache_free_misses : counter_cpu_cache_misses, 1);
+  if (path == (freeing ? latency_free_shared_cache : latency_malloc_shared_cache)) {
+    counter_add(freeing ? counter_shared_cache_free_hits : counter_shared_cache_hits, 1);
+  } else {
+    counter_add(freeing ? counter_shared_cache_free_misses : counter_shared_cache_misses, 1);
+  }
+}
 
 void* cached_malloc(binnumber_t bin)
 // Effect: Try the thread cache first.  Otherwise try the cpu cache
-//   (move several things from the cpu cache to the thread cache if we
-//   can do it efficiently), otherwise try the global cache (move a
-//   whole chunk from the global cache to the cpu cache).
+//   (move a magazine from the cpu cache to the thread cache), otherwise
+//   try the global cache (move a whole list of magazines from the
+//   global cache to the cpu cache).
 {
   bassert(bin < first_huge_bin_number);
   uint64_t siz = bin_2_size(bin);
+  uint64_t start = latency_start();
+  latency_path underlying_path = bin < first_large_bin_number ? latency_malloc_small : latency_malloc_large;
 
   if (use_threadcache) {
     init_cache();
-#ifdef ENABLE_STATS
-    cache_for_thread.attempt_count++;
-#endif
-    void *result = try_get_cached_both(&cache_for_thread.cb[bin],
-				       siz);
+    void *result = try_get_cached_both(&cache_for_thread.cb[bin]);
     if (result) {
-#ifdef ENABLE_STATS
-      cache_for_thread.success_count++;
-#endif
+      if (__builtin_expect(use_stats, 0)) note_thread_cache_hit();
+      clog_command('a', result, siz);
+      note_latency(latency_malloc_thread_cache, start);
+      return result;
+    }
+    stat_add(counter_thread_cache_misses, 1);
+    note_thread_cache_event(bin, siz, true);
+
+    rseq_abi *r = rseq_current_area();
+    if (r || mode == MODE_LOCKFREE) {
+      // The cpu cache needs no locks, since we have restartable sequences (or compare-and-swap).
+      latency_path path = underlying_path;
+      result = try_get_batch_cached(r, bin, siz, &path);
+      if (result == NULL) {
+	result = (bin < first_large_bin_number)
+	  ? refill_thread_cache_from_small_malloc(bin)
+	  : underlying_malloc(bin, siz);
+      }
+      note_cache_tier_stats(path, false);
       clog_command('a', result, siz);
+      note_latency(path, start);
       return result;
     }
   }
 
   // Still must access the cache atomically even though it's per processor.
-  int p = getcpu() % cpulimit;
-#ifdef ENABLE_STATS
-  __sync_fetch_and_add(&cache_for_cpu[p].attempt_count, 1);
-#endif
+  int p = cpu_slot(getcpu());
 
   {
     void *result = try_get_cpu_cached(p, bin, siz);
     if (result) {
-#ifdef ENABLE_STATS
-      __sync_fetch_and_add(&cache_for_cpu[p].success_count, 1);
-#endif
+      stat_add(counter_cpu_cache_hits, 1);
       clog_command('a', result, siz);
+      note_latency(latency_malloc_cpu_cache, start);
       return result;
     }
+    stat_add(counter_cpu_cache_misses, 1);
   }
 
   {
-#ifdef ENABLE_STATS
-    __sync_fetch_and_add(&global_cache_attempt_count, 1);
-#endif
-    void *result = try_get_global_cached(p, bin, siz);
+    void *result = try_get_shared_cached(p, bin, siz);
     if (result) {
-#ifdef ENABLE_STATS
-      __sync_fetch_and_add(&global_cache_success_count, 1);
-#endif
+      stat_add(counter_shared_cache_hits, 1);
       clog_command('a', result, siz);
+      note_latency(latency_malloc_shared_cache, start);
       return result;
     }
+    stat_add(counter_shared_cache_misses, 1);
   }
     
   // Didn't get a result.  Use the underlying alloc
-  if (bin < first_large_bin_number) {
-    void *result = small_malloc(bin);
-    clog_command('a', result, siz);
-    return result;
-  } else {
-    void *result = large_malloc(siz);
-    clog_command('a', result, siz);
-    return result;
-  }
+  void *result = (use_threadcache && bin < first_large_bin_number)
+    ? refill_thread_cache_from_small_malloc(bin)
+    : underlying_malloc(bin, siz);
+  clog_command('a', result, siz);
+  note_latency(underlying_path, start);
+  return result;
 }
 
 // This is not called atomically, it's only operating on thread cache
-static bool try_put_cached(linked_list *obj, cached_objects *co, uint64_t size, uint64_t cache_size) {
-  uint64_t bc = co->bytecount;
-  if (bc < cache_size) {
-    linked_list *h = co->head;
-    obj->next = h;
-    if (h == NULL) {
-      co->bytecount = size;
-      co->head = obj;
-      co->tail = obj;
-    } else {
-      co->bytecount = bc+size;
-      co->head = obj;
-      // tail is already correct.
-    }
+static bool try_put_cached_both(void *obj,
+				ThreadCacheForBin *tc,
+				uint64_t siz)
+// Effect: Push obj onto the loaded magazine, or else onto the previous
+//  one (which then becomes the loaded one).  Return false if both are
+//  full.
+{
+  magazine *m = tc->loaded;
+  if (m == NULL) {
+    m = tc->loaded = get_magazine();
+    if (m == NULL) return false;
+    if (tc->limit == 0) tc->limit = magazine_limit(siz);
+  }
+  uint64_t limit = tc->limit;
+  if (m->n < limit) {
+    m->objects[m->n++] = obj;
     return true;
-  } else {
-    return false;
   }
-}
-
-// This is not called atomically, it's only operating on thread cache
-static bool try_put_cached_both(linked_list *obj,
-				CacheForBin *cb,
-				uint64_t size,
-				uint64_t cache_size) {
-  if (try_put_cached(obj, &cb->co[0], size, cache_size)) return true;
-  if (try_put_cached(obj, &cb->co[1], size, cache_size)) return true;
-  return false;
-}
-
-static bool predo_try_put_into_cpu_cache_part(linked_list *obj,
-					      cached_objects *tco,
-					      cached_objects *cco) {
-  uint64_t old_cco_bytecount = cco->bytecount;
-  if (old_cco_bytecount < per_cpu_cache_bytecount_limit) {
-    obj->next = tco->head; // obj is private to the thread at this point, so we can write to it.
-    prefetch_write(tco->tail);
-    prefetch_write(tco);
-    prefetch_write(cco);
+  magazine *p = tc->previous;
+  if (p == NULL) {
+    p = tc->previous = get_magazine();
+    if (p == NULL) return false;
+  }
+  if (p->n < limit) {
+    tc->previous = m;
+    tc->loaded   = p;
+    p->objects[p->n++] = obj;
     return true;
   }
   return false;
 }
 
-static void predo_put_into_cpu_cache(linked_list *obj,
-				     cached_objects *tco,
+static void predo_put_into_cpu_cache(magazine *m,
 				     CacheForBin *cc,
 				     uint64_t siz __attribute__((unused))) {
-  if (predo_try_put_into_cpu_cache_part(obj, tco, &cc->co[0])) return;
-  if (predo_try_put_into_cpu_cache_part(obj, tco, &cc->co[1])) return;
-  return;
-}
-
-static bool try_put_into_cpu_cache_part(linked_list *obj,
-					cached_objects *tco,
-					cached_objects *cco,
-					uint64_t siz) {
-  uint64_t old_cco_bytecount = cco->bytecount;
-  linked_list *old_cco_head  = cco->head;
-  if (old_cco_bytecount < per_cpu_cache_bytecount_limit) {
-    obj->next = tco->head;
-
-    bassert(tco->tail != NULL);
-    tco->tail->next = old_cco_head;
-
-    cco->bytecount = old_cco_bytecount + tco->bytecount + siz ;
-    cco->head      = obj;
-    if (!old_cco_head) cco->tail = tco->tail;
-
-    tco->bytecount = 0;
-    tco->head = NULL;
-    tco->tail = NULL;                                  // The tail can be left undefined if the head is NULL.
-    
-    return true;
+  for (int i = 0; i < 2; i++) {
+    if (atomic_load(&cc->co[i].bytecount) < per_cpu_cache_bytecount_limit) {
+      m->next = cc->co[i].head; // m is private to the thread at this point, so we can write to it.
+      prefetch_write(&cc->co[i]);
+      return;
+    }
   }
-  return false;
 }
 
-static bool do_put_into_cpu_cache(linked_list *obj,
-				  cached_objects *tco,
+static bool do_put_into_cpu_cache(magazine *m,
 				  CacheForBin *cc,
-				  uint64_t siz) {
-  // Always move stuff from 
-  if (try_put_into_cpu_cache_part(obj, tco, &cc->co[0], siz)) return true;
-  if (try_put_into_cpu_cache_part(obj, tco, &cc->co[1], siz)) return true;
+				  uint64_t siz)
+// Effect: If the cpu cache has room, push the magazine m onto it.
+{
+  for (int i = 0; i < 2; i++) {
+    cached_objects *cco = &cc->co[i];
+    uint64_t old_cco_bytecount = cco->bytecount;
+    if (old_cco_bytecount < per_cpu_cache_bytecount_limit) {
+      magazine *old_cco_head = cco->head;
+      m->next = old_cco_head;
+      cco->bytecount = old_cco_bytecount + m->n * siz;
+      cco->head      = m;
+      if (!old_cco_head) cco->tail = m;
+      return true;
+    }
+  }
   return false;
 }
 
 __attribute__((optimize("unroll-loops")))
-static void predo_put_one_into_cpu_cache(linked_list *obj,
+static void predo_put_one_into_cpu_cache(void *obj __attribute__((unused)),
 					 CacheForBin *cc,
-					 uint64_t siz __attribute__((unused))) {
+					 uint64_t siz __attribute__((unused)),
+					 magazine **spare) {
   for (int i = 0; i < 2; i++) {
     uint64_t old_bytecount = cc->co[i].bytecount;
     if (old_bytecount < per_cpu_cache_bytecount_limit) {
-      linked_list *old_head = cc->co[i].head;
-      obj->next = old_head; // obj is private, so we can write to it.
-      prefetch_write(&cc->co[i].bytecount);
+      prefetch_write(&cc->co[i]);
+      magazine *h = atomic_load(&cc->co[i].head);
+      if (h) {
+	uint64_t n = atomic_load(&h->n);
+	prefetch_write(&h->n);
+	if (n < magazine_capacity) prefetch_write(&h->objects[n]);
+      } else if (*spare) {
+	prefetch_write(*spare);
+      }
       return;
     }
   }
 }
 
 __attribute__((optimize("unroll-loops")))
-static bool do_put_one_into_cpu_cache(linked_list *obj,
+static bool do_put_one_into_cpu_cache(void *obj,
 				      CacheForBin *cc,
-				      uint64_t siz) {
+				      uint64_t siz,
+				      magazine **spare)
+// Effect: Push obj onto the first magazine in the cpu cache.  If that
+//  is full, start a new magazine with *spare (and set *spare to NULL).
+{
   for (int i = 0; i < 2; i++) {
     uint64_t old_bytecount = cc->co[i].bytecount;
     if (old_bytecount < per_cpu_cache_bytecount_limit) {
-      linked_list *old_head = cc->co[i].head;
-      if (old_head == NULL) {
-	cc->co[i].tail = obj;
+      magazine *old_head = cc->co[i].head;
+      if (old_head && old_head->n < magazine_capacity) {
+	old_head->objects[old_head->n++] = obj;
+      } else {
+	magazine *m = *spare;
+	if (m == NULL) return false;
+	*spare = NULL;
+	m->n = 1;
+	m->objects[0] = obj;
+	m->next = old_head;
+	if (old_head == NULL) {
+	  cc->co[i].tail = m;
+	}
+	cc->co[i].head = m;
       }
-      cc->co[i].head = obj;
       cc->co[i].bytecount = old_bytecount + siz;
-      obj->next = old_head;
       return true;
     }
   }
   return false;
 }
 
-static bool try_put_into_cpu_cache(linked_list *obj,
+static bool try_put_into_cpu_cache(void *obj,
 				   int processor,
 				   binnumber_t bin,
 				   uint64_t siz)
-// Effect: Move obj and stuff from a threadcache into a cpu cache, if the cpu has space.
-// Requires: the threadcache has stuff in it.
+// Effect: Move the loaded magazine into a cpu cache, if the cpu has
+//  space, and then put obj into a new loaded magazine.
+// Requires: the thread cache is full.
 {
   if (use_threadcache) {
     init_cache();
-    return atomically(&cpu_cache_locks[processor][bin], "put_into_cpu_cache",
-		      predo_put_into_cpu_cache,
-		      do_put_into_cpu_cache,
-		      obj,
-		      &cache_for_thread.cb[bin].co[0], // always move from bin 0
-		      &cache_for_cpu[processor].cb[bin],
-		      siz);
+    ThreadCacheForBin *tc = &cache_for_thread.cb[bin];
+    magazine *fresh = get_magazine();
+    if (fresh == NULL) return false;
+    if (!atomically(&cpu_cache_locks[processor][bin], ATOMIC_SITE("put_into_cpu_cache"),
+		    predo_put_into_cpu_cache,
+		    do_put_into_cpu_cache,
+		    tc->loaded,
+		    &cache_for_cpu[processor].cb[bin],
+		    siz)) {
+      put_magazine(fresh);
+      return false;
+    }
+    fresh->objects[0] = obj;
+    fresh->n = 1;
+    tc->loaded = fresh;
+    return true;
   } else {
-    return atomically(&cpu_cache_locks[processor][bin],  "put_one_into_cpu_cache",
+    if (spare_magazine == NULL) {
+      init_cache();
+      spare_magazine = get_magazine();
+    }
+    return atomically(&cpu_cache_locks[processor][bin],  ATOMIC_SITE("put_one_into_cpu_cache"),
 		      predo_put_one_into_cpu_cache,
 		      do_put_one_into_cpu_cache,
 		      obj,
 		      &cache_for_cpu[processor].cb[bin],
-		      siz);
+		      siz,
+		      &spare_magazine);
   }
 }
 
-static void predo_put_into_global_cache(linked_list *obj,
-					CacheForBin *cb,
-					GlobalCacheForBin *gb,
-					uint64_t siz __attribute__((unused))) {
-  uint8_t gnum = atomic_load(&gb->n_nonempty_caches);
-  uint64_t old_bytecount = atomic_load(&cb->co[0].bytecount);
-  if (gnum < global_cache_depth && old_bytecount >= per_cpu_cache_bytecount_limit) {
-    obj->next = cb->co[0].head; // obj->next is private, so we can write to it.
-    uint64_t ignore __attribute__((unused)) = atomic_load(&gb->co[gnum].bytecount);
-    prefetch_write(&gb->co[gnum]);
+static void predo_remove_full_cache_from_cpu(CacheForBin *cb,
+					     cached_objects *co) {
+  if (atomic_load(&cb->co[0].bytecount) >= per_cpu_cache_bytecount_limit) {
     prefetch_write(&cb->co[0]);
-    prefetch_write(&gb->n_nonempty_caches);
+    prefetch_write(co);
   }
 }
 
-static bool do_put_into_global_cache(linked_list *obj,
-				     CacheForBin *cb,
-				     GlobalCacheForBin *gb,
-				     uint64_t siz)
-// Effect: if the first cpu cache is full and there's a free global cache, then move the first cpu cache and the object into the global cache.
+static bool do_remove_full_cache_from_cpu(CacheForBin *cb,
+					  cached_objects *co)
+// Effect: If the first cpu cache is full, move it into co.
 {
-  uint8_t gnum = gb->n_nonempty_caches;
-  uint64_t old_bytecount = cb->co[0].bytecount;
-  if (gnum < global_cache_depth && old_bytecount >= per_cpu_cache_bytecount_limit) {
-
-    obj->next = cb->co[0].head;
-
-    gb->co[gnum].bytecount = old_bytecount + siz;
-    gb->co[gnum].head = obj;
-    gb->co[gnum].tail = cb->co[0].tail;
-
-    gb->n_nonempty_caches = gnum+1;
-
-    cb->co[0].bytecount = 0;
-    cb->co[0].head = NULL;
-    cb->co[0].tail = NULL;                  // The tail can be left undefined if the head is NULL.
+  if (cb->co[0].bytecount >= per_cpu_cache_bytecount_limit) {
+    *co = cb->co[0];
+    cb->co[0] = empty_cached_objects;
     return true;
   }
   return false;
 }
 
-static bool try_put_into_global_cache(linked_list *obj,
+static bool try_put_into_shared_cache(void *obj,
 				      int processor,
 				      binnumber_t bin,
-				      uint64_t siz) {
-  return atomically2(&global_cache_locks[bin], &cpu_cache_locks[processor][bin], "put_into_global_cache",
-		     predo_put_into_global_cache,
-		     do_put_into_global_cache,
-		     obj,
-		     &cache_for_cpu[processor].cb[bin],
-		     &global_cache.gb[bin],
-		     siz);
+				      uint64_t siz)
+// Effect: Make room in the cpu cache by moving its first list of
+//  magazines into the llc domain cache or the global cache, and then
+//  try the cpu cache again.
+{
+  if (shared_cache_full(processor, bin)) return false;
+  CacheForBin *cb = &cache_for_cpu[processor].cb[bin];
+  cached_objects co;
+  if (!atomically(&cpu_cache_locks[processor][bin], ATOMIC_SITE("remove_full_cache_from_cpu"),
+		  predo_remove_full_cache_from_cpu,
+		  do_remove_full_cache_from_cpu,
+		  cb,
+		  &co)) {
+    return false;
+  }
+  if (!shared_batch_push(processor, bin, &co)) {
+    // The caches filled up in the meantime.  Put the list back.
+    atomically(&cpu_cache_locks[processor][bin], ATOMIC_SITE("add_a_cache_to_cpu"),
+	       predo_add_a_cache_to_cpu,
+	       do_add_a_cache_to_cpu,
+	       cb,
+	       &co);
+    return false;
+  }
+  return try_put_into_cpu_cache(obj, processor, bin, siz);
+}
+
+static bool try_put_batch_cached(rseq_abi *r,
+				 void *obj,
+				 binnumber_t bin,
+				 uint64_t siz,
+				 latency_path *path)
+// Effect: The thread cache is full.  Move the loaded magazine into
+//  this cpu's rseq or lock-free cache or, if that is full, into the
+//  llc domain cache or the global cache (and set *path to say which).
+//  Then put obj into a new loaded magazine.
+{
+  ThreadCacheForBin *tc = &cache_for_thread.cb[bin];
+  magazine *m = tc->loaded;
+  bassert(m->n > 0);
+  magazine *fresh = get_magazine();
+  if (fresh == NULL) return false;
+  m->next = NULL;
+  cached_objects co = {m->n * siz, m, m};
+  if (cpu_batch_push(r, bin, &co)) {
+    *path = latency_free_cpu_cache;
+  } else if (shared_batch_push(cpu_slot(r ? rseq_cpu_start(r) : getcpu()), bin, &co)) {
+    *path = latency_free_shared_cache;
+  } else {
+    put_magazine(fresh);
+    return false;
+  }
+  fresh->objects[0] = obj;
+  fresh->n = 1;
+  tc->loaded = fresh;
+  return true;
+}
+
+static void underlying_free(void *ptr, binnumber_t bin) {
+  if (bin < first_large_bin_number) {
+    small_free(ptr);
+  } else {
+    large_free(ptr);
+  }
+}
+
+static void free_thread_cache_and(void *obj, binnumber_t bin)
+// Effect: The thread cache for bin is full and so are the cpu and
+//  global caches.  Really free the objects in the loaded magazine,
+//  and keep obj in it, so that the next several frees find room in the
+//  thread cache instead of overflowing one object at a time.
+{
+  magazine *m = cache_for_thread.cb[bin].loaded;
+  free_objects(bin, m->objects, m->n);
+  m->objects[0] = obj;
+  m->n = 1;
 }
-				      
 
 void cached_free(void *ptr, binnumber_t bin) {
   // What I want:
   //  If the threadcache is empty enough, add the object to the thread cache, and we are done.
-  //  If the cpucache is empty enough, add everything in one of the threadcaches to the cpucache (including ptr), and we are done.
-  //  Else if the global cache is empty enough, add everything from one of the cpucaches (including the ptr), and we are done.
-  //  Else really free the pointer.
+  //  If the cpucache is empty enough, move a full magazine from the threadcache to the cpucache, and we are done.
+  //  Else if the global cache is empty enough, move everything from one of the cpucaches to it, and try the cpucache again.
+  //  Else really free the pointer (along with a magazine's worth of others).
   clog_command('f', ptr, bin);
   bassert(bin < first_huge_bin_number);
   uint64_t siz = bin_2_size(bin);
+  uint64_t start = latency_start();
+  latency_path underlying_path = bin < first_large_bin_number ? latency_free_small : latency_free_large;
   
   // No lock needed for this.
   if (use_threadcache) {
     init_cache();
-    if (try_put_cached_both(reinterpret_cast<linked_list*>(ptr),
-			    &cache_for_thread.cb[bin],
-			    siz,
-			    thread_cache_bytecount_limit)) {
+    if (try_put_cached_both(ptr, &cache_for_thread.cb[bin], siz)) {
+      note_latency(latency_free_thread_cache, start);
+      return;
+    }
+    if (cache_for_thread.cb[bin].loaded == NULL) {
+      // We couldn't even get a magazine.
+      underlying_free(ptr, bin);
+      note_latency(underlying_path, start);
+      return;
+    }
+    note_thread_cache_event(bin, siz, false);
+    rseq_abi *r = rseq_current_area();
+    if (r || mode == MODE_LOCKFREE) {
+      latency_path path = underlying_path;
+      if (!try_put_batch_cached(r, ptr, bin, siz, &path)) {
+	free_thread_cache_and(ptr, bin);
+      }
+      note_cache_tier_stats(path, true);
+      note_latency(path, start);
       return;
     }
   }
 
-  int p = getcpu() % cpulimit;
+  int p = cpu_slot(getcpu());
   
-  if (try_put_into_cpu_cache(reinterpret_cast<linked_list*>(ptr),
-			     p, bin, siz)) {
+  if (try_put_into_cpu_cache(ptr, p, bin, siz)) {
+    stat_add(counter_cpu_cache_free_hits, 1);
+    note_latency(latency_free_cpu_cache, start);
     return;
   }
+  stat_add(counter_cpu_cache_free_misses, 1);
 			     
-  if (try_put_into_global_cache(reinterpret_cast<linked_list*>(ptr),
-				p, bin, siz)) {
+  if (try_put_into_shared_cache(ptr, p, bin, siz)) {
+    stat_add(counter_shared_cache_free_hits, 1);
+    note_latency(latency_free_shared_cache, start);
     return;
   }
+  stat_add(counter_shared_cache_free_misses, 1);
 
   // Finally must really do the work.
-  if (bin < first_large_bin_number) {
-    small_free(ptr);
+  if (use_threadcache) {
+    free_thread_cache_and(ptr, bin);
   } else {
-    large_free(ptr);
+    underlying_free(ptr, bin);
   }
+  note_latency(underlying_path, start);
 }
 
-#ifdef ENABLE_STATS
-void print_cache_stats() {
-  printf("Success_counts=");
-  for (int i = 0; i < cpulimit; i++)
-    if (cache_for_cpu[i].attempt_count)
-      printf(" %ld/%ld=%.0f%%", cache_for_cpu[i].success_count, cache_for_cpu[i].attempt_count,
-	     100.0*(double)cache_for_cpu[i].success_count/(double)cache_for_cpu[i].attempt_count);
-  printf("\n");
-}
-#endif
-
 #ifdef ENABLE_LOG_CHECKING
 static const int clog_count_limit = 10000000;
 static int clog_count=0;
@@ -873,9 +1415,162 @@ void check_log_cache() {
 #endif
 
 #ifdef TESTING
+static void test_batch_stack() {
+  BatchStack s = {{NULL, 0}, 0};
+  char base[1];
+  magazine *mags[3];
+  cached_objects co;
+  bassert(!batch_stack_pop(&s, &co));
+  for (int i = 0; i < 3; i++) {
+    mags[i] = test_magazine(1, base);
+    cached_objects c = {static_cast<uint64_t>(i+1), mags[i], mags[i]};
+    bassert(batch_stack_push(&s, &c, 2) == (i < 2));
+  }
+  bassert(s.n == 2);
+  bassert(batch_stack_pop(&s, &co));
+  assert_equal(&co, 2, mags[1], mags[1]);
+  bassert(batch_stack_pop(&s, &co));
+  assert_equal(&co, 1, mags[0], mags[0]);
+  bassert(!batch_stack_pop(&s, &co));
+  bassert(s.n == 0);
+  bassert(s.head.tag == 2);
+  for (int i = 0; i < 3; i++) put_magazine(mags[i]);
+}
+#endif
+
+#ifdef TESTING
+static void test_thread_cache_limits() {
+  init_cache();
+  CacheForThread *ct = &cache_for_thread;
+  const binnumber_t bin = size_2_bin(1024), other = size_2_bin(2048);
+  uint64_t siz = bin_2_size(bin);
+  ThreadCacheForBin *tc = &ct->cb[bin];
+  tc->limit = 0;
+  ct->last_sweep = ct->clock;
+  note_thread_cache_event(bin, siz, true);
+  bassert(tc->limit == magazine_limit(siz));
+  // A second miss before the sweep means the bin is hot.
+  note_thread_cache_event(bin, siz, true);
+  bassert(tc->limit == 2*magazine_limit(siz));
+  // Overflows don't grow it.
+  note_thread_cache_event(bin, siz, false);
+  bassert(tc->limit == 2*magazine_limit(siz));
+  while (tc->limit < max_magazine_limit(siz)) note_thread_cache_event(bin, siz, true);
+  bassert(tc->limit == max_magazine_limit(siz));
+  // The first sweep sees that the bin was busy.
+  uint64_t sweep = ct->last_sweep;
+  while (ct->last_sweep == sweep) note_thread_cache_event(other, bin_2_size(other), false);
+  bassert(tc->limit == max_magazine_limit(siz));
+  // The second sweep sees that it was idle.
+  sweep = ct->last_sweep;
+  while (ct->last_sweep == sweep) note_thread_cache_event(other, bin_2_size(other), false);
+  bassert(tc->limit == max_magazine_limit(siz)/2);
+  bassert(tc->previous == NULL);
+  bassert(tc->loaded == NULL || tc->loaded->n <= tc->limit);
+  tc->limit = magazine_limit(siz);
+}
+#endif
+
+#ifdef TESTING
+static void test_llc_cache() {
+  char dir[64];
+  use_fake_cpu_slots(8);
+  make_fake_cpu_topology(dir, 8, 4);
+  init_llc_domains(dir);
+  // The fake cpus need lock-free caches of their own.
+  LockfreeCacheForCpu *saved_lockfree_caches = lockfree_cache_for_cpu;
+  size_t lockfree_size = ceil(n_cpu_slots*sizeof(*lockfree_cache_for_cpu), pagesize)*pagesize;
+  lockfree_cache_for_cpu = reinterpret_cast<LockfreeCacheForCpu*>(mmap_size(lockfree_size));
+  bassert(lockfree_cache_for_cpu);
+  const binnumber_t bin = 3;
+  const uint32_t d0 = llc_domain_of_slot[cpu_slot(1)], d1 = llc_domain_of_slot[cpu_slot(6)];
+  bassert(d0 != d1);
+  char base[1];
+  magazine *m = test_magazine(1, base);
+  cached_objects co = {1, m, m}, got;
+  // A list pushed by cpu 1 goes to its domain, which cpu 2 shares and cpu 5 doesn't.
+  bassert(shared_batch_push(cpu_slot(1), bin, &co));
+  bassert(llc_cache[d0][bin].n == 1 && global_cache[bin].n == 0);
+  bassert(!batch_stack_pop(llc_cache_for(cpu_slot(5), bin), &got));
+  bassert(batch_stack_pop(llc_cache_for(cpu_slot(2), bin), &got));
+  assert_equal(&got, 1, m, m);
+  // When the domain cache is full, the list goes to the global cache.
+  for (uint64_t i = 0; i < llc_cache_depth; i++) bassert(shared_batch_push(cpu_slot(6), bin, &co));
+  bassert(!shared_cache_full(cpu_slot(6), bin));
+  bassert(shared_batch_push(cpu_slot(6), bin, &co));
+  bassert(llc_cache[d1][bin].n == llc_cache_depth && global_cache[bin].n == 1);
+  while (batch_stack_pop(llc_cache_for(cpu_slot(6), bin), &got)) {}
+  bassert(global_batch_pop(bin, &got));
+  // Stealing only looks at the siblings.
+  bassert(batch_stack_push(&lockfree_cache_for_cpu[cpu_slot(7)].cb[bin], &co, rseq_cache_depth));
+  bassert(!steal_batch_from_siblings(cpu_slot(1), bin, &got));
+  bassert(steal_batch_from_siblings(cpu_slot(4), bin, &got));
+  assert_equal(&got, 1, m, m);
+  put_magazine(m);
+  munmap(lockfree_cache_for_cpu, lockfree_size);
+  lockfree_cache_for_cpu = saved_lockfree_caches;
+  remove_fake_sysfs_tree(dir);
+  use_real_cpu_slots();
+}
+#endif
+
+#ifdef TESTING
+static void test_cache_tier_stats() {
+  bool saved_use_stats = use_stats;
+  use_stats = true;
+  const stat_counter cs[8] = {counter_cpu_cache_hits, counter_cpu_cache_misses,
+			      counter_shared_cache_hits, counter_shared_cache_misses,
+			      counter_cpu_cache_free_hits, counter_cpu_cache_free_misses,
+			      counter_shared_cache_free_hits, counter_shared_cache_free_misses};
+  int64_t before[8];
+  for (int i = 0; i < 8; i++) before[i] = counter_read(cs[i]);
+  note_cache_tier_stats(latency_malloc_cpu_cache, false);    // A cpu cache hit.
+  note_cache_tier_stats(latency_malloc_shared_cache, false); // A cpu miss and a shared hit.
+  note_cache_tier_stats(latency_malloc_small, false);        // Both miss.
+  note_cache_tier_stats(latency_free_shared_cache, true);
+  note_cache_tier_stats(latency_free_large, true);
+  const int64_t expect[8] = {1, 2, 1, 1, 0, 2, 1, 1};
+  for (int i = 0; i < 8; i++) bassert(counter_read(cs[i]) == before[i] + expect[i]);
+  use_stats = saved_use_stats;
+}
+
+static void test_fill_overflow() {
+  // When the cpu cache is full, the magazines we don't load go to the
+  // shared caches rather than back to the allocator.
+  const binnumber_t bin = 5;
+  ThreadCacheForBin *tc = &cache_for_thread.cb[bin];
+  magazine *saved_loaded = tc->loaded;
+  tc->loaded = NULL;
+  BatchStack *cpu_stack = &lockfree_cache_for_cpu[cpu_slot(getcpu())].cb[bin];
+  char base[2];
+  magazine *filler = test_magazine(1, base);
+  cached_objects filler_co = {1, filler, filler};
+  uint64_t n_filler = 0;
+  while (batch_stack_push(cpu_stack, &filler_co, rseq_cache_depth)) n_filler++;
+  magazine *m0 = test_magazine(1, &base[0]);
+  magazine *m1 = test_magazine(1, &base[1]);
+  m0->next = m1;
+  cached_objects co = {2, m0, m1}, got;
+  uint64_t global_n = global_cache[bin].n;
+  bassert(fill_thread_cache_from_batch(NULL, bin, &co, 1) == &base[0]);
+  bassert(global_cache[bin].n == global_n + 1);
+  bassert(global_batch_pop(bin, &got));
+  assert_equal(&got, 1, m1, m1);
+  for (uint64_t i = 0; i < n_filler; i++) bassert(batch_stack_pop(cpu_stack, &got));
+  put_magazine(m1);
+  put_magazine(filler);
+  put_magazine(tc->loaded);
+  tc->loaded = saved_loaded;
+}
+
 void test_cache_early() {
+  test_cache_tier_stats();
+  test_fill_overflow();
   test_try_get_cached_both();
-  test_remove_a_cache_from_cpu();
+  test_thread_cache_limits();
+  test_llc_cache();
+  test_remove_a_magazine_from_cpu();
   test_add_a_cache_to_cpu();
+  test_batch_stack();
 }
 #endif
@@ -26,6 +26,10 @@ void __setup_supermalloc_env() {
       mode = MODE_TSX;
     } else if (0 == std::strcmp("pthread_mutex", mode_str)) {
       mode = MODE_PTHREAD_MUTEX;
+    } else if (0 == std::strcmp("lockfree", mode_str)) {
+      mode = MODE_LOCKFREE;
+    } else if (0 == std::strcmp("queued", mode_str)) {
+      mode = MODE_QUEUED; // Uses transactions only if the machine has TSX.
     } else {
       fprintf(stderr, "SuperMalloc: Warning: unknown mode '%s'.\n", mode_str);
       mode = default_mode();
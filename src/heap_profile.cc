@@ -0,0 +1,363 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <unwind.h>
+
+#include <algorithm>
+
+#include "supermalloc.h"
+#include "atomically.h"
+#include "bassert.h"
+#include "heap_profile.h"
+#include "rng.h"
+
+#ifdef TESTING
+#include <stdlib.h>
+#endif
+
+bool use_heap_profile = false;
+uint64_t heap_profile_interval = 512*1024;
+uint8_t *chunk_heap_samples = NULL;
+
+__thread int64_t bytes_until_sample = 0;
+static __thread bool recording_sample = false;
+
+static const uint32_t heap_profile_depth = 32;     // The most stack frames we keep.
+static const uint32_t heap_sample_limit  = 1u<<19; // Samples past this many live ones are dropped.
+static const uint32_t log_heap_index_size = 20;
+static const uint32_t heap_index_size = 1u<<log_heap_index_size;
+
+struct heap_sample {
+  void *p;            // NULL if the sample is on the free list.
+  uint64_t size;
+  uint32_t depth;
+  uint32_t next_free;
+  void *stack[heap_profile_depth];
+};
+
+// The samples are allocated from a dense array, so that only as many
+// pages are touched as there are samples.  The index is an open
+// addressing (linear probing) hash table from the pointer to the
+// sample number.  Sample 0 is never used, so that 0 can mean empty.
+static heap_sample *samples;
+static uint32_t *sample_index;
+static uint32_t n_samples_used; // Samples [1, n_samples_used] have been handed out.
+static uint32_t free_samples;   // A list of freed samples, through next_free.
+static lock_t heap_profile_lock = LOCK_INITIALIZER;
+// The index is changed only with heap_profile_lock held, and
+// sample_index_seq is odd while it is being changed, so that free()
+// can look for a pointer without the lock (see heap_profile_forget()).
+static uint32_t sample_index_seq;
+static char heap_profile_file[256];
+
+void init_heap_profile(const char *file) {
+  if (samples == NULL) {
+    samples = reinterpret_cast<heap_sample*>(mmap_size(heap_sample_limit*sizeof(heap_sample)));
+    sample_index = reinterpret_cast<uint32_t*>(mmap_size(heap_index_size*sizeof(uint32_t)));
+    // Like chunk_infos, this is mostly never touched.
+    chunk_heap_samples = reinterpret_cast<uint8_t*>(mmap_size(1ul<<log_max_chunknumber));
+    if (samples == NULL || sample_index == NULL || chunk_heap_samples == NULL) {
+      use_heap_profile = false;
+      return;
+    }
+  }
+  snprintf(heap_profile_file, sizeof(heap_profile_file), "%s", file);
+}
+
+static int64_t next_sample_interval()
+// Effect: Return the number of bytes until the next sample.  The
+//  intervals are exponentially distributed, so that the samples form a
+//  Poisson process, which is what pprof assumes when it scales them up.
+{
+  double u = static_cast<double>((prandnum() >> 11) + 1) / static_cast<double>(1ul << 53); // In (0, 1].
+  return static_cast<int64_t>(-log(u) * static_cast<double>(heap_profile_interval));
+}
+
+bool heap_profile_start_sample() {
+  bytes_until_sample = next_sample_interval();
+  return !recording_sample;
+}
+
+static inline uint32_t index_home(const void *p) {
+  return (reinterpret_cast<uint64_t>(p) * 0x9E3779B97F4A7C15ul) >> (64 - log_heap_index_size);
+}
+
+static void begin_index_change() {
+  __atomic_store_n(&sample_index_seq, sample_index_seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+static void end_index_change() {
+  __atomic_store_n(&sample_index_seq, sample_index_seq + 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t find_sample(const void *p)
+// Effect: Return the index slot that holds p's sample, or the empty
+//  slot that ends p's probe sequence.
+{
+  uint32_t i = index_home(p);
+  while (1) {
+    uint32_t s = __atomic_load_n(&sample_index[i], __ATOMIC_RELAXED);
+    if (s == 0 || __atomic_load_n(&samples[s].p, __ATOMIC_RELAXED) == p) return i;
+    i = (i+1) % heap_index_size;
+  }
+}
+
+static bool surely_not_sampled(const void *p)
+// Effect: Return true if p has no sample, without taking the lock.
+//  Return false if it has one, or if the index changed while we looked.
+{
+  uint32_t seq = __atomic_load_n(&sample_index_seq, __ATOMIC_ACQUIRE);
+  if (seq & 1) return false;
+  bool found = __atomic_load_n(&sample_index[find_sample(p)], __ATOMIC_RELAXED) != 0;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return !found && __atomic_load_n(&sample_index_seq, __ATOMIC_RELAXED) == seq;
+}
+
+struct unwind_state {
+  void **stack;
+  uint32_t depth;
+  uint32_t skip;
+};
+
+static _Unwind_Reason_Code unwind_one(struct _Unwind_Context *ctx, void *v) {
+  unwind_state *s = reinterpret_cast<unwind_state*>(v);
+  if (s->skip > 0) {
+    s->skip--;
+    return _URC_NO_REASON;
+  }
+  if (s->depth >= heap_profile_depth) return _URC_END_OF_STACK;
+  void *ip = reinterpret_cast<void*>(_Unwind_GetIP(ctx));
+  if (ip == NULL) return _URC_END_OF_STACK;
+  s->stack[s->depth++] = ip;
+  return _URC_NO_REASON;
+}
+
+__attribute__((noinline))
+void heap_profile_record(void *p, size_t size) {
+  if (p == NULL) return;
+  // We use the unwinder directly: backtrace() may dlopen libgcc_s, which mallocs.
+  recording_sample = true;
+  void *stack[heap_profile_depth];
+  unwind_state us = {stack, 0, 1}; // Skip our own frame.  The stack starts in malloc().
+  _Unwind_Backtrace(unwind_one, &us);
+  {
+    mylock_raii m(&heap_profile_lock);
+    uint32_t s = free_samples;
+    if (s) {
+      free_samples = samples[s].next_free;
+    } else if (n_samples_used + 1 < heap_sample_limit) {
+      s = ++n_samples_used;
+    }
+    if (s) {
+      heap_sample *hs = &samples[s];
+      hs->p = p;
+      hs->size = size;
+      hs->depth = us.depth;
+      memcpy(hs->stack, stack, us.depth*sizeof(stack[0]));
+      uint32_t i = index_home(p);
+      while (sample_index[i] != 0) i = (i+1) % heap_index_size;
+      begin_index_change();
+      __atomic_store_n(&sample_index[i], s, __ATOMIC_RELAXED);
+      end_index_change();
+      chunknumber_t cn = address_2_chunknumber(p);
+      if (chunk_heap_samples[cn] < UINT8_MAX) chunk_heap_samples[cn]++; // Once it saturates, it stays.
+    }
+  }
+  recording_sample = false;
+}
+
+void heap_profile_forget(void *p) {
+  // Most of the objects in a chunk that has samples aren't sampled, so
+  // look first without the lock.  Only we can remove p's sample (and
+  // it was recorded before p was returned), so if the index didn't
+  // change while we looked and p wasn't there, it isn't sampled.
+  if (surely_not_sampled(p)) return;
+  mylock_raii m(&heap_profile_lock);
+  uint32_t i = find_sample(p);
+  if (sample_index[i] == 0) return; // p's chunk has samples, but p isn't one.
+  uint32_t s = sample_index[i];
+  begin_index_change();
+  __atomic_store_n(&samples[s].p, static_cast<void*>(NULL), __ATOMIC_RELAXED);
+  samples[s].next_free = free_samples;
+  free_samples = s;
+  chunknumber_t cn = address_2_chunknumber(p);
+  if (chunk_heap_samples[cn] < UINT8_MAX) chunk_heap_samples[cn]--;
+  // Close up the hole, so that the probe sequences don't need tombstones.
+  while (1) {
+    uint32_t j = i;
+    uint32_t k;
+    do {
+      j = (j+1) % heap_index_size;
+      if (sample_index[j] == 0) {
+	__atomic_store_n(&sample_index[i], 0u, __ATOMIC_RELAXED);
+	end_index_change();
+	return;
+      }
+      k = index_home(samples[sample_index[j]].p);
+      // Entry j can move to i unless its home is cyclically in (i, j].
+    } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+    __atomic_store_n(&sample_index[i], sample_index[j], __ATOMIC_RELAXED);
+    i = j;
+  }
+}
+
+static bool write_all(int fd, const char *buf, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, buf, n);
+    if (w <= 0) return false;
+    buf += w;
+    n -= w;
+  }
+  return true;
+}
+
+static bool same_stack(const heap_sample *a, const heap_sample *b) {
+  return a->depth == b->depth && memcmp(a->stack, b->stack, a->depth*sizeof(a->stack[0])) == 0;
+}
+
+static bool stack_less(uint32_t a, uint32_t b) {
+  const heap_sample *sa = &samples[a], *sb = &samples[b];
+  if (sa->depth != sb->depth) return sa->depth < sb->depth;
+  return memcmp(sa->stack, sb->stack, sa->depth*sizeof(sa->stack[0])) < 0;
+}
+
+extern "C" int supermalloc_write_heap_profile(int fd) {
+  if (!use_heap_profile) return -1;
+  char line[128 + heap_profile_depth*20];
+  mylock_raii m(&heap_profile_lock);
+  // Sort the live samples by stack (in memory that we map ourselves,
+  // since we're holding the lock that malloc may need).
+  size_t order_size = ceil((n_samples_used+1)*sizeof(uint32_t), pagesize)*pagesize;
+  uint32_t *order = reinterpret_cast<uint32_t*>(mmap(NULL, order_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0));
+  if (order == MAP_FAILED) return -1;
+  uint32_t n = 0;
+  uint64_t total_bytes = 0;
+  for (uint32_t s = 1; s <= n_samples_used; s++) {
+    if (samples[s].p == NULL) continue;
+    order[n++] = s;
+    total_bytes += samples[s].size;
+  }
+  std::sort(order, order + n, stack_less);
+  // We only keep the live samples, so the allocated columns are the same as the in-use ones.
+  int len = snprintf(line, sizeof(line), "heap profile: %u: %lu [%u: %lu] @ heap_v2/%lu\n",
+		     n, total_bytes, n, total_bytes, heap_profile_interval);
+  bool ok = write_all(fd, line, len);
+  for (uint32_t i = 0; ok && i < n; ) {
+    const heap_sample *first = &samples[order[i]];
+    uint32_t count = 0;
+    uint64_t bytes = 0;
+    for (; i < n && same_stack(first, &samples[order[i]]); i++) {
+      count++;
+      bytes += samples[order[i]].size;
+    }
+    len = snprintf(line, sizeof(line), "%u: %lu [%u: %lu] @", count, bytes, count, bytes);
+    for (uint32_t d = 0; d < first->depth; d++) {
+      len += snprintf(line + len, sizeof(line) - len, " %p", first->stack[d]);
+    }
+    line[len++] = '\n';
+    ok = write_all(fd, line, len);
+  }
+  munmap(order, order_size);
+  // pprof needs the mappings to find the symbols.
+  if (ok) ok = write_all(fd, "\nMAPPED_LIBRARIES:\n", 19);
+  int maps = open("/proc/self/maps", O_RDONLY);
+  if (maps >= 0) {
+    char buf[4096];
+    ssize_t r;
+    while (ok && (r = read(maps, buf, sizeof(buf))) > 0) ok = write_all(fd, buf, r);
+    close(maps);
+  }
+  return ok ? 0 : -1;
+}
+
+__attribute__((destructor))
+static void write_heap_profile_at_exit() {
+  if (!use_heap_profile || heap_profile_file[0] == 0) return;
+  int fd = open(heap_profile_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return;
+  supermalloc_write_heap_profile(fd);
+  close(fd);
+}
+
+#ifdef TESTING
+static uint32_t live_samples() {
+  uint32_t n = 0;
+  for (uint32_t s = 1; s <= n_samples_used; s++) {
+    if (samples[s].p) n++;
+  }
+  return n;
+}
+
+extern "C" void test_heap_profile() {
+  bool saved_use = use_heap_profile;
+  uint64_t saved_interval = heap_profile_interval;
+  use_heap_profile = true;
+  init_heap_profile("");
+  bassert(use_heap_profile);
+
+  // The intervals average about heap_profile_interval.
+  heap_profile_interval = 1000;
+  uint64_t sum = 0;
+  for (int i = 0; i < 10000; i++) sum += next_sample_interval();
+  bassert(sum > 9000000 && sum < 11000000);
+
+  // Pointers whose homes are in a window of the index that wraps
+  // around the end, so that the probe sequences overlap, freed in a
+  // scrambled order.
+  const uint32_t n = 32, window = 16, first_home = heap_index_size - window/2;
+  void *fake[n];
+  uint32_t n_fake = 0;
+  for (uint64_t a = 1ul << 20; n_fake < n; a += 16) {
+    void *p = reinterpret_cast<void*>(a);
+    if ((index_home(p) - first_home) % heap_index_size < window) fake[n_fake++] = p;
+  }
+  uint32_t base = live_samples();
+  for (uint32_t i = 0; i < n; i++) heap_profile_record(fake[i], 16);
+  bassert(live_samples() == base + n);
+  for (uint32_t i = 0; i < n; i++) {
+    heap_profile_forget(fake[(i*13) % n]);
+    bassert(live_samples() == base + n - 1 - i);
+    bassert(surely_not_sampled(fake[(i*13) % n]));
+    // The ones we haven't forgotten can still be found, with or without the lock.
+    for (uint32_t m = i+1; m < n; m++) {
+      void *p = fake[(m*13) % n];
+      bassert(sample_index[find_sample(p)] != 0);
+      bassert(!surely_not_sampled(p));
+    }
+  }
+  // While the index is changing, we can't be sure of anything.
+  begin_index_change();
+  bassert(!surely_not_sampled(fake[0]));
+  end_index_change();
+  bassert(surely_not_sampled(fake[0]) && (sample_index_seq & 1) == 0);
+
+  // With an interval of 1, every allocation is sampled.
+  heap_profile_interval = 1;
+  bytes_until_sample = 0;
+  void *a = malloc(100);
+  void *b = malloc(200);
+  bassert(live_samples() == base + 2);
+  bassert(chunk_heap_samples[address_2_chunknumber(a)] > 0);
+  char name[] = "/tmp/supermalloc-heap-XXXXXX";
+  int fd = mkstemp(name);
+  bassert(fd >= 0);
+  bassert(supermalloc_write_heap_profile(fd) == 0);
+  char buf[256];
+  bassert(pread(fd, buf, sizeof(buf)-1, 0) > 0);
+  buf[sizeof(buf)-1] = 0;
+  bassert(strncmp(buf, "heap profile: ", 14) == 0);
+  bassert(strstr(buf, "@ heap_v2/1\n"));
+  close(fd);
+  unlink(name);
+  free(a);
+  free(b);
+  bassert(live_samples() == base);
+
+  heap_profile_interval = saved_interval;
+  use_heap_profile = saved_use;
+  bytes_until_sample = 0;
+}
+#endif
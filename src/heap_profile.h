@@ -0,0 +1,66 @@
+#ifndef HEAP_PROFILE_H
+#define HEAP_PROFILE_H
+
+// The sampling heap profiler (SUPERMALLOC_HEAP_PROFILE=<file>).
+//
+// Each thread counts down the bytes it allocates, and when the count
+// goes negative, the allocation that did it is sampled: we record its
+// size and stack trace in a side table keyed by the pointer, and pick
+// the next countdown from an exponential distribution with mean
+// heap_profile_interval bytes (SUPERMALLOC_HEAP_PROFILE_INTERVAL).
+// So a sampled allocation stands for about heap_profile_interval
+// bytes, however big it is.  free() removes the entry.  To keep free()
+// from looking in the table for every object, we keep a count of the
+// samples in each chunk, and only look if the object's chunk has one.
+// Even then, free() looks without the lock, and takes the lock only if
+// it finds the object (or the table changed while it looked), since
+// with the default interval most chunks have a sample.
+//
+// The live samples can be written out, grouped by stack, in the text
+// format that pprof reads (heap_v2), with
+// supermalloc_write_heap_profile(fd).  If SUPERMALLOC_HEAP_PROFILE is
+// set, the profile is also written to that file when the program
+// exits.
+//
+// When the profiler is off, malloc and free each pay for a load and a
+// branch that isn't taken.  (We test use_heap_profile before touching
+// the countdown, since a thread-local variable in a shared library can
+// cost a call to __tls_get_addr.)
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "malloc_internal.h"
+
+extern bool use_heap_profile;
+extern uint64_t heap_profile_interval;  // The mean number of bytes between samples.
+extern uint8_t *chunk_heap_samples;     // The number of samples in each chunk (saturating).
+
+extern __thread int64_t bytes_until_sample;
+
+void init_heap_profile(const char *file);
+// Effect: Set up the side table, and remember to write the profile to
+//  file at exit.  Turns use_heap_profile off if we can't.  Requires:
+//  use_heap_profile is set.
+
+static inline bool should_sample(size_t size) {
+  return __builtin_expect(use_heap_profile, 0) && __builtin_expect((bytes_until_sample -= size) < 0, 0);
+}
+
+bool heap_profile_start_sample();
+// Effect: Called when should_sample() says yes.  Set the thread's next
+//  countdown, and return true if the allocation should really be
+//  sampled.  (It returns false when recording a sample calls malloc.)
+
+void heap_profile_record(void *p, size_t size);
+// Effect: Record that p (of size bytes) was sampled, with our caller's
+//  stack.
+
+void heap_profile_forget(void *p);
+// Effect: If p was sampled, remove its sample.
+
+static inline void heap_profile_maybe_forget(void *p, chunknumber_t cn) {
+  if (__builtin_expect(use_heap_profile, 0) && chunk_heap_samples[cn]) heap_profile_forget(p);
+}
+
+#endif
@@ -2,105 +2,204 @@
 #include <algorithm>
 
 #ifdef TESTING
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #endif
 
 #include "atomically.h"
 #include "bassert.h"
 #include "generated_constants.h"
 #include "malloc_internal.h"
+#include "numa.h"
+#include "purge.h"
 
 static lock_t huge_lock = LOCK_INITIALIZER;
 
-// free_chunks[0] is a list of 1-chunk objects (which are, by definition chunk-aligned)
-// free_chunks[1] is a list of 2-chunk objects which are also 2-chunk aligned (that is 4MiB-aligned).
-// free_chunks[2] is a list of 4-chunk objects that are 4-chunk aligned.
-// terminated by 0.
-chunknumber_t free_chunks[log_max_chunknumber];
+// Huge objects get exactly as many chunks as they need.  The free
+// chunks are kept as extents (maximal runs of free chunks), which are
+// indexed by length: free_extents[node][i] is a doubly linked list
+// threaded through chunk_infos[] (next and prev are chunk numbers,
+// terminated by 0).  List i < n_exact_extent_lists holds the extents
+// of exactly i chunks, and the rest hold the extents whose length has
+// a given floor(lg), so a malloc takes the best fit from the first
+// nonempty list that can have one.
+// The chunk_infos[] entries of the first and last chunk of a free
+// extent have free_length set to its length (it's 0 for every other
+// chunk), which is how huge_free() finds the free extents on either
+// side of the chunks it frees, so that it can coalesce them.
+// In NUMA mode each node has its own lists (free_extents[node]), an
+// extent goes back onto the lists of the node it is bound to, and we
+// coalesce only extents on the same node.
+// The lists are changed only with huge_lock held (or in a transaction).
+static const uint32_t n_exact_extent_lists = 64;
+static const uint32_t n_extent_lists = n_exact_extent_lists + log_max_chunknumber - 6;
+static const uint32_t extent_scan_limit = 64; // How many extents of a list we look at for the best fit.
+static chunknumber_t free_extents[numa_node_limit][n_extent_lists];
+static uint64_t huge_free_bytes = 0; // How much address space the free extents hold.
 
-static void pre_get_from_free_chunks(int f) {
-  int r = free_chunks[f];
+uint64_t huge_retain_max = 1ul<<30;
+
+static inline uint32_t extent_list(chunknumber_t len) {
+  if (len < n_exact_extent_lists) return len;
+  return n_exact_extent_lists + (63 - __builtin_clzl(len)) - 6;
+}
+
+static void link_extent(chunknumber_t cn, chunknumber_t len, uint32_t node) {
+  chunknumber_t *head = &free_extents[node][extent_list(len)];
+  chunk_infos[cn].next = *head;
+  chunk_infos[cn].prev = null_chunknumber;
+  chunk_infos[cn].free_length = len;
+  chunk_infos[cn+len-1].free_length = len;
+  if (*head != null_chunknumber) chunk_infos[*head].prev = cn;
+  *head = cn;
+  huge_free_bytes += len*chunksize;
+}
+
+static void unlink_extent(chunknumber_t cn, chunknumber_t len, uint32_t node) {
+  chunknumber_t next = chunk_infos[cn].next;
+  chunknumber_t prev = chunk_infos[cn].prev;
+  if (prev != null_chunknumber) {
+    chunk_infos[prev].next = next;
+  } else {
+    free_extents[node][extent_list(len)] = next;
+  }
+  if (next != null_chunknumber) chunk_infos[next].prev = prev;
+  chunk_infos[cn].prev = null_chunknumber;
+  chunk_infos[cn].free_length = 0;
+  chunk_infos[cn+len-1].free_length = 0;
+  huge_free_bytes -= len*chunksize;
+}
+
+static void pre_get_extent(uint32_t node, chunknumber_t n, chunknumber_t align) {
+  chunknumber_t r = free_extents[node][extent_list(n + align - 1)];
   if (r==0) return;
-  prefetch_write(&free_chunks[f]);
-  prefetch_read(&chunk_infos[r]);
+  prefetch_write(&free_extents[node][extent_list(n + align - 1)]);
+  prefetch_write(&chunk_infos[r]);
 }
-static void* do_get_from_free_chunks(int f) {
-  chunknumber_t r = free_chunks[f];
-  if (r==0) return NULL;
-  free_chunks[f] = chunk_infos[r].next;
-  return reinterpret_cast<void*>(static_cast<uint64_t>(r)*chunksize);
+static chunknumber_t do_get_extent(uint32_t node, chunknumber_t n, chunknumber_t align)
+// Effect: Take n chunks, aligned to align chunks, off node's lists,
+//  out of the free extent that fits best.  Put what is left of the
+//  extent back.  Return the first chunk, or 0 if there are no extents
+//  big enough.
+// Requires: align is a power of two.
+{
+  chunknumber_t need = n + align - 1; // An extent this long has an aligned run of n chunks.
+  for (uint32_t i = extent_list(need); i < n_extent_lists; i++) {
+    chunknumber_t best = null_chunknumber, best_len = 0;
+    uint32_t count = 0;
+    for (chunknumber_t e = free_extents[node][i]; e != null_chunknumber && count < extent_scan_limit; e = chunk_infos[e].next, count++) {
+      chunknumber_t len = chunk_infos[e].free_length;
+      if (len >= need && (best == null_chunknumber || len < best_len)) {
+	best = e;
+	best_len = len;
+	if (len == need) break;
+      }
+    }
+    if (best == null_chunknumber) continue;
+    unlink_extent(best, best_len, node);
+    chunknumber_t r = (best + align - 1) & ~(align - 1);
+    if (r > best) link_extent(best, r - best, node);
+    if (best + best_len > r + n) link_extent(r + n, best + best_len - (r + n), node);
+    return r;
+  }
+  return null_chunknumber;
 }
 
-static void *get_cached_power_of_two_chunks(int list_number) {
-  if (atomic_load(&free_chunks[list_number]) == 0) return NULL; // there are none.
-  return atomically(&huge_lock, "huge:add_to_free_chunks", pre_get_from_free_chunks, do_get_from_free_chunks, list_number);
+static void *get_cached_chunks(uint32_t node, chunknumber_t n, chunknumber_t align) {
+  if (atomic_load(&huge_free_bytes) < n*chunksize) return NULL; // there are none.
+  chunknumber_t r = atomically(&huge_lock, ATOMIC_SITE("huge_get_extent"), pre_get_extent, do_get_extent, node, n, align);
+  if (r == null_chunknumber) return NULL;
+  return reinterpret_cast<void*>(static_cast<uint64_t>(r)*chunksize);
 }
 
-static void put_cached_power_of_two_chunks(chunknumber_t cn, int list_number) {
-  // Do this atomically.  This one is simple enough to be done with a compare and swap.
-  if (0) {
-    chunk_infos[cn].next = free_chunks[list_number];
-    free_chunks[list_number] = cn;
-  } else {
-    while (1) {
-      chunknumber_t hd = atomic_load(&free_chunks[list_number]);
-      chunk_infos[cn].next = hd;
-      if (__sync_bool_compare_and_swap(&free_chunks[list_number], hd, cn)) break;
+struct huge_extent {
+  chunknumber_t cn;
+  chunknumber_t len; // 0 if there is no extent.
+};
+
+static void pre_put_extent(chunknumber_t cn, chunknumber_t len, uint32_t node __attribute__((unused))) {
+  prefetch_write(&chunk_infos[cn]);
+  prefetch_read(&chunk_infos[cn-1]);
+  prefetch_read(&chunk_infos[cn+len]);
+}
+static huge_extent do_put_extent(chunknumber_t cn, chunknumber_t len, uint32_t node)
+// Effect: Put the len free chunks at cn onto node's lists, coalescing
+//  them with the free extents on either side.  If that would make the
+//  free extents hold more than huge_retain_max bytes, return the
+//  coalesced extent instead (so that the caller unmaps it).
+{
+  chunknumber_t right = cn + len;
+  if (right < (1u<<log_max_chunknumber)) {
+    chunknumber_t right_len = chunk_infos[right].free_length;
+    if (right_len != 0 && chunk_numa_node(right) == node) {
+      unlink_extent(right, right_len, node);
+      len += right_len;
     }
   }
+  chunknumber_t left_len = chunk_infos[cn-1].free_length;
+  if (left_len != 0 && chunk_numa_node(cn - left_len) == node) {
+    unlink_extent(cn - left_len, left_len, node);
+    cn  -= left_len;
+    len += left_len;
+  }
+  if (huge_free_bytes + len*chunksize > huge_retain_max) {
+    huge_extent e = {cn, len};
+    return e;
+  }
+  link_extent(cn, len, node);
+  huge_extent e = {cn, 0};
+  return e;
 }
 
-// static void* align_pointer_up_huge(void *p, chunknumber_t n_chunks_alignment) {
-//   uint64_t ru = reinterpret_cast<uint64_t>(p);
-//   uint64_t alignment = n_chunks_alignment * chunksize;
-//   uint64_t ra = (ru + alignment -1) & ~(alignment-1);
-//   return reinterpret_cast<void*>(ra);
-// }
+static void put_chunks(chunknumber_t cn, chunknumber_t len)
+// Effect: Free the len chunks at cn (which are purged), and unmap what
+//  we can't keep.
+{
+  huge_extent e = atomically(&huge_lock, ATOMIC_SITE("huge_put_extent"), pre_put_extent, do_put_extent, cn, len, chunk_numa_node(cn));
+  if (e.len != 0) {
+    int r = munmap(reinterpret_cast<void*>(static_cast<uint64_t>(e.cn)*chunksize), e.len*chunksize);
+    bassert(r == 0);
+  }
+}
 
-static void* get_power_of_two_n_chunks(chunknumber_t n_chunks)
-// Effect: Allocate n_chunks of chunks.
-// Requires: n_chunks is power of two.
+static void* get_n_chunks(chunknumber_t n_chunks, chunknumber_t align)
+// Effect: Allocate n_chunks of chunks, aligned to align chunks.
+// Requires: align is a power of two.
 {
+  uint32_t node = numa_current_node();
   {
-    void *r = get_cached_power_of_two_chunks(lg_of_power_of_two(n_chunks));
+    void *r = get_cached_chunks(node, n_chunks, align);
     if (r) return r;
   }
-  void *p = mmap_chunk_aligned_block(2*n_chunks); 
-  if (p == NULL) return NULL;
-  chunknumber_t c = address_2_chunknumber(p);
-  chunknumber_t end = c+2*n_chunks;
-  void *result = NULL;
-  while (c < end) {
-    if ((c & (n_chunks-1)) == 0) {
-      // c is aligned well enough
-      result = reinterpret_cast<void*>(c*chunksize);
-      c += n_chunks;
-      break;
-    } else {
-      int bit = __builtin_ffs(c)-1;
-      // make sure the bit we add doesn't overflow
-      while (c + (1<<bit) > end) bit--;
-      put_cached_power_of_two_chunks(c, bit);
-      c += (1<<bit);
+  void *p = mmap_chunk_aligned_block(n_chunks + align - 1);
+  if (p == NULL) {
+    // Our node is out of address space (or memory).  Try the others.
+    for (uint32_t other = 1; other < n_numa_nodes; other++) {
+      void *r = get_cached_chunks((node + other) % n_numa_nodes, n_chunks, align);
+      if (r) return r;
     }
+    return NULL;
   }
-  // the pieces in the tail of c must be put in the right place.
-  while (c < end) {
-    int bit = __builtin_ffs(c)-1;
-    while (c + (1<<bit) > end) bit--;
-    put_cached_power_of_two_chunks(c, bit);
-    c += (1<<bit);
-  }
-  bassert(result);
-  return result;
+  chunknumber_t c = address_2_chunknumber(p);
+  chunknumber_t end = c + n_chunks + align - 1;
+  chunknumber_t result = (c + align - 1) & ~(align - 1);
+  // The pieces on either side of the aligned chunks are free.
+  if (result > c) put_chunks(c, result - c);
+  if (end > result + n_chunks) put_chunks(result + n_chunks, end - (result + n_chunks));
+  return reinterpret_cast<void*>(static_cast<uint64_t>(result)*chunksize);
 }
 
-void* huge_malloc(size_t size) {
-  // allocates something out of the hyperceil(size) bin, which is also hyperceil(size)-aligned.
-  chunknumber_t n_chunks = std::max(1ul, hyperceil(size)/chunksize); // at least one chunk always
-  void *c = get_power_of_two_n_chunks(n_chunks);
+void* huge_malloc_aligned(size_t size, size_t alignment) {
+  chunknumber_t n_chunks = std::max(1ul, ceil(size, chunksize)); // at least one chunk always
+  chunknumber_t align    = std::max(1ul, alignment/chunksize);
+  void *c = get_n_chunks(n_chunks, align);
   if (c == NULL) return NULL;
-  madvise(c, n_chunks*chunksize, MADV_DONTNEED);
+  // The chunks were purged when they were freed (or are fresh from
+  // mmap).  Purging them again is worth it only in dontneed mode,
+  // since the other modes don't zero them anyway (calloc zeroes for
+  // itself).
+  if (purge_mode == PURGE_DONTNEED) purge_pages(c, n_chunks*chunksize);
   size_t n_whole_chunks = size/chunksize;
   size_t n_bytes_at_end = size - n_whole_chunks*chunksize;
   if (n_bytes_at_end==0 ||
@@ -121,10 +220,15 @@ void* huge_malloc(size_t size) {
   binnumber_t bin        = size_2_bin(n_chunks*chunksize);
   bin_and_size_t b_and_s = bin_and_size_to_bin_and_size(bin, size);
   bassert(b_and_s != 0);
+  bassert(huge_n_chunks(b_and_s) == n_chunks);
   chunk_infos[chunknum].bin_and_size = b_and_s;
   return c;
 }
 
+void* huge_malloc(size_t size) {
+  return huge_malloc_aligned(size, chunksize);
+}
+
 void huge_free(void *m) {
   // huge_free() is required to tolerate m being any pointer into the chunk returned by huge_malloc.
   // However this code cannot really tolerate i.
@@ -134,25 +238,35 @@ void huge_free(void *m) {
   bassert(cn);
   bin_and_size_t bnt = chunk_infos[cn].bin_and_size;
   bassert(bnt != 0);
-  binnumber_t   bin  = bin_from_bin_and_size(bnt);
-  uint64_t      siz  = bin_2_size(bin);
-  chunknumber_t csiz = ceil(siz, chunksize);
-  uint64_t     hceil = hyperceil(csiz);
-  uint32_t      hlog = lg_of_power_of_two(hceil);
-  bassert(hlog < log_max_chunknumber);
-  {
-    int r = madvise(m, siz, MADV_DONTNEED);
-    bassert(r==0);  // Should we really check this?
-  }
-  put_cached_power_of_two_chunks(cn, hlog);
+  bassert(bin_from_bin_and_size(bnt) >= first_huge_bin_number);
+  chunknumber_t n_chunks = huge_n_chunks(bnt);
+  purge_pages(m, n_chunks*chunksize);
+  put_chunks(cn, n_chunks);
 }
 
 #ifdef TESTING
+static bool chunk_is_free(chunknumber_t cn)
+// Effect: Return true if chunk cn is in a free extent.
+{
+  for (uint32_t node = 0; node < numa_node_limit; node++) {
+    for (uint32_t i = 0; i < n_extent_lists; i++) {
+      for (chunknumber_t e = free_extents[node][i]; e != null_chunknumber; e = chunk_infos[e].next) {
+	if (e <= cn && cn < e + chunk_infos[e].free_length) return true;
+      }
+    }
+  }
+  return false;
+}
+
+static bool disjoint(chunknumber_t x, chunknumber_t x_len, chunknumber_t y, chunknumber_t y_len) {
+  return x + x_len <= y || y + y_len <= x;
+}
+
 void test_huge_malloc(void) {
   const bool print = false;
 
   // Sometimes mmap works its way down (e.g., under linux 3.15.8).  Sometimes it works its way up (e.g., under valgrind under linux 3.15.8)
-  // So the tests below have to look at the absolute difference instead of the relative difference.
+  // So the tests below check that objects don't overlap rather than where they are relative to each other.
   void *temp = huge_malloc(chunksize); // reset the strangeness that may have happened when testing the chunk allocator.
   if (print) printf("temp=%p\n", temp);
 
@@ -186,12 +300,12 @@ void test_huge_malloc(void) {
   bassert(bin_from_bin_and_size(chunk_infos[c_n].bin_and_size) == first_huge_bin_number +1);
 
   // Now make sure that a, b, c, d are allocated with no overlaps.
-  bassert(abs(a_n-b_n)>=1);  // a and b must be separated by 1
-  bassert(abs(a_n-c_n)>=2);  // a and c must be separated by 2
-  bassert(abs(a_n-d_n)>=2);  // a and d must be separated by 2
-  bassert(abs(b_n-c_n)>=2);  // b and c must be separated by 2
-  bassert(abs(b_n-d_n)>=2);  // a and d must be separated by 2
-  bassert(abs(c_n-d_n)>=2);  // c and d must be separated by 2
+  bassert(disjoint(a_n, 1, b_n, 1));
+  bassert(disjoint(a_n, 1, c_n, 2));
+  bassert(disjoint(a_n, 1, d_n, 2));
+  bassert(disjoint(b_n, 1, c_n, 2));
+  bassert(disjoint(b_n, 1, d_n, 2));
+  bassert(disjoint(c_n, 2, d_n, 2));
 
   {
     chunknumber_t m1_n = address_2_chunknumber(reinterpret_cast<void*>(-1ul));
@@ -207,41 +321,99 @@ void test_huge_malloc(void) {
     if (print) printf("-1 ==> 0x%x\n", zero_n);
   }
 
+  // Which free extent a malloc gets back depends on what else is free,
+  // so all we can say is that the freed chunks are on the lists.
   huge_free(a);
+  bassert(chunk_is_free(a_n));
   void *a_again = huge_malloc(largest_large + 1);
   if (print) printf("a=%p a_again=%p\n", a, a_again);
-  bassert(a==a_again);
+  bassert(!chunk_is_free(address_2_chunknumber(a_again)));
 
   huge_free(a_again);
   huge_free(b);
+  bassert(chunk_is_free(address_2_chunknumber(a_again)) && chunk_is_free(b_n));
   void *b_again      = huge_malloc(largest_large + 2);
   void *a_againagain = huge_malloc(largest_large + 1);
   if (print) printf("a=%p b=%p a_again=%p b_again=%p\n", a, b, a_again, b_again);
-  bassert(b==b_again);
-  bassert(a==a_againagain);
+  bassert(b_again != a_againagain);
 
   huge_free(d);
-  void *d_again      = huge_malloc(2*chunksize);
-  bassert(d==d_again);
+  bassert(chunk_is_free(d_n) && chunk_is_free(d_n+1));
 
-  // Make sure the chunk cache works right when we ask for a different size.
-  // Recall that the reason we do the bookkeeping separately after the chunks are
-  // allocated is so that we can keep track of the footprint (the footprint is the
-  // RSS if the user were to touch all the byte of all her malloc'd objects.)
+  // Huge objects aren't rounded up to a power of two.
   void *e            = huge_malloc(5*chunksize);
+  bassert(huge_n_chunks(chunk_infos[address_2_chunknumber(e)].bin_and_size) == 5);
   huge_free(e);
-  void *eagain       = huge_malloc(8*chunksize);
-  bassert(e==eagain);
-  huge_free(e);
-
+  for (chunknumber_t i = 0; i < 5; i++) bassert(chunk_is_free(address_2_chunknumber(e) + i));
   void *f            = huge_malloc(5*chunksize+1);
-  bassert(f==e);
+  bassert(huge_n_chunks(chunk_infos[address_2_chunknumber(f)].bin_and_size) == 6);
   huge_free(f);
 
+  // But they can be aligned.
+  void *g            = huge_malloc_aligned(3*chunksize, 8*chunksize);
+  bassert(reinterpret_cast<uint64_t>(g) % (8*chunksize) == 0);
+  bassert(huge_n_chunks(chunk_infos[address_2_chunknumber(g)].bin_and_size) == 3);
+  huge_free(g);
+
   huge_free(a_againagain);
-  void *g            = huge_malloc(chunksize-4096);
-  bassert(g==a_againagain);
-  
+  bassert(chunk_is_free(address_2_chunknumber(a_againagain)));
+
+  {
+    // Free a 64-chunk object one chunk at a time (in a scrambled
+    // order), and the chunks coalesce back into one extent.
+    const uint32_t n = 64;
+    char *h = reinterpret_cast<char*>(huge_malloc(n*chunksize));
+    chunknumber_t h_n = address_2_chunknumber(h);
+    for (uint32_t i = 0; i < n; i++) {
+      chunk_infos[h_n + i].bin_and_size = bin_and_size_to_bin_and_size(first_huge_bin_number, chunksize);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      huge_free(h + ((i*37) % n)*chunksize);
+    }
+    chunknumber_t h_head = h_n;
+    while (chunk_infos[h_head].free_length == 0) h_head--;
+    bassert(h_head + chunk_infos[h_head].free_length >= h_n + n);
+  }
+  {
+    // Best fit.  Set node 0's lists aside so that we know what is on
+    // them, and work in the middle of a bigger object so that nothing
+    // next door coalesces.
+    chunknumber_t saved_extents[n_extent_lists];
+    memcpy(saved_extents, free_extents[0], sizeof(saved_extents));
+    memset(free_extents[0], 0, sizeof(saved_extents));
+    uint64_t saved_free_bytes = huge_free_bytes;
+    huge_free_bytes = 0;
 
+    char *g = reinterpret_cast<char*>(huge_malloc(21*chunksize));
+    chunknumber_t g_n = address_2_chunknumber(g);
+    chunknumber_t h_n = (g_n + 4) & ~3;
+    do_put_extent(h_n, 4, 0);
+    do_put_extent(h_n + 5, 11, 0);
+    bassert(do_get_extent(0, 3, 1) == h_n);              // 4 fits better than 11.
+    bassert(chunk_infos[h_n + 3].free_length == 1);
+    bassert(do_get_extent(0, 2, 4) == h_n + 8);          // Aligned, which splits the 11.
+    bassert(chunk_infos[h_n + 5].free_length == 3 && chunk_infos[h_n + 10].free_length == 6);
+    bassert(do_get_extent(0, 7, 1) == null_chunknumber);
+    // Coalesce it all back.
+    do_put_extent(h_n + 4, 1, 0);
+    do_put_extent(h_n + 8, 2, 0);
+    do_put_extent(h_n, 3, 0);
+    bassert(chunk_infos[h_n].free_length == 16 && chunk_infos[h_n + 15].free_length == 16);
+    bassert(huge_free_bytes == 16*chunksize);
+    bassert(do_get_extent(0, 16, 1) == h_n);
+    bassert(huge_free_bytes == 0);
+
+    memcpy(free_extents[0], saved_extents, sizeof(saved_extents));
+    huge_free_bytes = saved_free_bytes;
+
+    // Past the retention limit, the coalesced extents are unmapped.
+    uint64_t saved_retain_max = huge_retain_max;
+    huge_retain_max = 0;
+    huge_free(g);
+    bassert(huge_free_bytes <= saved_free_bytes);
+    bassert(!chunk_is_free(g_n));
+    bassert(msync(g, pagesize, MS_ASYNC) == -1 && errno == ENOMEM);
+    huge_retain_max = saved_retain_max;
+  }
 }
 #endif
@@ -2,12 +2,15 @@
 #include <stdio.h>
 #endif
 
-#include <sys/mman.h>
+#include <time.h>
 
 #include "atomically.h"
 #include "bassert.h"
 #include "generated_constants.h"
+#include "latency.h"
 #include "malloc_internal.h"
+#include "numa.h"
+#include "purge.h"
 
 #ifdef ENABLE_LOG_CHECKING
 static void log_command(char command, const void *ptr);
@@ -16,33 +19,166 @@ static void log_command(char command, const void *ptr);
 #endif
 
 static const binnumber_t n_large_classes = first_huge_bin_number - first_large_bin_number;
-static large_object_list_cell* free_large_objects[n_large_classes]; // For each large size, a list (threaded through the chunk headers) of all the free objects of that size.
-// Later we'll be a little careful about purging those large objects (and we'll need to remember which are which, but we may also want thread-specific parts).  For now, just purge them all.
+static tagged_head<large_object_list_cell*> free_large_objects[numa_node_limit][n_large_classes]; // For each node and large size, a list (threaded through the chunk headers) of all the free objects of that size whose pages have been purged.  The tag is used only in MODE_LOCKFREE.  Without NUMA mode, there is just node 0.
+
+// Freeing a large object doesn't give its pages back right away.
+// Instead the object goes onto a dirty list, newest first, stamped
+// with the time it was freed, and large_malloc() reuses dirty objects
+// before clean ones (so a program that churns through large objects
+// doesn't take a page fault on every page it touches).  The dirty
+// objects are purged (madvised and moved to the free_large_objects
+// lists) once they have been free for large_decay_ms, or, starting
+// with the biggest sizes, whenever the dirty objects add up to more
+// than large_dirty_max bytes.  Who purges by age is up to the purger
+// (see purge.h).
+static tagged_head<large_object_list_cell*> dirty_large_objects[numa_node_limit][n_large_classes];
+static int64_t large_dirty_bytes = 0; // Can be briefly negative, since a malloc may pop an object before its free has counted it.
+static uint64_t large_decay_due = 0; // When the next purge by age should happen (in ms).
+
+uint64_t large_decay_ms = 1000; // 0 means purge each object as it is freed.
+uint64_t large_dirty_max = 64ul<<20;
 
 static lock_t large_lock = LOCK_INITIALIZER;
 
-void predo_large_malloc_pop(large_object_list_cell **free_head) {
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+}
+
+void predo_large_malloc_pop(tagged_head<large_object_list_cell*> *free_head) {
   // For the predo, we basically want to look at the free head (and make it writeable) and
   // read the next pointer (but only if the free-head is non-null, since the free-head could
   // have become null by now, and we would need to allocate another chunk.)
-  large_object_list_cell *h = *free_head;
+  large_object_list_cell *h = free_head->value;
   if (h != NULL) {
     prefetch_write(free_head);
     prefetch_read(h);
   }
 }
 
-large_object_list_cell* do_large_malloc_pop(large_object_list_cell **free_head) {
-  large_object_list_cell *h = *free_head;
+large_object_list_cell* do_large_malloc_pop(tagged_head<large_object_list_cell*> *free_head) {
+  large_object_list_cell *h = free_head->value;
   if (0) printf(" dlmp: h=%p\n", h);
   if(h == NULL) {
     return NULL;
   } else {
-    *free_head = h->next;
+    free_head->value = h->next;
     return h;
   }
 }
 
+static large_object_list_cell* large_pop(tagged_head<large_object_list_cell*> *free_head)
+// Effect: Pop an object off free_head, or return NULL if it is empty.
+{
+  while (atomic_load(&free_head->value) != NULL) {
+    // This needs to be done atomically (along the successful branch).
+    // It cannot be done with a plain compare-and-swap since we read two locations that
+    // are visible to other threads (getting h, and getting h->next).  In MODE_LOCKFREE
+    // we use the tag in free_head to make the compare-and-swap work.
+    large_object_list_cell *h;
+    if (mode == MODE_LOCKFREE) {
+      h = lockfree_pop(free_head);
+    } else {
+      h = atomically(&large_lock,
+		     ATOMIC_SITE("large_malloc_pop"),
+		     predo_large_malloc_pop,
+		     do_large_malloc_pop,
+		     free_head);
+    }
+    if (h != NULL) return h;
+    // Otherwise the list became empty, so go look again.
+  }
+  return NULL;
+}
+
+static large_object_list_cell* large_pop_all(tagged_head<large_object_list_cell*> *free_head)
+// Effect: Empty free_head and return what was on it.
+{
+  if (mode == MODE_LOCKFREE) {
+    return lockfree_pop_all(free_head);
+  } else {
+    // Keep out the pops, which don't bump the tag.
+    mylock_raii m(&large_lock);
+    return lockfree_pop_all(free_head);
+  }
+}
+
+static void* large_cell_2_address(large_object_list_cell *h, size_t usable_size) {
+  void* chunk = address_2_chunkaddress(h);
+  if (0) printf("chunk=%p\n", chunk);
+  large_object_list_cell *chunk_as_list_cell = reinterpret_cast<large_object_list_cell*>(chunk);
+  size_t offset = h-chunk_as_list_cell;
+  if (0) printf("offset=%ld\n", offset);
+  return reinterpret_cast<void*>(reinterpret_cast<char*>(chunk) + offset_of_first_object_in_large_chunk + offset * usable_size);
+}
+
+static uint64_t large_purge_list(binnumber_t b, uint32_t node, uint64_t now, uint64_t min_age_ms)
+// Effect: Purge the objects on the dirty list for node and bin b that
+//  have been free for at least min_age_ms.  Return the number of
+//  madvise calls.
+{
+  tagged_head<large_object_list_cell*> *dirty_head = &dirty_large_objects[node][b - first_large_bin_number];
+  if (atomic_load(&dirty_head->value) == NULL) return 0;
+  large_object_list_cell *h = large_pop_all(dirty_head);
+  if (h == NULL) return 0;
+  // The list is newest first, so put back the prefix that is too young.
+  // (Frees that happen meanwhile end up behind that prefix, which only
+  // means that they may be purged a little late.)
+  large_object_list_cell *young_last = NULL;
+  large_object_list_cell *old = h;
+  while (old != NULL && min_age_ms > 0 && now < old->dirty_since + min_age_ms) {
+    young_last = old;
+    old = old->next;
+  }
+  if (young_last != NULL) {
+    young_last->next = NULL;
+    lockfree_push(dirty_head, h, young_last);
+  }
+  if (old == NULL) return 0;
+  size_t usable_size = bin_2_size(b);
+  uint64_t n_calls = 0, n_bytes = 0;
+  large_object_list_cell *old_last = NULL;
+  for (large_object_list_cell *c = old; c != NULL; ) {
+    // Objects whose cells are adjacent are adjacent, so madvise each such run at once.
+    large_object_list_cell *run_end = c;
+    while (run_end->next == run_end+1) run_end = run_end->next;
+    size_t run_size = (run_end - c + 1) * usable_size;
+    uint64_t start = latency_start();
+    purge_pages(large_cell_2_address(c, usable_size), run_size);
+    note_latency(latency_madvise_large, start);
+    n_calls++;
+    n_bytes += run_size;
+    old_last = run_end;
+    c = run_end->next;
+  }
+  __sync_fetch_and_sub(&large_dirty_bytes, n_bytes);
+  lockfree_push(&free_large_objects[node][b - first_large_bin_number], old, old_last);
+  return n_calls;
+}
+
+uint64_t large_purge(uint64_t min_age_ms, uint64_t dirty_target) {
+  uint64_t now = now_ms();
+  uint64_t n_calls = 0;
+  for (binnumber_t b = first_huge_bin_number; b-- > first_large_bin_number; ) {
+    for (uint32_t node = 0; node < numa_node_limit; node++) {
+      if (atomic_load(&large_dirty_bytes) <= static_cast<int64_t>(dirty_target)) return n_calls;
+      n_calls += large_purge_list(b, node, now, min_age_ms);
+    }
+  }
+  return n_calls;
+}
+
+void large_purge_if_due() {
+  uint64_t now = now_ms();
+  uint64_t due = atomic_load(&large_decay_due);
+  if (now < due) return;
+  // Only one thread gets to do each purge.
+  if (!__sync_bool_compare_and_swap(&large_decay_due, due, now + large_decay_ms/4 + 1)) return;
+  if (atomic_load(&large_dirty_bytes) <= 0) return;
+  large_purge(large_decay_ms, 0);
+}
+
 void* large_malloc(size_t size)
 // Effect: Allocate a large object (page allocated, multiple per chunk)
 // Implementation notes: Since it is page allocated, any page is as
@@ -58,43 +194,25 @@ void* large_malloc(size_t size)
   bassert(b >= first_large_bin_number);
   bassert(b < first_huge_bin_number);
 
-  large_object_list_cell **free_head = &free_large_objects[b - first_large_bin_number];
+  uint32_t node = numa_current_node();
+  tagged_head<large_object_list_cell*> *dirty_head = &dirty_large_objects[node][b - first_large_bin_number];
+  tagged_head<large_object_list_cell*> *free_head  = &free_large_objects[node][b - first_large_bin_number];
 
   while (1) { // Keep going until we find a free object and return it.
-  
-    // This needs to be done atomically (along the successful branch).
-    // It cannot be done with a compare-and-swap since we read two locations that
-    // are visible to other threads (getting h, and getting h->next).
-    large_object_list_cell *h = *free_head;
+    large_object_list_cell *h = large_pop(dirty_head);
+    if (h != NULL) {
+      __sync_fetch_and_sub(&large_dirty_bytes, usable_size);
+    } else {
+      h = large_pop(free_head);
+    }
     if (0) printf("h==%p\n", h);
     if (h != NULL) {
-      if (0) {
-	// This is what we want the atomic code below to do.
-	// The atomic code will have to re-read *free_head to get h again.
-	*free_head = h->next;
-      } else {
-	// The strategy for the atomic version is that we set e.result to NULL if the list
-	// becomes empty (so that we go around and do chunk allocation again).
-
-	h = atomically(&large_lock,
-		       "large_malloc_pop",
-		       predo_large_malloc_pop,
-		       do_large_malloc_pop,
-		       free_head);
-	if (h==NULL) continue; // Go try again
-      }
-      // that was the atomic part.
       h->footprint = footprint;
       add_to_footprint(footprint);
       if (0) printf("setting its footprint to %d\n", h->footprint);
       if (0) printf("returning the page corresponding to %p\n", h);
-      void* chunk = address_2_chunkaddress(h);
-      if (0) printf("chunk=%p\n", chunk);
-      large_object_list_cell *chunk_as_list_cell = reinterpret_cast<large_object_list_cell*>(chunk);
-      size_t offset = h-chunk_as_list_cell;
-      if (0) printf("offset=%ld\n", offset);
-      void* address = reinterpret_cast<void*>(reinterpret_cast<char*>(chunk) + offset_of_first_object_in_large_chunk + offset * usable_size);
-      bassert(address_2_chunknumber(address)==address_2_chunknumber(chunk));
+      void* address = large_cell_2_address(h, usable_size);
+      bassert(address_2_chunknumber(address)==address_2_chunknumber(h));
       if (0) printf("result=%p\n", address);
       bassert(bin_from_bin_and_size(chunk_infos[address_2_chunknumber(address)].bin_and_size) == b);
       log_command('a', address);
@@ -102,7 +220,21 @@ void* large_malloc(size_t size)
     } else {
       // No already free objects.  Get a chunk
       void *chunk = mmap_chunk_aligned_block(1);
+      if (chunk == NULL && n_numa_nodes > 1) {
+	// Our node is exhausted, so use another node's free objects if there are any.
+	bool found = false;
+	for (uint32_t other = 1; other < n_numa_nodes && !found; other++) {
+	  uint32_t other_node = (node + other) % n_numa_nodes;
+	  dirty_head = &dirty_large_objects[other_node][b - first_large_bin_number];
+	  free_head  = &free_large_objects[other_node][b - first_large_bin_number];
+	  found = atomic_load(&dirty_head->value) != NULL || atomic_load(&free_head->value) != NULL;
+	}
+	if (found) continue;
+      }
       bassert(chunk);
+      uint32_t chunk_node = chunk_numa_node(address_2_chunknumber(chunk));
+      dirty_head = &dirty_large_objects[chunk_node][b - first_large_bin_number];
+      free_head  = &free_large_objects[chunk_node][b - first_large_bin_number];
       if (0) printf("chunk=%p\n", chunk);
 
       if (0) printf("usable_size=%ld\n", usable_size);
@@ -123,17 +255,10 @@ void* large_malloc(size_t size)
 
       // Do this atomically. 
       if (0) {
-	entry[objects_per_chunk-1].next = *free_head;
-	*free_head = &entry[0];
+	entry[objects_per_chunk-1].next = free_head->value;
+	free_head->value = &entry[0];
       } else {
-	while (1) {
-	  large_object_list_cell *old_first = *free_head;
-	  entry[objects_per_chunk-1].next = old_first;
-	  if (__sync_bool_compare_and_swap(free_head,
-					   old_first,
-					   &entry[0]))
-	    break;
-	}
+	lockfree_push(free_head, &entry[0], &entry[objects_per_chunk-1]);
       }
     
       if (0) printf("Got object\n");
@@ -167,7 +292,11 @@ void large_free(void *p) {
   binnumber_t bin = bin_from_bin_and_size(b_and_s);
   bassert(first_large_bin_number <= bin  && bin < first_huge_bin_number);
   uint64_t usable_size = bin_2_size(bin);
-  madvise(p, usable_size, MADV_DONTNEED);
+  if (large_decay_ms == 0) {
+    uint64_t start = latency_start();
+    purge_pages(p, usable_size);
+    note_latency(latency_madvise_large, start);
+  }
   uint64_t offset = offset_in_chunk(p);
   uint64_t        objnum = divide_offset_by_objsize(offset-offset_of_first_object_in_large_chunk, bin);
   if (IS_TESTING) {
@@ -177,22 +306,25 @@ void large_free(void *p) {
   large_object_list_cell *entries = reinterpret_cast<large_object_list_cell*>(address_2_chunkaddress(p));
   uint32_t footprint = entries[objnum].footprint;
   add_to_footprint(-static_cast<int64_t>(footprint));
-  large_object_list_cell **h = &free_large_objects[bin - first_large_bin_number];
+  uint32_t node = chunk_numa_node(address_2_chunknumber(p));
   large_object_list_cell *ei = entries+objnum;
-  // This part atomic. Can be done with compare_and_swap
-  if (0) {
-    ei->next = *h;
-    *h = ei;
-  } else {
-    while (1) {
-      large_object_list_cell *first = atomic_load(h);
-      ei->next = first;
-      if (__sync_bool_compare_and_swap(h, first, ei)) break;
-    }
+  if (large_decay_ms == 0) {
+    lockfree_push(&free_large_objects[node][bin - first_large_bin_number], ei, ei);
+    return;
+  }
+  ei->dirty_since = now_ms();
+  lockfree_push(&dirty_large_objects[node][bin - first_large_bin_number], ei, ei);
+  int64_t dirty = __sync_add_and_fetch(&large_dirty_bytes, usable_size);
+  if (dirty > static_cast<int64_t>(large_dirty_max)) {
+    // Over budget: purge (regardless of age) down to half the budget, so that we don't do this on every free.
+    large_purge(0, large_dirty_max/2);
+  } else if (purger == PURGER_INLINE) {
+    large_purge_if_due();
+  } else if (purger == PURGER_THREAD) {
+    start_purge_thread();
   }
 }
 
-
 void test_large_malloc(void) {
   size_t msize = 4*pagesize;
   int64_t fp = get_footprint();
@@ -280,6 +412,24 @@ void test_large_malloc(void) {
     large_free(y);
   }
   bassert(get_footprint() - fp == 0);
+  if (large_decay_ms > 0) {
+    // Freed objects stay resident until they are purged.
+    char *x = reinterpret_cast<char*>(large_malloc(msize));
+    char *y = reinterpret_cast<char*>(large_malloc(msize));
+    x[0] = y[msize-1] = 1;
+    large_free(x);
+    large_free(y);
+    bassert(atomic_load(&large_dirty_bytes) >= static_cast<int64_t>(2*msize));
+    bassert(x[0] == 1 && y[msize-1] == 1);
+    large_purge(0, 0);
+    bassert(atomic_load(&large_dirty_bytes) <= 0);
+    if (purge_mode == PURGE_DONTNEED) bassert(x[0] == 0 && y[msize-1] == 0);
+    // And then they come off the clean list.
+    void *z = large_malloc(msize);
+    bassert(z == x || z == y);
+    large_free(z);
+  }
+  bassert(get_footprint() - fp == 0);
 }
 
 #ifdef ENABLE_LOG_CHECKING
@@ -0,0 +1,141 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include "atomically.h"
+#include "bassert.h"
+#include "latency.h"
+#include "malloc_internal.h"
+#include "thread_block.h"
+
+bool use_latency = false;
+
+static const char *latency_path_names[latency_path_limit] = {
+  "malloc thread cache",
+  "malloc cpu cache",
+  "malloc shared cache",
+  "malloc small",
+  "malloc large",
+  "malloc huge",
+  "free thread cache",
+  "free cpu cache",
+  "free shared cache",
+  "free small",
+  "free large",
+  "mmap chunk",
+  "madvise small",
+  "madvise large",
+};
+
+struct latency_block {
+  uint64_t cycles[latency_path_limit];
+  uint64_t counts[latency_path_limit][latency_buckets];
+};
+
+static __thread latency_block *thread_latency_block = NULL;
+
+static void forget_latency_block() {
+  thread_latency_block = NULL;
+}
+
+static thread_block_pool latency_blocks = THREAD_BLOCK_POOL_INITIALIZER(sizeof(latency_block), forget_latency_block);
+
+static latency_block *get_latency_block()
+// Effect: Return this thread's block, getting one from the pool if the
+//  thread doesn't have one yet.  Returns NULL if we are out of memory.
+{
+  latency_block *b = thread_latency_block;
+  if (__builtin_expect(b != NULL, 1)) return b;
+  b = reinterpret_cast<latency_block*>(thread_block_get(&latency_blocks));
+  thread_latency_block = b;
+  return b;
+}
+
+void record_latency(latency_path path, uint64_t cycles) {
+  latency_block *b = get_latency_block();
+  if (b == NULL) return;
+  b->cycles[path] += cycles;
+  b->counts[path][cycles ? 64 - __builtin_clzl(cycles) : 0]++;
+}
+
+uint64_t latency_count(latency_path path, uint32_t bucket) {
+  uint64_t sum = 0;
+  for (thread_block *t = thread_block_all(&latency_blocks); t; t = t->next_all) {
+    sum += thread_block_data<latency_block>(t)->counts[path][bucket]; // We don't care if the answer is slightly stale.
+  }
+  return sum;
+}
+
+void print_latency() {
+  fprintf(stderr, "latency: path: n_calls mean_cycles, then count for each bucket of <2^k cycles\n");
+  for (uint32_t path = 0; path < latency_path_limit; path++) {
+    uint64_t counts[latency_buckets] = {0};
+    uint64_t n = 0, cycles = 0;
+    for (thread_block *t = thread_block_all(&latency_blocks); t; t = t->next_all) {
+      latency_block *b = thread_block_data<latency_block>(t);
+      cycles += b->cycles[path];
+      for (uint32_t k = 0; k < latency_buckets; k++) counts[k] += b->counts[path][k];
+    }
+    for (uint32_t k = 0; k < latency_buckets; k++) n += counts[k];
+    if (n == 0) continue;
+    fprintf(stderr, "%s: %lu %.0f\n", latency_path_names[path], n, (double)cycles/(double)n);
+    for (uint32_t k = 0; k < latency_buckets; k++) {
+      if (counts[k]) fprintf(stderr, "  <2^%u: %lu\n", k, counts[k]);
+    }
+  }
+}
+
+// Like the statistics, the histograms are printed by a destructor.
+__attribute__((destructor))
+static void print_latency_at_exit() {
+  if (use_latency) print_latency();
+}
+
+#ifdef TESTING
+static void* record_in_thread(void *arg __attribute__((unused))) {
+  record_latency(latency_mmap_chunk, 1000);
+  return NULL;
+}
+
+extern "C" void test_latency() {
+  bool saved_use_latency = use_latency;
+  use_latency = false;
+  uint64_t start = latency_start();
+  bassert(start == 0);
+  uint64_t before = latency_count(latency_mmap_chunk, 0);
+  note_latency(latency_mmap_chunk, start);
+  bassert(latency_count(latency_mmap_chunk, 0) == before);
+
+  // Bucket k holds [2^(k-1), 2^k).
+  before = latency_count(latency_mmap_chunk, 10);
+  record_latency(latency_mmap_chunk, 512);
+  record_latency(latency_mmap_chunk, 1023);
+  bassert(latency_count(latency_mmap_chunk, 10) == before + 2);
+  before = latency_count(latency_mmap_chunk, 1);
+  record_latency(latency_mmap_chunk, 1);
+  bassert(latency_count(latency_mmap_chunk, 1) == before + 1);
+
+  use_latency = true;
+  start = latency_start();
+  bassert(start != 0);
+  uint64_t total = 0;
+  for (uint32_t k = 0; k < latency_buckets; k++) total += latency_count(latency_madvise_large, k);
+  note_latency(latency_madvise_large, start);
+  for (uint32_t k = 0; k < latency_buckets; k++) total -= latency_count(latency_madvise_large, k);
+  bassert(total == -1ul);
+
+  // A thread's counts outlive it, and its block is reused.
+  before = latency_count(latency_mmap_chunk, 10);
+  pthread_t t;
+  bassert(pthread_create(&t, NULL, record_in_thread, NULL) == 0);
+  pthread_join(t, NULL);
+  bassert(latency_count(latency_mmap_chunk, 10) == before + 1);
+  thread_block *b = atomic_load(&latency_blocks.free.value);
+  bassert(b != NULL && thread_block_data<latency_block>(b) != thread_latency_block);
+  bassert(pthread_create(&t, NULL, record_in_thread, NULL) == 0);
+  pthread_join(t, NULL);
+  bassert(latency_count(latency_mmap_chunk, 10) == before + 2);
+  bassert(atomic_load(&latency_blocks.free.value) == b);
+
+  use_latency = saved_use_latency;
+}
+#endif
@@ -0,0 +1,79 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+// Latency histograms (SUPERMALLOC_LATENCY=1).
+//
+// We time each malloc and free with rdtsc, and count the time in a
+// histogram for the path that satisfied the call: the thread cache,
+// the cpu cache, the shared (llc domain or global) cache, or the
+// underlying small, large, or huge allocator.  We also time the
+// expensive system calls (mapping chunks and madvising folios and
+// large objects) separately.  The buckets are powers of two: a call
+// that took c cycles goes into bucket 64-clz(c), so bucket k counts the
+// calls that took [2^(k-1), 2^k) cycles.
+//
+// Each thread counts into a histogram block of its own.  The blocks
+// are never freed: when a thread exits, its block goes onto a free
+// list for the next thread to count into, so the counts of exited
+// threads are still there when we merge all the blocks and print the
+// histograms on stderr at exit.
+//
+// When the histograms are off, a timed call costs a load and a branch
+// that isn't taken at the start and a test of a register at the end.
+
+#include <stdint.h>
+
+enum latency_path {
+  latency_malloc_thread_cache,
+  latency_malloc_cpu_cache,
+  latency_malloc_shared_cache,
+  latency_malloc_small,
+  latency_malloc_large,
+  latency_malloc_huge,
+  latency_free_thread_cache,
+  latency_free_cpu_cache,
+  latency_free_shared_cache,
+  latency_free_small,
+  latency_free_large,
+  latency_mmap_chunk,
+  latency_madvise_small,
+  latency_madvise_large,
+  latency_path_limit
+};
+
+const uint32_t latency_buckets = 65;
+
+extern bool use_latency;
+
+static inline uint64_t rdtsc() {
+  uint32_t hi, lo;
+  __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+  return (((uint64_t)lo) | (((uint64_t)hi) << 32));
+}
+
+static inline uint64_t latency_start()
+// Effect: Return the time, or 0 if we aren't keeping histograms.
+{
+  if (__builtin_expect(use_latency, 0)) return rdtsc();
+  return 0;
+}
+
+void record_latency(latency_path path, uint64_t cycles);
+// Effect: Count a call that took cycles in path's histogram in this
+//  thread's block.
+
+static inline void note_latency(latency_path path, uint64_t start)
+// Effect: If start came from latency_start() while the histograms
+//  were on, count the time since start in path's histogram.
+{
+  if (__builtin_expect(start != 0, 0)) record_latency(path, rdtsc() - start);
+}
+
+uint64_t latency_count(latency_path path, uint32_t bucket);
+// Effect: Return the count in bucket of path's histogram, summed over
+//  all the threads.  The answer may be slightly stale.
+
+void print_latency();
+// Effect: Print the merged histograms on stderr.
+
+#endif
@@ -5,6 +5,8 @@
 #include "malloc_internal.h"
 #include "bassert.h"
 #include "generated_constants.h"
+#include "latency.h"
+#include "numa.h"
 
 #ifdef TESTING
 #include <string.h>
@@ -65,7 +67,7 @@ static void *chunk_create_slow(size_t n_chunks) {
   }
 }
 
-void *mmap_chunk_aligned_block(size_t n_chunks)
+static void *mmap_chunk_aligned_block_untimed(size_t n_chunks)
 // Effect: Return a pointer to a chunk.
 //   The chunk is in a purged-stated (not in memory, zero-fill-on-demand).
 //   The chunk might map as either a huge page or a lot of little
@@ -93,11 +95,19 @@ void *mmap_chunk_aligned_block(size_t n_chunks)
   if (offset_in_chunk(r) != 0) {
     // Do it the slow way.
     unmap(r, n_chunks*chunksize);
-    return chunk_create_slow(n_chunks);
-  } else {
-    //printf("%s:%d returning %p\n", __FILE__, __LINE__, r);
-    return r;
+    r = chunk_create_slow(n_chunks);
+    if (r == NULL) return NULL;
   }
+  //printf("%s:%d returning %p\n", __FILE__, __LINE__, r);
+  numa_bind_chunks(r, n_chunks, numa_current_node());
+  return r;
+}
+
+void *mmap_chunk_aligned_block(size_t n_chunks) {
+  uint64_t start = latency_start();
+  void *r = mmap_chunk_aligned_block_untimed(n_chunks);
+  note_latency(latency_mmap_chunk, start);
+  return r;
 }
 
 void test_makechunk(void) {
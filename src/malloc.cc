@@ -17,6 +17,13 @@
 #include "cpucores.h"
 #include "generated_constants.h"
 #include "has_tsx.h"
+#include "heap_profile.h"
+#include "latency.h"
+#include "purge.h"
+#include "rseq.h"
+#include "numa.h"
+#include "stats.h"
+#include "topology.h"
 
 #ifndef PREFIX
 #define PREFIXIFY(f) f
@@ -76,43 +83,6 @@ struct chunk_info *chunk_infos;
 
 uint32_t n_cores;
 
-#ifdef DO_FAILED_COUNTS
-atomic_stats_s atomic_stats;
-
-lock_t failed_counts_mutex = LOCK_INITIALIZER;
-int    failed_counts_n = 0;
-struct failed_counts_s failed_counts[max_failed_counts];
-
-int compare_failed_counts(const void *a_v, const void *b_v) {
-  const failed_counts_s *a = reinterpret_cast<const failed_counts_s*>(a_v);
-  const failed_counts_s *b = reinterpret_cast<const failed_counts_s*>(b_v);
-  int r = strcmp(a->name, b->name);
-  if (r!=0) return r;
-  if (a->code < b->code) return -1;
-  if (a->code > b->code) return +1;
-  return 0;
-}
-#endif
-
-#if 0
-static void print_atomic_stats() {
-#if defined(DO_FAILED_COUNTS) && defined(TESTING)
-  fprintf(stderr, "Critical sections: %ld, locked %ld\n", atomic_stats.atomic_count, atomic_stats.locked_count);
-  qsort(failed_counts, failed_counts_n, sizeof(failed_counts[0]), compare_failed_counts);
-  for (int i = 0; i < failed_counts_n; i++) {
-    fprintf(stderr, " %38s: 0x%08x %5ld\n", failed_counts[i].name, failed_counts[i].code, failed_counts[i].count);
-  }
-#endif
-}
-#endif
-
-#ifdef ENABLE_STATS
-static void print_stats() {
-  print_cache_stats();
-  print_bin_stats();
-}
-#endif
-
 #ifdef ENABLE_LOG_CHECKING
 static void check_log() {
   check_log_large();
@@ -140,10 +110,6 @@ void initialize_malloc() {
   // initialized.  (Which makes sense if the libraries have
   // initializers that malloc: they aren't yet initialized...)
 
-  //  atexit(print_atomic_stats);
-  //#ifdef ENABLE_STATS
-  //  atexit(print_stats);
-  //#endif
   //#ifdef ENABLE_LOG_CHECKING
   //  atexit(check_log);
   //#endif
@@ -156,7 +122,13 @@ void initialize_malloc() {
   chunk_infos = (chunk_info*)mmap_chunk_aligned_block(n_chunks);
   bassert(chunk_infos);
 
+  init_cpu_slots();
+  init_cpu_caches();
+  init_counters();
+
   n_cores = cpucores();
+  n_small_shards = n_cpu_slots;
+  init_llc_domains("/sys/devices/system/cpu");
 
   {
     char *v = getenv("SUPERMALLOC_TRANSACTIONS");
@@ -188,6 +160,123 @@ void initialize_malloc() {
       }
     }
   }
+  {
+    char *v = getenv("SUPERMALLOC_SMALL_SHARDS");
+    if (v) {
+      long n = atol(v);
+      if (n >= 1) n_small_shards = std::min(static_cast<uint32_t>(n), cpu_id_limit);
+    }
+  }
+  init_small_shards();
+  {
+    char *v = getenv("SUPERMALLOC_PURGE");
+    if (v) {
+      if (strcmp(v, "dontneed")==0) {
+	purge_mode = PURGE_DONTNEED;
+      } else if (strcmp(v, "free")==0) {
+	purge_mode = PURGE_FREE;
+      } else if (strcmp(v, "none")==0) {
+	purge_mode = PURGE_NONE;
+      }
+    }
+  }
+  {
+    char *v = getenv("SUPERMALLOC_PURGER");
+    if (v) {
+      if (strcmp(v, "inline")==0) {
+	purger = PURGER_INLINE;
+      } else if (strcmp(v, "thread")==0) {
+	purger = PURGER_THREAD;
+      } else if (strcmp(v, "user")==0) {
+	purger = PURGER_USER;
+      }
+    }
+  }
+  {
+    char *v = getenv("SUPERMALLOC_PURGE_INTERVAL_MS");
+    if (v) {
+      long n = atol(v);
+      if (n >= 1) purge_interval_ms = n;
+    }
+  }
+  {
+    char *v = getenv("SUPERMALLOC_LARGE_DECAY_MS");
+    if (v) {
+      long n = atol(v);
+      if (n >= 0) large_decay_ms = n;
+    }
+  }
+  {
+    char *v = getenv("SUPERMALLOC_LARGE_DIRTY_MAX");
+    if (v) {
+      long n = atol(v);
+      if (n >= 0) large_dirty_max = n;
+    }
+  }
+  {
+    char *v = getenv("SUPERMALLOC_HUGE_RETAIN_MAX");
+    if (v) {
+      long n = atol(v);
+      if (n >= 0) huge_retain_max = n;
+    }
+  }
+  {
+    char *v = getenv("SUPERMALLOC_RSEQ");
+    if (v) {
+      if (strcmp(v, "0")==0) {
+	use_rseq = false;
+      } else if (strcmp(v, "1")==0) {
+	use_rseq = true;
+      }
+    }
+  }
+
+  {
+    char *v = getenv("SUPERMALLOC_NUMA");
+    if (v) {
+      if (strcmp(v, "0")==0) {
+	use_numa = false;
+      } else if (strcmp(v, "1")==0) {
+	use_numa = true;
+      }
+    }
+  }
+  if (use_numa) init_numa("/sys/devices/system/node");
+
+  {
+    char *v = getenv("SUPERMALLOC_HEAP_PROFILE_INTERVAL");
+    if (v) {
+      long n = atol(v);
+      if (n >= 1) heap_profile_interval = n;
+    }
+  }
+  {
+    char *v = getenv("SUPERMALLOC_HEAP_PROFILE");
+    if (v && *v) {
+      use_heap_profile = true;
+      init_heap_profile(v);
+    }
+  }
+  {
+    char *v = getenv("SUPERMALLOC_STATS");
+    if (v) {
+      if (strcmp(v, "0")==0) {
+	use_stats = false;
+      } else if (strcmp(v, "1")==0) {
+	use_stats = true;
+      }
+    }
+  }
+  {
+    char *v = getenv("SUPERMALLOC_LATENCY");
+    if (v) {
+      if (strcmp(v, "0")==0) {
+	use_latency = false;
+      } else if (strcmp(v, "1")==0) {
+	use_latency = true;
+      }
+    }
+  }
 
   free_p = (void(*)(void*)) (dlsym(RTLD_NEXT, "free"));
 }
@@ -238,12 +327,7 @@ static uint64_t max_allocatable_size = (chunksize << 27)-1;
 //   BIG, used for large allocations.  These are 2MB-aligned chunks.  We use BIG for anything bigger than a quarter of a chunk.
 //   SMALL fit within a chunk.  Everything within a single chunk is the same size.
 // The sizes are the powers of two (1<<X) as well as (1<<X)*1.25 and (1<<X)*1.5 and (1<<X)*1.75
-extern "C" void* MALLOC(size_t size) {
-  maybe_initialize_malloc();
-  if (size >= max_allocatable_size) {
-    errno = ENOMEM;
-    return NULL;
-  }
+static void* malloc_unsampled(size_t size) {
   if (size < largest_small) {
     binnumber_t bin = size_2_bin(size);
     size_t siz = bin_2_size(bin);
@@ -265,13 +349,32 @@ extern "C" void* MALLOC(size_t size) {
       if (result == NULL) return NULL;
       return reinterpret_cast<char*>(result) + misalignment;
     } else {
+      uint64_t start = latency_start();
       void *result = huge_malloc(allocate_size);
+      note_latency(latency_malloc_huge, start);
       if (result == NULL) return result;
       return reinterpret_cast<char*>(result) + misalignment;
     }
   }
 }
 
+__attribute__((noinline))
+static void* sampled_malloc(size_t size) {
+  void *result = malloc_unsampled(size);
+  if (heap_profile_start_sample()) heap_profile_record(result, size);
+  return result;
+}
+
+extern "C" void* MALLOC(size_t size) {
+  maybe_initialize_malloc();
+  if (size >= max_allocatable_size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (should_sample(size)) return sampled_malloc(size);
+  return malloc_unsampled(size);
+}
+
 extern "C" void FREE(void *p) {
   maybe_initialize_malloc();
   if (p == NULL) return;
@@ -291,6 +394,7 @@ extern "C" void FREE(void *p) {
       abort();
     }
   }
+  heap_profile_maybe_forget(p, cn);
   binnumber_t bin = bin_from_bin_and_size(bnt);
   bassert(!(offset_in_chunk(p) == 0 && bin==0)); // we cannot have a bin 0 item that is chunk-aligned
   if (bin < first_huge_bin_number) {
@@ -360,8 +464,13 @@ extern "C" void* CALLOC(size_t number, size_t size) {
     // If the base object is page aligned, and the usable amount isn't page aligned, it's still pretty small, so just zero it.
     bassert(usable_from_base < chunksize);
     memset(result, 0, number*size);
+  } else if (purge_mode != PURGE_DONTNEED && usable_from_base < chunksize) {
+    // The pages may be left over from a purge that didn't zero them
+    // (see purge.h), and the object is small enough that touching it
+    // is no worse than faulting it back in.
+    memset(result, 0, number*size);
   } else {
-    // everything is page aligned.
+    // everything is page aligned.  MADV_DONTNEED zeroes the pages, whatever purge_mode is.
     madvise(base, usable_from_base, MADV_DONTNEED);
   }
   return result;
@@ -396,11 +505,9 @@ static void* aligned_malloc_internal(size_t alignment, size_t size) {
   // We fell out the bottom.  We'll use a huge block.
   if (alignment <= chunksize) {
     // huge blocks are naturally aligned properly.
-    return huge_malloc(size); // huge blocks are always naturally aligned.
+    return huge_malloc(size); // huge blocks are always chunk aligned.
   } else {
-    // huge blocks are naturally powers of two, but they aren't always aligned.  Allocate something big enough to align it.
-    // huge_malloc sets all the intermediate spots to bin -1 to indicate that it's not really the beginning.
-    void *r = huge_malloc(std::max(alignment, size)); // this will be aligned.  The bookkeeping will be messed up if alignment>size, however.
+    void *r = huge_malloc_aligned(size, alignment);
     if (r == NULL) return NULL;
     bassert((reinterpret_cast<uint64_t>(r) & (alignment-1)) == 0); // make sure it is aligned
     return r;
@@ -468,7 +575,7 @@ extern "C" size_t MALLOC_USABLE_SIZE(const void *ptr) {
   const char *base = reinterpret_cast<const char*>(object_base(const_cast<void*>(ptr)));
   bassert(address_2_chunknumber(base)==cn);
   const char *ptr_c = reinterpret_cast<const char*>(ptr);
-  ssize_t base_size = bin_2_size(bin);
+  ssize_t base_size = (bin < first_huge_bin_number) ? bin_2_size(bin) : huge_n_chunks(b_and_s)*chunksize;
   bassert(base <= ptr);
   bassert(base_size >= ptr_c-base);
   return base_size - (ptr_c-base);
@@ -480,12 +587,15 @@ static void test_malloc_usable_size_internal(size_t given_s) {
   size_t as = MALLOC_USABLE_SIZE(a);
   char *base = reinterpret_cast<char*>(object_base(a));
   binnumber_t b = size_2_bin(MALLOC_USABLE_SIZE(base));
-  bassert(MALLOC_USABLE_SIZE(base) == bin_2_size(b));
   bassert(MALLOC_USABLE_SIZE(base) + base == MALLOC_USABLE_SIZE(a) + a);  
   if (b < first_huge_bin_number) {
+    bassert(MALLOC_USABLE_SIZE(base) == bin_2_size(b));
     bassert(address_2_chunknumber(a) == address_2_chunknumber(a+as-1));
   } else {
+    // Huge objects get exactly the chunks they need.
     bassert(offset_in_chunk(base) == 0);
+    bassert(MALLOC_USABLE_SIZE(base) % chunksize == 0);
+    bassert(as >= given_s && as < given_s + chunksize);
   }
   FREE(a);
 }
@@ -96,25 +96,45 @@ extern struct chunk_info {
     bin_and_size_t bin_and_size;
     chunknumber_t next; // Forms a linked list.
   };
+  chunknumber_t prev;        // The list is doubly linked.
+  chunknumber_t free_length; // For the first and last chunk of a free huge extent, its length in chunks.  Otherwise 0.
 } *chunk_infos; // I want this to be an array of length [1u<<27], but that causes link-time errors.  Instead initialize_malloc() mmaps something big enough.
 
+static inline uint64_t size_from_bin_and_size(bin_and_size_t bnt)
+// Effect: Return the size recorded in bnt (rounded up to pages, or to
+//  chunks if it is 2^24 pages or more).
+{
+  return (bnt & (1<<7)) ? static_cast<uint64_t>(bnt>>8)*pagesize : static_cast<uint64_t>(bnt>>8)*chunksize;
+}
+static inline chunknumber_t huge_n_chunks(bin_and_size_t bnt)
+// Effect: Return how many chunks the huge object whose first chunk has bnt takes.
+{
+  return ceil(size_from_bin_and_size(bnt), chunksize);
+}
+
 // Functions that are separated into various files.
 void* huge_malloc(uint64_t size);
+void* huge_malloc_aligned(uint64_t size, uint64_t alignment);
+// Effect: Like huge_malloc, but the result is aligned to alignment
+//  (which is a power of two).
 void huge_free(void* ptr);
 
 const unsigned int log_max_chunknumber = 27;
 const chunknumber_t null_chunknumber = 0;
 
-// We allocate chunks using only powers of two.  We don't bother with
-// a buddy system to coalesce chunks, instead we just purge chunks
-// that are no longer in use.  Each power of two, K, gets a linked
-// list starting with free_chunks[K], which is a chunk number (we use
+// We allocate huge objects in whole chunks, exactly as many as they
+// need (the size in bin_and_size says how many).  We purge chunks
+// that are no longer in use, and coalesce them with the free chunks on
+// either side into extents, which are kept on linked lists by length.
+// A list starts with free_extents[K], which is a chunk number (we use
 // 0 for the null chunk number).  The linked list employs the
-// chunk_infos[] array to form the links.
-
-extern chunknumber_t free_chunks[log_max_chunknumber];
+// chunk_infos[] array to form the links.  Once the free extents hold
+// more than huge_retain_max bytes (see purge.h), we unmap the extents
+// as they are freed instead.  (See huge_malloc.cc.)
 
 void* mmap_chunk_aligned_block(size_t n_chunks); //
+// In NUMA mode (see numa.h) the chunks are bound to the node we are running on.
+void* mmap_size(size_t size);
 
 void *large_malloc(size_t size);
 void large_free(void* ptr);
@@ -123,29 +143,40 @@ void add_to_footprint(int64_t delta);
 int64_t get_footprint();
 
 void *small_malloc(binnumber_t bin);
+uint32_t small_malloc_batch(binnumber_t bin, uint32_t n, void **objects);
+// Effect: Allocate between 1 and n objects from a small bin, taking
+//  them from one folio, and store them in objects[].  Return the
+//  number of objects, or 0 if we are out of memory.
 void small_free(void* ptr);
+void small_free_batch(binnumber_t bin, void **objects, uint32_t n);
+// Effect: Free the n objects in objects[], which are all in a small
+//  bin.  The objects are grouped by folio so that each folio is
+//  updated once.  (This reorders objects[].)
+void small_merge_pending_frees();
+// Effect: Merge the frees that are waiting on every folio's pending
+//  stack into the bitmaps and the fullness lists (see small_malloc.cc),
+//  and madvise the folios that become empty.
+
+extern uint32_t n_small_shards; // Set by initialize_malloc() to the number of cpu slots (see topology.h).
+void init_small_shards();
+// Effect: Allocate the lists and locks for n_small_shards shards.
+//  Called by initialize_malloc() once n_small_shards is set.
 
 extern bool use_threadcache;
 void* cached_malloc(binnumber_t bin);
 void cached_free(void *ptr, binnumber_t bin);
 
-const int cpulimit = 128;
-
+void flush_thread_cache_stats();
+// Effect: Add this thread's uncounted thread cache hits to the
+//  counters (see stats.h).
 
-#ifdef ENABLE_STATS
-void print_cache_stats();
+void init_cpu_caches();
+// Effect: Allocate the per-cpu caches, one for each cpu slot (see
+//  topology.h).  Called by initialize_malloc() after init_cpu_slots().
 
-void print_bin_stats();
-void bin_stats_note_malloc(binnumber_t b);
-void bin_stats_note_free(binnumber_t b);
+uint32_t getcpu(void);
+// Effect: Return the cpu we are running on (or were recently running on).
 
-#else
-static inline void print_cache_stats() {}
-
-static inline void print_bin_stats() {}
-static inline void bin_stats_note_malloc(binnumber_t b __attribute__((unused))) {}
-static inline void bin_stats_note_free(binnumber_t b __attribute__((unused))) {}
-#endif
 
 #ifdef TESTING
 #define IS_TESTING 1
@@ -162,6 +193,7 @@ struct large_object_list_cell {
     large_object_list_cell *next;
     uint32_t footprint;
   };
+  uint64_t dirty_since; // When a free object whose pages are still resident was freed, in ms (see large_malloc.cc).
 };
 
 const uint32_t max_objects_per_folio = 2048; /* at most 2048 objects per folio. objsizes will check this when generated the constants. */ 
@@ -170,9 +202,47 @@ const uint32_t folio_bitmap_n_words = max_objects_per_folio/64;
 struct per_folio {
   per_folio *next __attribute__((aligned(64)));
   per_folio *prev;
-  uint64_t inuse_bitmap[folio_bitmap_n_words]; // up to 512 objects (8 bytes per object) per page.  The bit is set if the object is in use.
+  objects_per_folio_t inuse_count; // The number of bits set in inuse_bitmap, as of when the folio was last put on a list.
+  uint8_t owned;  // Set while a shard allocates out of this folio without the lock (see small_malloc.cc).
+  uint8_t bucket; // Which fullness list the folio is on (or detached_fullness_bucket).
+  int16_t n_pending;      // About how many objects are on the pending stack.
+  uint8_t pending_listed; // Set while the folio is on its shard's stack of folios with pending frees.
+  void *pending;  // A stack of objects freed into the folio (linked through their first word) whose bits are still set.
+  per_folio *pending_next; // The next folio on the shard's stack of folios with pending frees.
+  uint64_t inuse_bitmap[folio_bitmap_n_words]; // up to 512 objects (8 bytes per object) per page.  The bit is set if the object is in use.  Changed only with atomic operations.
+  uint32_t shard; // Which dsbi shard owns this folio (see small_malloc.cc).
 };
 
+// The folios of a small bin are kept in lists by fullness bucket.
+// Bucket 0 holds the full folios.  Buckets 1 through P hold the partly
+// full folios: a folio with n free objects is in bucket 1+floor(lg n),
+// so a folio changes lists only when its free count crosses a power of
+// two.  Bucket P+1 holds empty folios, and bucket P+2 holds empty
+// folios that have been madvised away.
+static inline uint32_t n_partial_fullness_buckets(objects_per_folio_t o_per_folio) {
+  return o_per_folio >= 2 ? 64 - __builtin_clzl(o_per_folio-1) : 0;
+}
+static inline uint32_t empty_fullness_bucket(objects_per_folio_t o_per_folio) {
+  return n_partial_fullness_buckets(o_per_folio) + 1;
+}
+static inline uint32_t madvised_fullness_bucket(objects_per_folio_t o_per_folio) {
+  return n_partial_fullness_buckets(o_per_folio) + 2;
+}
+static inline uint32_t n_fullness_buckets(objects_per_folio_t o_per_folio) {
+  return n_partial_fullness_buckets(o_per_folio) + 3;
+}
+// A folio that is on no list (because a shard owns it, or because it
+// is being madvised) has this in per_folio::bucket.
+const uint8_t detached_fullness_bucket = 255;
+static inline uint32_t fullness_bucket(objects_per_folio_t o_per_folio, uint32_t n_free)
+// Effect: Return the bucket for a folio that has n_free free objects
+//  (and hasn't been madvised).
+{
+  if (n_free == 0) return 0;
+  if (n_free == o_per_folio) return empty_fullness_bucket(o_per_folio);
+  return 64 - __builtin_clzl(n_free);
+}
+
 #ifdef TESTING
 #include "unit-tests.h"
 #endif
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bassert.h"
+#include "numa.h"
+#include "topology.h"
+
+#ifdef TESTING
+#include <stdlib.h>
+#include <sys/stat.h>
+#endif
+
+bool use_numa = false;
+uint32_t n_numa_nodes = 1;
+uint8_t *numa_node_of_slot = NULL;
+uint32_t numa_node_id[numa_node_limit];
+uint8_t *chunk_numa_nodes = NULL;
+
+// From linux/mempolicy.h.  We don't want to depend on libnuma.
+static const int mpol_preferred = 1;
+
+static long mbind_node(void *p, size_t len, uint32_t node_id)
+// Effect: Ask the kernel to put the pages of [p, p+len) on node_id.
+//  We use MPOL_PREFERRED rather than MPOL_BIND, so that when the node
+//  runs out of memory the kernel takes pages from another node instead
+//  of failing the page fault.
+{
+  unsigned long mask = 1ul << node_id;
+  return syscall(SYS_mbind, p, len, mpol_preferred, &mask, 8*sizeof(mask)+1, 0);
+}
+
+long (*numa_bind_hook)(void *p, size_t len, uint32_t node_id) = mbind_node;
+
+static bool set_cpus_in_list(const char *list, uint8_t node)
+// Effect: Set numa_node_of_slot[] to node for the slot of each cpu in
+//  a cpu list such as "0-3,8-11".  (Cpus without a slot of their own
+//  are skipped.)  Return false if the list is malformed.
+{
+  while (*list >= '0' && *list <= '9') {
+    uint32_t lo = 0, hi;
+    for (; *list >= '0' && *list <= '9'; list++) lo = lo*10 + (*list - '0');
+    hi = lo;
+    if (*list == '-') {
+      list++;
+      if (*list < '0' || *list > '9') return false;
+      for (hi = 0; *list >= '0' && *list <= '9'; list++) hi = hi*10 + (*list - '0');
+    }
+    for (uint32_t cpu = lo; cpu <= hi && cpu < n_mapped_cpus; cpu++) {
+      int32_t s = exact_cpu_slot(cpu);
+      if (s >= 0) numa_node_of_slot[s] = node;
+    }
+    if (*list == ',') list++;
+  }
+  return true;
+}
+
+void init_numa(const char *node_dir) {
+  const uint32_t node_id_limit = 64; // The most that mbind_node() can name.
+  char path[256];
+  char buf[1024];
+  uint32_t n = 0;
+  if (numa_node_of_slot == NULL) {
+    numa_node_of_slot = reinterpret_cast<uint8_t*>(mmap_size(ceil(n_cpu_slots, pagesize)*pagesize));
+    if (numa_node_of_slot == NULL) {
+      use_numa = false;
+      return;
+    }
+  }
+  memset(numa_node_of_slot, 0, n_cpu_slots);
+  for (uint32_t id = 0; id < node_id_limit; id++) {
+    snprintf(path, sizeof(path), "%s/node%u/cpulist", node_dir, id);
+    if (!read_sysfs_file(path, buf, sizeof(buf))) continue;
+    uint32_t index = n < numa_node_limit ? n : n % numa_node_limit;
+    if (n < numa_node_limit) numa_node_id[n] = id;
+    if (!set_cpus_in_list(buf, index)) continue;
+    n++;
+  }
+  n_numa_nodes = n > 0 ? (n < numa_node_limit ? n : numa_node_limit) : 1;
+  if (n_numa_nodes <= 1) {
+    use_numa = false;
+    return;
+  }
+  if (chunk_numa_nodes == NULL) {
+    // Like chunk_infos, this is mostly never touched.
+    chunk_numa_nodes = reinterpret_cast<uint8_t*>(mmap_size(1ul<<log_max_chunknumber));
+    if (chunk_numa_nodes == NULL) {
+      use_numa = false;
+      return;
+    }
+  }
+}
+
+void numa_bind_chunks(void *p, size_t n_chunks, uint32_t node) {
+  if (!use_numa) return;
+  numa_bind_hook(p, n_chunks*chunksize, numa_node_id[node]); // If it fails, the pages just go wherever the kernel likes.
+  memset(&chunk_numa_nodes[address_2_chunknumber(p)], node, n_chunks);
+}
+
+#ifdef TESTING
+static void write_fake_file(const char *path, const char *contents) {
+  FILE *f = fopen(path, "w");
+  bassert(f);
+  fputs(contents, f);
+  fclose(f);
+}
+
+void make_fake_numa_nodes(char *dir, uint32_t n_nodes, uint32_t cpus_per_node) {
+  strcpy(dir, "/tmp/supermalloc-numa-XXXXXX");
+  bassert(mkdtemp(dir));
+  char path[256];
+  char buf[64];
+  for (uint32_t node = 0; node < n_nodes; node++) {
+    snprintf(path, sizeof(path), "%s/node%u", dir, node);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/node%u/cpulist", dir, node);
+    snprintf(buf, sizeof(buf), "%u-%u\n", node*cpus_per_node, (node+1)*cpus_per_node-1);
+    write_fake_file(path, buf);
+  }
+}
+
+static uint32_t n_binds;
+static uint32_t last_bound_node_id;
+static long fake_bind(void *p __attribute__((unused)), size_t len __attribute__((unused)), uint32_t node_id) {
+  n_binds++;
+  last_bound_node_id = node_id;
+  return 0;
+}
+
+extern "C" void test_numa() {
+  // With no nodes (or one), NUMA mode turns itself off.
+  use_numa = true;
+  init_numa("/nonexistent");
+  bassert(!use_numa && n_numa_nodes == 1);
+
+  use_fake_cpu_slots(test_cpu_slots);
+  {
+    memset(numa_node_of_slot, 0, n_cpu_slots);
+    bassert(set_cpus_in_list("0-2,5,7-8\n", 3));
+    bassert(numa_node_of_slot[cpu_slot(0)] == 3 && numa_node_of_slot[cpu_slot(2)] == 3);
+    bassert(numa_node_of_slot[cpu_slot(5)] == 3 && numa_node_of_slot[cpu_slot(8)] == 3);
+    bassert(numa_node_of_slot[cpu_slot(3)] == 0 && numa_node_of_slot[cpu_slot(6)] == 0);
+    bassert(!set_cpus_in_list("4-\n", 1));
+  }
+
+  char dir[64];
+  make_fake_numa_nodes(dir, 2, test_cpu_slots/2);
+  use_numa = true;
+  init_numa(dir);
+  remove_fake_sysfs_tree(dir);
+  bassert(use_numa && n_numa_nodes == 2);
+  bassert(numa_node_of_slot[cpu_slot(0)] == 0 && numa_node_of_slot[cpu_slot(test_cpu_slots-1)] == 1);
+  bassert(numa_node_id[1] == 1);
+
+  long (*saved_hook)(void*, size_t, uint32_t) = numa_bind_hook;
+  numa_bind_hook = fake_bind;
+
+  // Pretend we are on node 0.
+  memset(numa_node_of_slot, 0, n_cpu_slots);
+  uint32_t binds = n_binds;
+  void *a = huge_malloc(chunksize);
+  bassert(n_binds > binds && last_bound_node_id == 0);
+  bassert(chunk_numa_node(address_2_chunknumber(a)) == 0);
+  void *la = large_malloc(4*pagesize);
+  bassert(chunk_numa_node(address_2_chunknumber(la)) == 0);
+  huge_free(a);
+  large_free(la);
+
+  // On node 1 we don't get node 0's free chunk or large object back.
+  memset(numa_node_of_slot, 1, n_cpu_slots);
+  void *b = huge_malloc(chunksize);
+  bassert(b != a);
+  bassert(last_bound_node_id == 1 && chunk_numa_node(address_2_chunknumber(b)) == 1);
+  void *lb = large_malloc(4*pagesize);
+  bassert(lb != la);
+  bassert(chunk_numa_node(address_2_chunknumber(lb)) == 1);
+
+  // Back on node 0, we do.
+  memset(numa_node_of_slot, 0, n_cpu_slots);
+  void *c = huge_malloc(chunksize);
+  bassert(c == a);
+  void *lc = large_malloc(4*pagesize);
+  bassert(lc == la);
+
+  huge_free(b);
+  huge_free(c);
+  large_free(lb);
+  large_free(lc);
+  numa_bind_hook = saved_hook;
+  use_numa = false;
+  n_numa_nodes = 1;
+  use_real_cpu_slots();
+}
+#endif
@@ -0,0 +1,65 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+// NUMA mode (SUPERMALLOC_NUMA=1).
+//
+// In NUMA mode each chunk is bound (with mbind) to the node of the
+// cpu that maps it, and we remember that node for each chunk.  The
+// free-chunk lists (huge_malloc.cc) and free-large-object lists
+// (large_malloc.cc) are kept per node, so that memory freed on a node
+// is reused on that node.  An allocation uses another node's free
+// lists only when it cannot map a new chunk on its own node.  The
+// small bins are already sharded by cpu, and a shard's chunks are
+// mapped (and so bound) by the cpus that use it.
+//
+// Nodes are read from sysfs (nodeN/cpulist under
+// /sys/devices/system/node).  The directory is a parameter, and the
+// mbind call goes through numa_bind_hook, so that the tests can give
+// us a fake machine.  With one node (or no sysfs), NUMA mode turns
+// itself off.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "malloc_internal.h"
+#include "topology.h"
+
+const uint32_t numa_node_limit = 8; // Nodes past this are folded into the first numa_node_limit.
+
+extern bool use_numa;
+extern uint32_t n_numa_nodes;
+extern uint8_t *numa_node_of_slot;             // An index into numa_node_id[] for each cpu slot (see topology.h).
+extern uint32_t numa_node_id[numa_node_limit]; // The kernel's number for each node.
+extern uint8_t *chunk_numa_nodes;              // The node index of each chunk (NUMA mode only).
+
+extern long (*numa_bind_hook)(void *p, size_t len, uint32_t node_id);
+// The default binds [p, p+len) to node_id with mbind(MPOL_PREFERRED).
+
+void init_numa(const char *node_dir);
+// Effect: Read the nodes from node_dir (normally
+//  /sys/devices/system/node) and, if there is more than one, set up
+//  the chunk-to-node map.  Turns use_numa off if there is only one
+//  node.  Requires: use_numa is set, and init_cpu_slots() has been
+//  called.
+
+static inline uint32_t numa_current_node() {
+  return use_numa ? numa_node_of_slot[cpu_slot(getcpu())] : 0;
+}
+
+static inline uint32_t chunk_numa_node(chunknumber_t cn) {
+  return use_numa ? chunk_numa_nodes[cn] : 0;
+}
+
+void numa_bind_chunks(void *p, size_t n_chunks, uint32_t node);
+// Effect: Bind the n_chunks chunks starting at p to node, and remember
+//  that they are on node.  Does nothing unless use_numa.
+
+#ifdef TESTING
+void make_fake_numa_nodes(char *dir, uint32_t n_nodes, uint32_t cpus_per_node);
+// Effect: Make a directory that looks like /sys/devices/system/node,
+//  with n_nodes nodes, each with a run of cpus_per_node cpus, and store
+//  its name in dir (which must have room for 64 bytes).  Remove it
+//  with remove_fake_sysfs_tree().
+#endif
+
+#endif
@@ -0,0 +1,78 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "atomically.h"
+#include "malloc_internal.h"
+#include "purge.h"
+#include "supermalloc.h"
+
+#ifndef MADV_FREE
+#define MADV_FREE 8 // Since linux 4.5.
+#endif
+
+purge_mode_t purge_mode = PURGE_DONTNEED;
+purger_t purger = PURGER_INLINE;
+uint64_t purge_interval_ms = 10;
+
+// Set once the purge thread has been started.  A child of fork()
+// doesn't inherit the thread, so the child clears it.
+static int purge_thread_started = 0;
+static pthread_once_t purge_atfork_once = PTHREAD_ONCE_INIT;
+
+static void purge_thread_after_fork() {
+  purge_thread_started = 0;
+}
+
+static void register_purge_atfork() {
+  pthread_atfork(NULL, NULL, purge_thread_after_fork);
+}
+
+void purge_pages(void *p, size_t len) {
+  switch (purge_mode) {
+  case PURGE_DONTNEED:
+    madvise(p, len, MADV_DONTNEED);
+    return;
+  case PURGE_FREE:
+    if (madvise(p, len, MADV_FREE) == 0 || errno != EINVAL) return;
+    // An old kernel.
+    purge_mode = PURGE_DONTNEED;
+    madvise(p, len, MADV_DONTNEED);
+    return;
+  case PURGE_NONE:
+    return;
+  }
+}
+
+static void* purge_thread(void *arg __attribute__((unused))) {
+  while (1) {
+    struct timespec ts = {(time_t)(purge_interval_ms / 1000), (long)(purge_interval_ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+    small_purge();
+    if (large_decay_ms > 0) large_purge_if_due();
+  }
+  return NULL;
+}
+
+void start_purge_thread() {
+  if (atomic_load(&purge_thread_started)) return;
+  if (!__sync_bool_compare_and_swap(&purge_thread_started, 0, 1)) return;
+  pthread_once(&purge_atfork_once, register_purge_atfork);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t t;
+  if (pthread_create(&t, &attr, purge_thread, NULL) != 0) {
+    // Without a thread, the freeing threads have to purge after all.
+    purger = PURGER_INLINE;
+    supermalloc_purge();
+  }
+  pthread_attr_destroy(&attr);
+}
+
+extern "C" void supermalloc_purge(void) {
+  if (atomic_load(&chunk_infos) == NULL) return; // Nothing has been allocated yet.
+  small_purge();
+  large_purge(0, 0);
+}
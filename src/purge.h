@@ -0,0 +1,90 @@
+#ifndef PURGE_H
+#define PURGE_H
+
+// Purging (SUPERMALLOC_PURGER=inline|thread|user).
+//
+// When a small folio becomes empty (and its bin already has an empty
+// folio), we give its pages back to the operating system with
+// madvise.  The purger setting says who makes that system call:
+//
+//  inline: The thread that freed the folio's last object, right
+//          away.  This is the default.
+//  thread: A thread that we start the first time a folio is queued
+//          for purging.  Every purge_interval_ms it merges the pending
+//          frees and madvises the queued folios.
+//  user:   The application, by calling supermalloc_purge() whenever
+//          (and from whatever thread) it likes.
+//
+// In the thread and user modes, the freeing thread only queues the
+// folio, and the purge madvises adjacent queued folios with one call.
+// A malloc that is about to map a new chunk purges the queue first,
+// so that the queued folios don't go to waste if the purger falls
+// behind.
+//
+// Freed large objects keep their pages until they have been free for
+// large_decay_ms (SUPERMALLOC_LARGE_DECAY_MS, 0 to purge each one as
+// it is freed), or until the free ones that are still resident add up
+// to more than large_dirty_max bytes (SUPERMALLOC_LARGE_DIRTY_MAX), in
+// which case the freeing thread purges them.  Purging them by age is
+// up to the purger: the freeing threads check now and then (inline),
+// the purge thread checks every purge_interval_ms (thread), or
+// supermalloc_purge() purges them all (user).
+//
+// Freed huge objects are purged right away, and their chunks are
+// coalesced with the free chunks around them (see huge_malloc.cc).
+// They keep their address space until the free chunks add up to more
+// than huge_retain_max bytes (SUPERMALLOC_HUGE_RETAIN_MAX), after which
+// we unmap each coalesced extent as it is freed.
+
+// How we give pages back (SUPERMALLOC_PURGE=dontneed|free|none):
+//
+//  dontneed: madvise(MADV_DONTNEED).  The pages go away right away,
+//            and the next touch takes a zero-fill page fault.  This is
+//            the default.
+//  free:     madvise(MADV_FREE).  The kernel takes the pages only if it
+//            runs short of memory, so reusing them usually costs
+//            nothing, but they aren't zeroed.  (If the kernel doesn't
+//            know MADV_FREE, we use MADV_DONTNEED.)
+//  none:     Keep the pages.
+//
+// Only dontneed zeroes the pages, so the code that needs zeroed memory
+// (calloc) must not count on a purge to do it.
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum purge_mode_t { PURGE_DONTNEED, PURGE_FREE, PURGE_NONE };
+extern purge_mode_t purge_mode;
+
+void purge_pages(void *p, size_t len);
+// Effect: Give the pages in [p, p+len) back to the operating system,
+//  as purge_mode says.  p and len are multiples of the page size.
+
+enum purger_t { PURGER_INLINE, PURGER_THREAD, PURGER_USER };
+extern purger_t purger;
+extern uint64_t purge_interval_ms;
+extern uint64_t large_decay_ms;
+extern uint64_t large_dirty_max;
+extern uint64_t huge_retain_max;
+
+void start_purge_thread();
+// Effect: If the purger is a thread and this process doesn't have one
+//  running yet, start it.
+
+uint64_t small_purge();
+// Effect: Merge the pending small frees, and madvise the queued empty
+//  folios and put them on the madvised lists.  Return the number of
+//  madvise calls.
+
+uint64_t large_purge(uint64_t min_age_ms, uint64_t dirty_target);
+// Effect: madvise the free large objects that are still resident and
+//  have been free for at least min_age_ms, biggest sizes first, until
+//  at most dirty_target bytes of them are left.  Return the number of
+//  madvise calls.
+
+void large_purge_if_due();
+// Effect: If it has been a while (a quarter of large_decay_ms) since
+//  the last time, purge the large objects that have been free for
+//  large_decay_ms.
+
+#endif
@@ -0,0 +1,214 @@
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <unistd.h>
+#include <immintrin.h>
+
+#include "queue_mutex.h"
+
+#define atomic_load(addr) __atomic_load_n(addr, __ATOMIC_CONSUME)
+#define atomic_store(addr, val) __atomic_store_n(addr, val, __ATOMIC_RELEASE)
+
+// The locked field is 0 if the lock is free, 1 if it is held, and 2 if
+//  it is held and the thread at the head of the queue may be asleep
+//  on it.  A thread that finds it 0 takes it without queueing.
+// The tail field points at the last node in the queue of threads
+//  waiting for the lock, or is NULL if no one is queued.  The thread at
+//  the head of the queue polls locked; the others spin (and then sleep)
+//  on their own nodes until they get to the head.
+// The hold field is the number waiting for the lock to be free (with
+//  the intention of running a transaction), and they sleep on hold_seq,
+//  which changes whenever the lock becomes free while someone holds.
+// The spins field is a moving average of how many pauses a waiter spun
+//  before it got what it was waiting for.  It is only a hint, so we
+//  don't care that the updates race.
+
+struct queue_node_s {
+  struct queue_node_s *next __attribute__((aligned(64)));
+  int wait; // 1 while waiting, 2 while sleeping on the futex, 0 once we are at the head.
+};
+
+// A thread needs its node only while it is queued, not while it holds
+// the lock, so one node per thread is enough.
+static __thread struct queue_node_s queue_node;
+
+static const int queue_spin_limit = 1000;
+
+static long sys_futex(void *addr1, int op, int val1, struct timespec *timeout, void *addr2, int val3)
+{
+  return syscall(SYS_futex, addr1, op, val1, timeout, addr2, val3);
+}
+
+static long futex_wait(volatile int *addr, int val) {
+  return sys_futex((void*)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+static long futex_wake1(volatile int *addr) {
+  return sys_futex((void*)addr, FUTEX_WAKE_PRIVATE, 1,   NULL, NULL, 0);
+}
+static long futex_wakeN(volatile int *addr) {
+  return sys_futex((void*)addr, FUTEX_WAKE_PRIVATE, INT_MAX,   NULL, NULL, 0);
+}
+
+static int spin_budget(queue_mutex_t *m) {
+  int s = 2*atomic_load(&m->spins) + 10;
+  return s < queue_spin_limit ? s : queue_spin_limit;
+}
+
+static void note_spins(queue_mutex_t *m, int count, bool slept)
+// Effect: Move the average toward count.  If we had to sleep, the
+//  spinning was wasted, so spin less next time.
+{
+  int s = atomic_load(&m->spins);
+  atomic_store(&m->spins, slept ? s - s/8 : s + (count - s)/8);
+}
+
+static bool wait_until_head(queue_mutex_t *m, struct queue_node_s *n)
+// Effect: Spin on our node, and then sleep on it, until our
+//  predecessor tells us we are at the head of the queue.  Return true
+//  if we slept.
+{
+  int budget = spin_budget(m);
+  int count = 0;
+  while (atomic_load(&n->wait) != 0 && count < budget) {
+    _mm_pause();
+    count++;
+  }
+  bool slept = false;
+  // If the CAS fails, we just got to the head.
+  if (atomic_load(&n->wait) != 0 && __sync_bool_compare_and_swap(&n->wait, 1, 2)) {
+    while (atomic_load(&n->wait) != 0) futex_wait(&n->wait, 2);
+    slept = true;
+  }
+  note_spins(m, count, slept);
+  return slept;
+}
+
+static bool lock_as_head(queue_mutex_t *m)
+// Effect: We are at the head of the queue.  Take the lock, spinning on
+//  it and then sleeping on it.  Return true if we slept.
+{
+  int budget = spin_budget(m);
+  for (int count = 0; count < budget; count++) {
+    if (atomic_load(&m->locked) == 0 && __sync_bool_compare_and_swap(&m->locked, 0, 1)) {
+      note_spins(m, count, false);
+      return false;
+    }
+    _mm_pause();
+  }
+  // Mark the lock as having a sleeper, so the unlock will wake us.
+  while (__atomic_exchange_n(&m->locked, 2, __ATOMIC_SEQ_CST) != 0) {
+    futex_wait(&m->locked, 2);
+  }
+  note_spins(m, budget, true);
+  return true;
+}
+
+extern "C" int queue_mutex_lock(queue_mutex_t *m) {
+  if (__sync_bool_compare_and_swap(&m->locked, 0, 1)) return 0;
+  struct queue_node_s *n = &queue_node;
+  n->next = NULL;
+  n->wait = 1;
+  struct queue_node_s *pred = __atomic_exchange_n(&m->tail, n, __ATOMIC_SEQ_CST);
+  bool slept = false;
+  if (pred != NULL) {
+    atomic_store(&pred->next, n);
+    slept = wait_until_head(m, n);
+  }
+  slept |= lock_as_head(m);
+  // Hand the head of the queue to the next thread.
+  struct queue_node_s *next = atomic_load(&n->next);
+  if (next == NULL) {
+    if (__sync_bool_compare_and_swap(&m->tail, n, NULL)) return slept;
+    // Someone has swapped themselves into the tail, but hasn't linked
+    // themselves to us yet.
+    while ((next = atomic_load(&n->next)) == NULL) _mm_pause();
+  }
+  if (__atomic_exchange_n(&next->wait, 0, __ATOMIC_SEQ_CST) == 2) {
+    futex_wake1(&next->wait);
+  }
+  return slept;
+}
+
+extern "C" void queue_mutex_unlock(queue_mutex_t *m) {
+  if (__atomic_exchange_n(&m->locked, 0, __ATOMIC_SEQ_CST) == 2) {
+    futex_wake1(&m->locked);
+  }
+  if (atomic_load(&m->hold)) {
+    __sync_fetch_and_add(&m->hold_seq, 1);
+    futex_wakeN(&m->hold_seq);
+  }
+}
+
+extern "C" int queue_mutex_subscribe(queue_mutex_t *m) {
+  return atomic_load(&m->locked) != 0;
+}
+
+extern "C" int queue_mutex_hold(queue_mutex_t *m) {
+  int budget = spin_budget(m);
+  for (int i = 0; i < budget; i++) {
+    if (atomic_load(&m->locked) == 0) return false;
+    _mm_pause();
+  }
+  int did_futex = 0;
+  __sync_fetch_and_add(&m->hold, 1);
+  while (1) {
+    // Read hold_seq before locked: if the lock goes free after we look
+    // at locked, hold_seq will have changed and the futex_wait returns.
+    int seq = atomic_load(&m->hold_seq);
+    if (atomic_load(&m->locked) == 0) {
+      __sync_fetch_and_add(&m->hold, -1);
+      return did_futex;
+    }
+    futex_wait(&m->hold_seq, seq);
+    did_futex = 1;
+  }
+}
+
+#ifdef TESTING
+#include <thread>
+
+#include "bassert.h"
+
+static queue_mutex_t tm = QUEUE_MUTEX_INITIALIZER;
+static queue_mutex_t tm2 = QUEUE_MUTEX_INITIALIZER;
+static volatile int test_is_locked = 0;
+static volatile uint64_t test_count = 0;
+
+static void contend(int n) {
+  for (int i = 0; i < n; i++) {
+    if (i % 7 == 0) {
+      queue_mutex_hold(&tm);
+      continue;
+    }
+    queue_mutex_lock(&tm);
+    bassert(queue_mutex_subscribe(&tm));
+    bassert(!test_is_locked);
+    test_is_locked = 1;
+    if (i % 5 == 0) {
+      // Nest a second lock, and sometimes sleep holding the lock so the waiters go to the futex.
+      queue_mutex_lock(&tm2);
+      if (i % 100 == 0) usleep(100);
+      queue_mutex_unlock(&tm2);
+    }
+    test_count++;
+    test_is_locked = 0;
+    queue_mutex_unlock(&tm);
+  }
+}
+
+extern "C" void test_queue_mutex() {
+  bassert(!queue_mutex_subscribe(&tm));
+  bassert(queue_mutex_lock(&tm) == 0);
+  bassert(queue_mutex_subscribe(&tm));
+  queue_mutex_unlock(&tm);
+  bassert(!queue_mutex_subscribe(&tm) && !queue_mutex_hold(&tm));
+
+  const int n_threads = 4, n = 20000;
+  uint64_t before = test_count;
+  std::thread x[n_threads];
+  for (int i = 0; i < n_threads; i++) x[i] = std::thread(contend, n);
+  for (int i = 0; i < n_threads; i++) x[i].join();
+  bassert(test_count == before + n_threads * (n - (n+6)/7));
+  bassert(!queue_mutex_subscribe(&tm) && tm.hold == 0 && tm.tail == NULL);
+}
+#endif
@@ -0,0 +1,37 @@
+#ifndef QUEUE_MUTEX_H
+#define QUEUE_MUTEX_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// An HTM-friendly queued mutex.  The lock is a single word (which is
+// all a transaction needs to subscribe to), but the threads waiting
+// for it line up in an MCS queue: only the thread at the head of the
+// queue polls the lock word, and the rest each spin on their own cache
+// line.  Each waiter spins for about as long as recent waits have
+// taken, and then sleeps on a futex.
+
+// See queue_mutex.cc for the meaning of these fields.
+struct queue_node_s;
+typedef struct queue_mutex_s {
+  int locked __attribute__((aligned(64)));
+  int hold;
+  int hold_seq;
+  int spins;
+  struct queue_node_s *tail;
+} queue_mutex_t;
+
+#define QUEUE_MUTEX_INITIALIZER {0,0,0,0,0}
+int queue_mutex_lock(queue_mutex_t *m); // return 0 if it's a fast lock, 1 if it's slow.
+void queue_mutex_unlock(queue_mutex_t *m);
+int queue_mutex_subscribe(queue_mutex_t *m); // (return 0 if it is unlocked)
+int queue_mutex_hold(queue_mutex_t *m); // return true if it was a long wait
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
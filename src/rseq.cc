@@ -0,0 +1,99 @@
+#include <errno.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bassert.h"
+#include "rseq.h"
+
+#ifndef SYS_rseq
+#define SYS_rseq 334 // x86_64
+#endif
+
+bool use_rseq = true;
+__thread rseq_abi *rseq_area = NULL;
+
+static __thread bool rseq_failed = false;
+static __thread rseq_abi own_rseq_area;
+
+// glibc 2.35 and later export these.  They are weak so that we still
+// link (and then register our own area) against an older glibc.
+extern "C" {
+  extern const ptrdiff_t __rseq_offset __attribute__((weak));
+  extern const unsigned int __rseq_size __attribute__((weak));
+}
+
+static const uint32_t rseq_cpu_id_uninitialized = static_cast<uint32_t>(-1);
+
+static inline char *thread_pointer() {
+  char *tp;
+  __asm__ ("movq %%fs:0, %0" : "=r"(tp));
+  return tp;
+}
+
+rseq_abi *rseq_register_current_thread() {
+  if (rseq_failed || !use_rseq) return NULL;
+  if (&__rseq_size != NULL && __rseq_size > 0) {
+    // libc already registered an area for this thread.
+    rseq_abi *r = reinterpret_cast<rseq_abi*>(thread_pointer() + __rseq_offset);
+    if (static_cast<int32_t>(r->cpu_id) >= 0) {
+      rseq_area = r;
+      return r;
+    }
+  }
+  own_rseq_area.cpu_id = rseq_cpu_id_uninitialized;
+  if (syscall(SYS_rseq, &own_rseq_area, sizeof(own_rseq_area), 0, RSEQ_SIG) == 0) {
+    rseq_area = &own_rseq_area;
+    return rseq_area;
+  }
+  // ENOSYS: the kernel is too old.  EBUSY: someone else registered an
+  // area we don't know how to find.  Either way, use the locks.
+  rseq_failed = true;
+  return NULL;
+}
+
+#ifdef TESTING
+struct test_record {
+  uint64_t a __attribute__((aligned(32)));
+  uint64_t b, c, d;
+};
+
+extern "C" void test_rseq() {
+  rseq_abi *r = rseq_current_area();
+  if (r == NULL) {
+    printf("rseq is not available, skipping test_rseq\n");
+    return;
+  }
+  const uint64_t limit = 4;
+  uint64_t n = 0;
+  test_record slots[limit];
+  for (uint64_t i = 0; i <= limit; i++) {
+    test_record t = {i, i+1, i+2, i+3};
+    int result;
+    do {
+      result = rseq_stack_push32(r, rseq_cpu_start(r), &n, limit, slots, &t);
+    } while (result < 0);
+    bassert(result == (i < limit ? 0 : 1));
+    bassert(n == (i < limit ? i+1 : limit));
+  }
+  for (uint64_t i = limit; i > 0; i--) {
+    test_record t;
+    int result;
+    do {
+      result = rseq_stack_pop32(r, rseq_cpu_start(r), &n, slots, &t);
+    } while (result < 0);
+    bassert(result == 0);
+    bassert(n == i-1);
+    bassert(t.a == i-1 && t.b == i && t.c == i+1 && t.d == i+2);
+  }
+  {
+    test_record t;
+    int result;
+    do {
+      result = rseq_stack_pop32(r, rseq_cpu_start(r), &n, slots, &t);
+    } while (result < 0);
+    bassert(result == 1);
+    bassert(n == 0);
+  }
+}
+#endif
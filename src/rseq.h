@@ -0,0 +1,189 @@
+#ifndef RSEQ_H
+#define RSEQ_H
+
+// Restartable sequences (Linux 4.18 and later).
+//
+// A restartable sequence is a short piece of code operating on
+// per-cpu data.  If the thread is preempted, migrated, or gets a
+// signal before the final (committing) store, the kernel sends it to
+// an abort label instead of letting it finish.  So a thread can push
+// or pop a per-cpu stack with no lock and no atomic read-modify-write
+// instruction, and the cpu number is exact rather than a stale cached
+// value.
+//
+// Each thread needs an rseq area registered with the kernel.  Recent
+// glibc (2.35 and later) registers one for every thread, and we use
+// that one if it is there.  Otherwise we try to register our own.  If
+// that fails (old kernel, seccomp, SUPERMALLOC_RSEQ=0) then
+// rseq_current_area() returns NULL and the caller uses the locked
+// code path instead.
+//
+// The code in here is x86_64-specific (as is the rest of supermalloc).
+
+#include <stdint.h>
+
+// The layout is fixed by the kernel ABI (see linux/rseq.h).  We don't
+// include that header since glibc's <sys/rseq.h> defines the same
+// struct under the same name.
+struct rseq_abi {
+  uint32_t cpu_id_start;
+  uint32_t cpu_id;
+  uint64_t rseq_cs;
+  uint32_t flags;
+} __attribute__((aligned(32)));
+
+extern bool use_rseq;
+extern __thread rseq_abi *rseq_area;
+
+rseq_abi *rseq_register_current_thread();
+// Effect: Find or register an rseq area for this thread.  Returns
+//  NULL if we cannot have one, and remembers the failure so that we
+//  don't make a system call every time.
+
+static inline rseq_abi *rseq_current_area() {
+  rseq_abi *r = rseq_area;
+  if (__builtin_expect(r != NULL, 1)) return r;
+  return rseq_register_current_thread();
+}
+
+static inline uint32_t rseq_cpu_start(rseq_abi *r) {
+  return __atomic_load_n(&r->cpu_id_start, __ATOMIC_RELAXED);
+}
+
+#define RSEQ_SIG 0x53053053
+
+#define RSEQ_STR_1(x) #x
+#define RSEQ_STR(x) RSEQ_STR_1(x)
+
+// The critical-section descriptor (struct rseq_cs) lives in its own
+// section.  post_commit_offset is the length of the critical section.
+#define RSEQ_ASM_DEFINE_TABLE(label, start_ip, post_commit_ip, abort_ip) \
+  ".pushsection __rseq_cs, \"aw\"\n\t"					\
+  ".balign 32\n\t"							\
+  RSEQ_STR(label) ":\n\t"						\
+  ".long 0, 0\n\t"							\
+  ".quad " RSEQ_STR(start_ip) ", (" RSEQ_STR(post_commit_ip) " - " RSEQ_STR(start_ip) "), " RSEQ_STR(abort_ip) "\n\t" \
+  ".popsection\n\t"
+
+#define RSEQ_ASM_STORE_RSEQ_CS(label, cs_label)		\
+  "leaq " RSEQ_STR(cs_label) "(%%rip), %%rax\n\t"	\
+  "movq %%rax, %[rseq_cs]\n\t"				\
+  RSEQ_STR(label) ":\n\t"
+
+#define RSEQ_ASM_CMP_CPU_ID(abort_label)		\
+  "cmpl %[cpu_id], %[current_cpu_id]\n\t"		\
+  "jnz " RSEQ_STR(abort_label) "\n\t"
+
+// The kernel checks that the four bytes before the abort handler are
+// the signature we registered.  The handler is out of line.
+#define RSEQ_ASM_DEFINE_ABORT(label, abort_label)	\
+  ".pushsection __rseq_failure, \"ax\"\n\t"		\
+  ".byte 0x0f, 0xb9, 0x3d\n\t"				\
+  ".long " RSEQ_STR(RSEQ_SIG) "\n\t"			\
+  RSEQ_STR(label) ":\n\t"				\
+  "jmp %l[" RSEQ_STR(abort_label) "]\n\t"		\
+  ".popsection\n\t"
+
+// The per-cpu stacks hold 32-byte records.  The stack is an array of
+// records, slots, and a count, *n, of how many are in use.  The
+// count is the commit word: a record written beyond *n is invisible
+// until the count is stored.
+
+static inline __attribute__((always_inline))
+int rseq_stack_push32(rseq_abi *r, uint32_t cpu,
+		      uint64_t *n, uint64_t limit, void *slots,
+		      const void *record)
+// Effect: If we are still running on cpu and the stack has room,
+//  copy *record onto the stack and return 0.  If the stack is full
+//  return 1.  If the sequence was aborted return -1 (the caller
+//  should look up its cpu again and retry).
+{
+  __asm__ __volatile__ goto (
+    RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f)
+    RSEQ_ASM_STORE_RSEQ_CS(1, 3b)
+    RSEQ_ASM_CMP_CPU_ID(4f)
+    "movq %[n], %%rbx\n\t"
+    "cmpq %[limit], %%rbx\n\t"
+    "jae %l[full]\n\t"
+    "movq %%rbx, %%rax\n\t"
+    "shlq $5, %%rax\n\t"
+    "addq %[slots], %%rax\n\t"
+    "movq 0(%[record]), %%rcx\n\t"
+    "movq %%rcx, 0(%%rax)\n\t"
+    "movq 8(%[record]), %%rcx\n\t"
+    "movq %%rcx, 8(%%rax)\n\t"
+    "movq 16(%[record]), %%rcx\n\t"
+    "movq %%rcx, 16(%%rax)\n\t"
+    "movq 24(%[record]), %%rcx\n\t"
+    "movq %%rcx, 24(%%rax)\n\t"
+    "addq $1, %%rbx\n\t"
+    // commit
+    "movq %%rbx, %[n]\n\t"
+    "2:\n\t"
+    RSEQ_ASM_DEFINE_ABORT(4, abort)
+    : /* asm goto doesn't allow outputs */
+    : [cpu_id]         "r" (cpu),
+      [current_cpu_id] "m" (r->cpu_id),
+      [rseq_cs]        "m" (r->rseq_cs),
+      [n]              "m" (*n),
+      [limit]          "r" (limit),
+      [slots]          "r" (slots),
+      [record]         "r" (record)
+    : "memory", "cc", "rax", "rbx", "rcx"
+    : abort, full);
+  return 0;
+ abort:
+  return -1;
+ full:
+  return 1;
+}
+
+static inline __attribute__((always_inline))
+int rseq_stack_pop32(rseq_abi *r, uint32_t cpu,
+		     uint64_t *n, void *slots,
+		     void *record)
+// Effect: If we are still running on cpu and the stack is nonempty,
+//  copy the top record into *record, remove it from the stack, and
+//  return 0.  If the stack is empty return 1.  If the sequence was
+//  aborted return -1 (and *record may have been partially written).
+{
+  __asm__ __volatile__ goto (
+    RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f)
+    RSEQ_ASM_STORE_RSEQ_CS(1, 3b)
+    RSEQ_ASM_CMP_CPU_ID(4f)
+    "movq %[n], %%rbx\n\t"
+    "testq %%rbx, %%rbx\n\t"
+    "jz %l[empty]\n\t"
+    "subq $1, %%rbx\n\t"
+    "movq %%rbx, %%rax\n\t"
+    "shlq $5, %%rax\n\t"
+    "addq %[slots], %%rax\n\t"
+    "movq 0(%%rax), %%rcx\n\t"
+    "movq %%rcx, 0(%[record])\n\t"
+    "movq 8(%%rax), %%rcx\n\t"
+    "movq %%rcx, 8(%[record])\n\t"
+    "movq 16(%%rax), %%rcx\n\t"
+    "movq %%rcx, 16(%[record])\n\t"
+    "movq 24(%%rax), %%rcx\n\t"
+    "movq %%rcx, 24(%[record])\n\t"
+    // commit
+    "movq %%rbx, %[n]\n\t"
+    "2:\n\t"
+    RSEQ_ASM_DEFINE_ABORT(4, abort)
+    : /* asm goto doesn't allow outputs */
+    : [cpu_id]         "r" (cpu),
+      [current_cpu_id] "m" (r->cpu_id),
+      [rseq_cs]        "m" (r->rseq_cs),
+      [n]              "m" (*n),
+      [slots]          "r" (slots),
+      [record]         "r" (record)
+    : "memory", "cc", "rax", "rbx", "rcx"
+    : abort, empty);
+  return 0;
+ abort:
+  return -1;
+ empty:
+  return 1;
+}
+
+#endif // RSEQ_H
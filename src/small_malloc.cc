@@ -1,45 +1,91 @@
 #include "atomically.h"
 #include "bassert.h"
 #include "generated_constants.h"
+#include "latency.h"
 #include "malloc_internal.h"
-#include <sys/mman.h>
+#include "purge.h"
+#include "stats.h"
+#include "topology.h"
+#include <algorithm>
 
-lock_t small_locks[first_large_bin_number] = { REPEAT_FOR_SMALL_BINS(LOCK_INITIALIZER) };
+// The dynamic small bin info is sharded by cpu, so that threads on
+// different cpus don't fight over the same lists.  Each shard owns
+// the chunks it allocated (per_folio::shard says which shard a folio
+// belongs to, and small_free() gives objects back to that shard).  A
+// thread allocates from the shard for its cpu, and steals from other
+// shards only when its own shard has no free objects in the bin.
+//
+// For each bin, a shard also owns one folio (dsbi_shard::owned) that
+// it allocates out of without taking the lock: a malloc claims
+// objects by setting their bits in the folio's bitmap with fetch_or,
+// and a free clears its bit with fetch_and.  The owned folio is on
+// none of the fullness lists, so the lists (and the lock) are touched
+// only when the shard trades in a used-up folio for another one, and
+// when the frees into folios that no shard owns are merged (see
+// below).
+//
+// A malloc that read dsbi_shard::owned may be slow to claim its bits,
+// and by the time its fetch_or lands the folio may have been traded
+// in.  So after claiming, the malloc checks per_folio::owned again,
+// and if it's clear gives the bits back.  Whoever changes the bitmap
+// of a folio that isn't owned (including a malloc giving bits back)
+// refiles the folio under the lock afterwards, and refiling counts
+// the bits again, so the folio ends up on the right list once the last
+// of them is done.
+//
+// A free into a folio that no shard owns doesn't take the lock
+// either.  It pushes the object onto the folio's pending stack with a
+// compare-and-swap, leaving the object's bit set, and the first such
+// free since the folio was last merged also pushes the folio onto the
+// shard's stack of folios with pending frees.  The pending frees are
+// merged into the bitmaps (and the folios refiled) in bulk: when a
+// malloc finds the shard's owned folio used up, before it trades the
+// folio in, when someone calls small_merge_pending_frees() (which the
+// purger does), and when the pending frees cover all the objects that
+// were in use when the folio was filed (so that an empty folio gets
+// purged).  Both stacks are emptied by swapping in NULL rather than
+// popped, so they don't have the ABA problem.
 
-static struct {
+struct dsbi_shard {
+  // For each bin, a list of folios for each fullness bucket (see
+  // fullness_bucket() in malloc_internal.h).  We allocate from the
+  // fullest nonempty bucket, so the empty folios are used only when
+  // there are no partly full ones, and the madvised folios only when
+  // there are no empty ones.  The rationale for keeping the empty
+  // folios separate from the madvised ones is that we don't want to
+  // constantly pay the cost of madvising an empty page and then
+  // touching it again, so we keep at least one folio in the empty
+  // bucket.
   dynamic_small_bin_info lists __attribute__((aligned(4096)));
 
-  // 0 means all pages are full (all the pages are in slot 0).
-  // Else 1 means there's a page with 1 free slot, and some page is in slot 1.
-  // Else 2 means there's one with 2 free slots, and some page is in slot 2.
-  // The full pages are in slot 0, the 1-free are in slot 1, and so forth.  Note
-  // that we can have some full pages and have the fullest_offset be nonzero
-  // (if not *all* pages are full).
-  // There's an extra slot for pages that are empty and have been madvised'd to uncommited.
-
-  // For example, if there are 512 objects per folio then the slot 0
-  // contains folios with 0 free slots, slot 1 contains folios with 1
-  // free slot, ..., slot 512 contains folios with 512 free slots, and
-  // slot 513 contains folios with 512 free slots and the folio is not
-  // committed to physical memory.  The rationale is that we don't
-  // want to constantly pay the cost of madvising an empty page and
-  // then touching it again, so we keep at least one page the
-  // penultimate slot (number 512), and the madvised' pages in slot
-  // 513.
-
-  // We will also eventually provide a way for a separate thread to
-  // actually do the madvising so that it won't slow down the thread
-  // that is doing malloc.  We'll do that by providing three modes:
-  //  [1] The madvise occurs in the free(), which introduces
-  //      performance variance to the caller of free().
-  //  [2] The madvise occurs in a separate thread which we manage.
-  //  [3] The madvise occurs in a thread the user creates using a
-  //      function that we create (for this one, we need to provide
-  //      some more synchronization so that the user thread can shut
-  //      us down if they want to.)
-
-  uint16_t fullest_offset[first_large_bin_number];
-} dsbi;
+  // Who madvises the other empty folios, and when, depends on the
+  // purger (see purge.h).
+
+  // For each bin, bit k is set if the list for bucket k is nonempty
+  // (for k > 0: we don't track the full folios).  So the fullest
+  // folio with a free object is at the head of the list for bucket
+  // ctz(nonempty), and if nonempty is 0 we need a new chunk.
+  uint32_t nonempty[first_large_bin_number];
+
+  // For each bin, the folio that the shard is allocating out of, or
+  // NULL.  Changed only while holding the lock.
+  per_folio *owned[first_large_bin_number];
+
+  // For each bin, the stack of folios with pending frees (linked
+  // through per_folio::pending_next).
+  per_folio *pending_folios[first_large_bin_number];
+};
+
+// The shards, and their locks, are sized from n_small_shards by
+// init_small_shards().
+static dsbi_shard *dsbi;
+static lock_t (*small_locks)[first_large_bin_number];
+uint32_t n_small_shards = 1;
+
+// When the purger isn't inline, the empty folios waiting to be
+// madvised (linked through per_folio::next, since they are on no
+// list).
+static per_folio *purge_queue = NULL;
 
 struct small_chunk_header {
   per_folio ll[512];  // This object is 16 pages long, but we don't use that much unless there are lots of folios in a chunk.  We don't use the last the array.  We could get it down to fewer pages if we packed it, but we want this to be
@@ -48,302 +94,606 @@ struct small_chunk_header {
 //const uint64_t n_pages_wasted = sizeof(small_chunk_header)/pagesize;
 //const uint64_t n_pages_used   = (chunksize/pagesize)-n_pages_wasted;
 
+static void map_small_shards(uint32_t n)
+// Effect: Map the lists and locks for n shards.  They start out zero,
+//  which is what the lists and LOCK_INITIALIZER want.
+{
+  size_t dsbi_size  = ceil(n*sizeof(*dsbi), pagesize)*pagesize;
+  size_t locks_size = ceil(n*sizeof(*small_locks), pagesize)*pagesize;
+  char *p = reinterpret_cast<char*>(mmap_size(dsbi_size + locks_size));
+  bassert(p);
+  dsbi        = reinterpret_cast<dsbi_shard*>(p);
+  small_locks = reinterpret_cast<lock_t(*)[first_large_bin_number]>(p + dsbi_size);
+}
+
+void init_small_shards() {
+  map_small_shards(n_small_shards);
+}
+
 static inline void verify_small_invariants() {
   return;
-  {
-    mylock_raii mr(&small_locks[27]);
-    if (0 && dsbi.fullest_offset[27] == 0) {
-      for (unsigned int i = 1; i<static_bin_info[27].objects_per_folio; i++) {
-	bassert(dsbi.lists.b27[i]==NULL);
+  for (uint32_t shard = 0; shard < n_small_shards; shard++) {
+    dsbi_shard *d = &dsbi[shard];
+    for (binnumber_t bin = 0; bin < first_large_bin_number; bin++) {
+      mylock_raii mr(&small_locks[shard][bin]);
+      int start       = dynamic_small_bin_offset(bin);
+      if (d->owned[bin]) {
+	bassert(d->owned[bin]->owned && d->owned[bin]->bucket == detached_fullness_bucket);
+      }
+      for (uint32_t k = 0; k < n_fullness_buckets(static_bin_info[bin].objects_per_folio); k++) {
+	if (k > 0) {
+	  bassert(((d->nonempty[bin] >> k) & 1) == (d->lists.b[start + k] != NULL));
+	}
+	// The bitmaps can change without the lock, so we can't check
+	// the counts here.
+	per_folio *prev_pp = NULL;
+	for (per_folio *pp = d->lists.b[start + k]; pp; pp = pp->next) {
+	  bassert(prev_pp == pp->prev);
+	  prev_pp = pp;
+	  bassert(pp->bucket == k && !pp->owned);
+	  bassert(pp->shard == shard);
+	}
       }
     }
   }
-  //  return;
-  for (binnumber_t bin = 0; bin < first_large_bin_number; bin++) {
-    mylock_raii mr(&small_locks[bin]);
-    uint16_t fullest_off = dsbi.fullest_offset[bin];
-    int start       = dynamic_small_bin_offset(bin);
-    objects_per_folio_t opp = static_bin_info[bin].objects_per_folio;
-    if (fullest_off==0) {
-      for (uint16_t i = 1; i <= opp; i++) {
-	bassert(dsbi.lists.b[start + i] == NULL);
-      }
-    } else {
-      bassert(fullest_off <= opp);
-      bassert(dsbi.lists.b[start + fullest_off] != NULL);
-      for (uint16_t i = 1; i < fullest_off; i++) {
-	bassert(dsbi.lists.b[start + i] == NULL);
+}
+
+static uint32_t folio_inuse(per_folio *pp, objects_per_folio_t o_per_folio)
+// Effect: Count the bits set in pp's bitmap.
+{
+  uint32_t sum = 0;
+  for (uint32_t w = 0; w < ceil(o_per_folio, 64); w++) {
+    sum += __builtin_popcountl(atomic_load(&pp->inuse_bitmap[w]));
+  }
+  return sum;
+}
+
+static uint32_t claim_in_folio(per_folio *pp, objects_per_folio_t o_per_folio, uint32_t n, uint64_t *claimed)
+// Effect: Claim up to n of the clear bits in pp's bitmap with
+//  fetch_or, record them in claimed, and return how many we got.
+//  Other threads may be claiming and clearing bits at the same time.
+{
+  uint32_t w_max = ceil(o_per_folio, 64);
+  for (uint32_t w = 0; w < w_max; w++) {
+    claimed[w] = 0;
+  }
+  uint32_t n_got = 0;
+  for (uint32_t w = 0; w < w_max && n_got < n; w++) {
+    // The bits past o_per_folio in the last word aren't objects.
+    uint64_t valid = (w+1 < w_max || o_per_folio % 64 == 0) ? UINT64_MAX : (1ul << (o_per_folio % 64)) - 1;
+    uint64_t bw = atomic_load(&pp->inuse_bitmap[w]);
+    while (n_got < n) {
+      uint64_t bwbar = ~bw & valid;
+      if (bwbar == 0) break;
+      // Claim the lowest clear bits.
+      uint64_t want = 0;
+      for (uint32_t i = n_got; i < n && bwbar; i++) {
+	uint64_t lowest = bwbar & -bwbar;
+	want |= lowest;
+	bwbar ^= lowest;
       }
+      bw = __sync_fetch_and_or(&pp->inuse_bitmap[w], want);
+      uint64_t got = want & ~bw;
+      claimed[w] |= got;
+      n_got += __builtin_popcountl(got);
+      bw |= want;
     }
-    for (uint16_t i = 0; i <= opp; i++) {
-      per_folio *prev_pp = NULL;
-      for (per_folio *pp = dsbi.lists.b[start + i]; pp; pp = pp->next) {
-	bassert(prev_pp == pp->prev);
-	prev_pp = pp;
-	int sum = 0;
-	for (uint32_t j = 0; j < folio_bitmap_n_words; j++) {
-	  sum += __builtin_popcountl(pp->inuse_bitmap[j]);
-	}
-	bassert(sum == opp - i);
-      }
+  }
+  return n_got;
+}
+
+static void unclaim_in_folio(per_folio *pp, objects_per_folio_t o_per_folio, const uint64_t *claimed)
+// Effect: Clear the bits that are set in claimed (which must be set
+//  in pp's bitmap) with fetch_and.
+{
+  for (uint32_t w = 0; w < ceil(o_per_folio, 64); w++) {
+    if (claimed[w]) {
+      uint64_t old_bits = __sync_fetch_and_and(&pp->inuse_bitmap[w], ~claimed[w]);
+      bassert((old_bits & claimed[w]) == claimed[w]);
+    }
+  }
+}
+
+static void unlink_folio(dsbi_shard *d,
+			 binnumber_t bin,
+			 uint32_t dsbi_offset,
+			 per_folio *pp)
+// Effect: Take pp off the list it is on, maintaining the nonempty
+//  bits, and mark it detached.
+{
+  uint32_t bucket = pp->bucket;
+  per_folio *pp_next = pp->next;
+  per_folio *pp_prev = pp->prev;
+  if (pp_prev == NULL) {
+    bassert(d->lists.b[dsbi_offset + bucket] == pp);
+    d->lists.b[dsbi_offset + bucket] = pp_next;
+    if (pp_next == NULL && bucket != 0) {
+      d->nonempty[bin] &= ~(1u << bucket);
     }
+  } else {
+    pp_prev->next = pp_next;
+  }
+  if (pp_next != NULL) {
+    pp_next->prev = pp_prev;
+  }
+  pp->bucket = detached_fullness_bucket;
+}
+
+static void link_folio(dsbi_shard *d,
+		       binnumber_t bin,
+		       uint32_t dsbi_offset,
+		       per_folio *pp,
+		       uint32_t bucket)
+// Effect: Push the detached folio pp onto the list for bucket,
+//  maintaining the nonempty bits.
+{
+  per_folio *new_next = d->lists.b[dsbi_offset + bucket];
+  pp->prev = NULL;
+  pp->next = new_next;
+  if (new_next) {
+    new_next->prev = pp;
+  } else if (bucket != 0) {
+    d->nonempty[bin] |= 1u << bucket;
+  }
+  d->lists.b[dsbi_offset + bucket] = pp;
+  pp->bucket = bucket;
+}
+
+static per_folio* file_folio(dsbi_shard *d,
+			     binnumber_t bin,
+			     uint32_t dsbi_offset,
+			     per_folio *pp)
+// Effect: pp is detached and not owned.  Count its objects and put
+//  it on the list for its fullness.  Returns NULL or else pp, if the
+//  folio is empty and should be madvised (in which case it stays
+//  detached, and the caller puts it on the madvised list afterwards).
+{
+  objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+  uint32_t inuse = folio_inuse(pp, o_per_folio);
+  pp->inuse_count = inuse;
+  uint32_t bucket = fullness_bucket(o_per_folio, o_per_folio - inuse);
+  // Even if the folio is empty, we want to keep one folio around
+  // without madvising() it in order to have some hysteresis in the
+  // madvise()/commit cycle.
+  if (bucket == empty_fullness_bucket(o_per_folio) && d->lists.b[dsbi_offset + bucket] != NULL) {
+    return pp;
   }
+  link_folio(d, bin, dsbi_offset, pp, bucket);
+  return NULL;
 }
 
-static void predo_small_malloc_add_pages_from_new_chunk(binnumber_t bin,
+static void predo_small_malloc_add_pages_from_new_chunk(dsbi_shard *d,
+							binnumber_t bin,
 							uint32_t dsbi_offset,
 							small_chunk_header *sch) {
   folios_per_chunk_t folios_per_chunk = static_bin_info[bin].folios_per_chunk;
   objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
-  prefetch_write(&dsbi.lists.b[dsbi_offset + o_per_folio + 1]);
+  per_folio *old_h = atomic_load(&d->lists.b[dsbi_offset + madvised_fullness_bucket(o_per_folio)]);
+  prefetch_write(&d->lists.b[dsbi_offset + madvised_fullness_bucket(o_per_folio)]);
   prefetch_write(&sch->ll[folios_per_chunk-1].next);
-  if (dsbi.fullest_offset[bin] == 0) {
-    prefetch_write(&dsbi.fullest_offset[bin]);
+  if (old_h) {
+    load_and_prefetch_write(&old_h->prev);
   }
+  prefetch_write(&d->nonempty[bin]);
 }
 
-static bool do_small_malloc_add_pages_from_new_chunk(binnumber_t bin,
+static bool do_small_malloc_add_pages_from_new_chunk(dsbi_shard *d,
+						     binnumber_t bin,
 						     uint32_t dsbi_offset,
 						     small_chunk_header *sch) {
   folios_per_chunk_t folios_per_chunk = static_bin_info[bin].folios_per_chunk;
   objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
-  // The "+ 1" in the lines below is to arrange to add the new folkos
-  // to the madvise_done list.  Initially, those folios are
-  // uncommitted.
-  per_folio *old_h = dsbi.lists.b[dsbi_offset + o_per_folio + 1];
-  dsbi.lists.b[dsbi_offset + o_per_folio + 1] = &sch->ll[0];
+  // The new folios go into the madvised bucket, since initially they
+  // are uncommitted.
+  uint32_t madvised = madvised_fullness_bucket(o_per_folio);
+  per_folio *old_h = d->lists.b[dsbi_offset + madvised];
+  d->lists.b[dsbi_offset + madvised] = &sch->ll[0];
   sch->ll[folios_per_chunk-1].next = old_h;
-  if (dsbi.fullest_offset[bin] == 0) { // must test this again here.
-    // Even if the fullest slot is actually in o_per_folio+1, we say it's in o_per_folio.
-    dsbi.fullest_offset[bin] = o_per_folio;
+  if (old_h) {
+    old_h->prev = &sch->ll[folios_per_chunk-1];
   }
+  d->nonempty[bin] |= 1u << madvised;
   return true; // cannot have the return type with void, since atomically wants to store the return type and then return it.
 }
 
-static void predo_small_malloc(binnumber_t bin,
+struct small_batch {
+  per_folio *pp;
+  uint64_t claimed[folio_bitmap_n_words]; // The bits we set in pp->inuse_bitmap.
+};
+
+static void predo_refile_folio(dsbi_shard *d,
+			       binnumber_t bin,
 			       uint32_t dsbi_offset,
-			       uint32_t o_size __attribute__((unused))) {
-  uint32_t fullest = atomic_load(&dsbi.fullest_offset[bin]);
-  if (fullest == 0) return; // A chunk must be allocated.
-  uint16_t o_per_folio = static_bin_info[bin].objects_per_folio;
-  uint32_t fetch_offset = fullest;
-  per_folio *result_pp = atomic_load(&dsbi.lists.b[dsbi_offset + fetch_offset]);
-  if (result_pp == NULL) {
-    if (fullest == o_per_folio) {
-      fetch_offset++;
-      result_pp = atomic_load(&dsbi.lists.b[dsbi_offset + fetch_offset]);
-    }
-    if (result_pp == NULL) {
-      return; // Can happen only because predo isn't done atomically.
-    }
-  }
-  prefetch_write(&dsbi.lists.b[dsbi_offset + fetch_offset]); // previously fetched, so just make it writeable
+			       per_folio *pp) {
+  if (atomic_load(&pp->owned)) return;
+  uint32_t bucket = atomic_load(&pp->bucket);
+  if (bucket == detached_fullness_bucket) return;
+  objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+  uint32_t new_bucket = fullness_bucket(o_per_folio, o_per_folio - folio_inuse(pp, o_per_folio));
+  prefetch_write(&pp->inuse_count);
+  if (new_bucket == bucket) return;
 
-  per_folio *next = result_pp->next;
-  if (next) {
-    load_and_prefetch_write(&next->prev);
+  per_folio *pp_next = atomic_load(&pp->next);
+  per_folio *pp_prev = atomic_load(&pp->prev);
+  if (pp_prev == NULL) {
+    load_and_prefetch_write(&d->lists.b[dsbi_offset + bucket]);
+  } else {
+    load_and_prefetch_write(&pp_prev->next);
   }
-  per_folio *old_h_below = atomic_load(&dsbi.lists.b[dsbi_offset + fullest -1]);
-  prefetch_write(&dsbi.lists.b[dsbi_offset + fullest -1]); // previously fetched
-  if (old_h_below) {
-    load_and_prefetch_write(&old_h_below->prev);
+  if (pp_next != NULL) {
+    load_and_prefetch_write(&pp_next->prev);
+  }
+  load_and_prefetch_write(&d->nonempty[bin]);
+  per_folio *new_next = atomic_load(&d->lists.b[dsbi_offset + new_bucket]);
+  if (new_next) {
+    load_and_prefetch_write(&new_next->prev);
   }
+  prefetch_write(&d->lists.b[dsbi_offset + new_bucket]);
+}
 
-  // set the new fullest
-  prefetch_write(&dsbi.fullest_offset[bin]);            // previously fetched
+static per_folio* do_refile_folio(dsbi_shard *d,
+				  binnumber_t bin,
+				  uint32_t dsbi_offset,
+				  per_folio *pp)
+// Effect: pp's bitmap changed while no shard owned it.  If pp is on a
+//  list, count its objects again and move it to the right list.
+//  Returns NULL or else pp, if the folio is empty and should be
+//  madvised.  Refiling a folio that is already on the right list (or
+//  that is owned or detached) does nothing.
+{
+  if (pp->owned || pp->bucket == detached_fullness_bucket) return NULL;
+  objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+  uint32_t inuse = folio_inuse(pp, o_per_folio);
+  // The folio changes lists only if it crosses a bucket boundary, and
+  // an empty madvised folio stays madvised.
+  uint32_t bucket = fullness_bucket(o_per_folio, o_per_folio - inuse);
+  if (bucket == pp->bucket
+      || (inuse == 0 && pp->bucket == madvised_fullness_bucket(o_per_folio))) {
+    pp->inuse_count = inuse;
+    return NULL;
+  }
+  unlink_folio(d, bin, dsbi_offset, pp);
+  return file_folio(d, bin, dsbi_offset, pp);
+}
 
-  if (fullest <= 1) {
-    for (uint32_t new_fullest = 1; new_fullest <= o_per_folio; new_fullest++) {
-      if (atomic_load(&dsbi.lists.b[dsbi_offset + new_fullest])) {
-	break;
-      }
-    }
+static void predo_small_acquire_folio(dsbi_shard *d,
+				      binnumber_t bin,
+				      uint32_t dsbi_offset,
+				      per_folio *old_pp,
+				      per_folio **madvise_me __attribute__((unused))) {
+  prefetch_write(&d->owned[bin]);
+  if (old_pp) {
+    prefetch_write(&old_pp->owned);
   }
+  uint32_t nonempty = atomic_load(&d->nonempty[bin]);
+  if (nonempty == 0) return; // A chunk must be allocated.
+  per_folio *pp = atomic_load(&d->lists.b[dsbi_offset + __builtin_ctz(nonempty)]);
+  if (pp == NULL) return; // Can happen only because predo isn't done atomically.
+  prefetch_write(&pp->owned);
+  per_folio *next = atomic_load(&pp->next);
+  if (next) {
+    load_and_prefetch_write(&next->prev);
+  }
+  prefetch_write(&d->nonempty[bin]);
+}
 
-  // prefetch the bitmap
-  for (uint32_t w = 0; w < ceil(o_per_folio, 64); w++) {
-    uint64_t bw = atomic_load(&result_pp->inuse_bitmap[w]);
-    if (bw != UINT64_MAX) {
-      prefetch_write(&result_pp->inuse_bitmap[w]);
-      break;
-    }
+static per_folio* do_small_acquire_folio(dsbi_shard *d,
+					 binnumber_t bin,
+					 uint32_t dsbi_offset,
+					 per_folio *old_pp,
+					 per_folio **madvise_me)
+// Effect: The shard's owned folio for bin was old_pp (or NULL), and
+//  we couldn't claim anything out of it.  Unless another thread has
+//  already traded it in, put it back on the lists and take the folio
+//  at the head of the fullest nonempty list instead.  Return the
+//  shard's owned folio, or NULL if the lists are empty (indicating
+//  that a chunk must be allocated).  Set *madvise_me to NULL or else
+//  to a folio that the caller should madvise.
+{
+  *madvise_me = NULL;
+  per_folio *pp = d->owned[bin];
+  if (pp != NULL) {
+    if (pp != old_pp) return pp;
+    // An exchange rather than a store, so that the count in
+    // file_folio() sees the bits of any malloc or free that saw the
+    // folio still owned.
+    __atomic_exchange_n(&pp->owned, 0, __ATOMIC_SEQ_CST);
+    d->owned[bin] = NULL;
+    *madvise_me = file_folio(d, bin, dsbi_offset, pp);
   }
-}  
+  uint32_t nonempty = d->nonempty[bin];
+  if (nonempty == 0) return NULL;
+  pp = d->lists.b[dsbi_offset + __builtin_ctz(nonempty)];
+  bassert(pp);
+  unlink_folio(d, bin, dsbi_offset, pp);
+  pp->owned = 1;
+  d->owned[bin] = pp;
+  return pp;
+}
 
+static void predo_small_malloc_steal(dsbi_shard *d,
+				     binnumber_t bin,
+				     uint32_t dsbi_offset,
+				     small_batch *b __attribute__((unused))) {
+  uint32_t nonempty = atomic_load(&d->nonempty[bin]);
+  if (nonempty == 0) return;
+  per_folio *pp = atomic_load(&d->lists.b[dsbi_offset + __builtin_ctz(nonempty)]);
+  if (pp == NULL) return; // Can happen only because predo isn't done atomically.
+  prefetch_write(&pp->inuse_count);
+}
 
-static void* do_small_malloc(binnumber_t bin,
-			     uint32_t dsbi_offset,
-			     uint32_t o_size)
-// Effect: If there is one get an object out of the fullest nonempty page, and return it. 
-//    If there is no such object return NULL.
-//    (Previously, we made sure there was something in a nonempty page, but
-//    another thread may have grabbed it.)
+static uint32_t do_small_malloc_steal(dsbi_shard *d,
+				      binnumber_t bin,
+				      uint32_t dsbi_offset,
+				      small_batch *b)
+// Effect: Claim one object out of the fullest nonempty folio on d's
+//  lists (without taking the folio), and refile the folio.  Record the
+//  folio and the claimed bit in b and return how many we claimed.  We
+//  don't touch the object itself here, so that the transaction stays
+//  small and doesn't fault on a madvised folio.
 {
+  uint32_t nonempty = d->nonempty[bin];
+  if (nonempty == 0) return 0;
+  b->pp = d->lists.b[dsbi_offset + __builtin_ctz(nonempty)];
+  bassert(b->pp);
+  uint32_t n_got = claim_in_folio(b->pp, static_bin_info[bin].objects_per_folio, 1, b->claimed);
+  // The folio isn't empty now (or it was full all along and the
+  // nonempty bit was stale), so this doesn't ask for a madvise.
+  per_folio *madvise_me = do_refile_folio(d, bin, dsbi_offset, b->pp);
+  bassert(madvise_me == NULL);
+  return n_got;
+}
 
-  uint32_t fullest = dsbi.fullest_offset[bin];
-  if (fullest == 0) return NULL; // Indicating that a chunk must be allocated.
+static void purge_empty_folio(binnumber_t bin, per_folio *pp);
+static per_folio* small_object_folio(void *p, binnumber_t bin, uint64_t *objnum);
 
-  uint16_t o_per_folio = static_bin_info[bin].objects_per_folio;
-  uint32_t fetch_offset = fullest;
-  per_folio *result_pp = dsbi.lists.b[dsbi_offset + fetch_offset];
-  if (fullest == o_per_folio && result_pp == NULL) {
-    // Special case, get stuff from the end.
-    fetch_offset++;
-    result_pp = dsbi.lists.b[dsbi_offset + fetch_offset];
+static void small_refile_folio(binnumber_t bin, per_folio *pp)
+// Effect: We changed pp's bitmap and then saw that no shard owns pp.
+//  Move pp to the right list, and madvise it if it is empty.
+{
+  uint32_t shard = pp->shard;
+  per_folio *madvise_me = atomically(&small_locks[shard][bin], ATOMIC_SITE("small_refile_folio"),
+				     predo_refile_folio, do_refile_folio,
+				     &dsbi[shard], bin, dynamic_small_bin_offset(bin), pp);
+  if (madvise_me) {
+    bassert(madvise_me == pp);
+    purge_empty_folio(bin, pp);
   }
+}
 
-  bassert(result_pp);
-  // update the linked list.
-  per_folio *next = result_pp->next;
+static void merge_pending_frees(binnumber_t bin, per_folio *pp)
+// Effect: Take everything off pp's pending stack and clear the
+//  objects' bits, and then refile pp if no shard owns it.
+{
+  objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+  uint64_t cleared[folio_bitmap_n_words];
+  for (uint32_t w = 0; w < ceil(o_per_folio, 64); w++) {
+    cleared[w] = 0;
+  }
+  int16_t n = 0;
+  void *p = __atomic_exchange_n(&pp->pending, (void*)NULL, __ATOMIC_SEQ_CST);
+  for (; p; p = *reinterpret_cast<void**>(p)) {
+    uint64_t objnum;
+    bassert(small_object_folio(p, bin, &objnum) == pp);
+    cleared[objnum/64] |= 1ul << (objnum%64);
+    n++;
+  }
+  __sync_fetch_and_sub(&pp->n_pending, n);
+  unclaim_in_folio(pp, o_per_folio, cleared);
+  if (!atomic_load(&pp->owned)) {
+    small_refile_folio(bin, pp);
+  }
+}
 
-  // When I did a study to try to figure out where most of the
-  // transaction conflicts occure, it was here: this line is causing
-  // most of the trouble because the fullest slot doesn't move much.
-  dsbi.lists.b[dsbi_offset + fetch_offset] = next;
+static void push_pending_frees(binnumber_t bin, per_folio *pp, void *first, void *last, uint32_t n)
+// Effect: Push the n freed objects first..last (linked through their
+//  first word) onto pp's pending stack, and make sure pp is on its
+//  shard's stack of folios with pending frees.
+{
+  void *old;
+  do {
+    old = atomic_load(&pp->pending);
+    *reinterpret_cast<void**>(last) = old;
+  } while (!__sync_bool_compare_and_swap(&pp->pending, old, first));
+  int16_t n_pending = __sync_add_and_fetch(&pp->n_pending, (int16_t)n);
+  if (!atomic_load(&pp->pending_listed) && __sync_bool_compare_and_swap(&pp->pending_listed, 0, 1)) {
+    per_folio **head = &dsbi[pp->shard].pending_folios[bin];
+    per_folio *old_pp;
+    do {
+      old_pp = atomic_load(head);
+      pp->pending_next = old_pp;
+    } while (!__sync_bool_compare_and_swap(head, old_pp, pp));
+    if (purger == PURGER_THREAD) start_purge_thread();
+  }
+  // The folio is probably empty now, so merge it right away.  (Only
+  // the steal changes the bitmap of a filed folio, and it refiles the
+  // folio.)
+  if (n_pending >= atomic_load(&pp->inuse_count)) {
+    merge_pending_frees(bin, pp);
+  }
+}
 
-  if (next) {
-    next->prev = NULL;
+static void small_merge_pending(binnumber_t bin, uint32_t shard)
+// Effect: Merge the pending frees of the folios on the shard's stack
+//  for bin.
+{
+  per_folio *pp = __atomic_exchange_n(&dsbi[shard].pending_folios[bin], (per_folio*)NULL, __ATOMIC_SEQ_CST);
+  while (pp) {
+    // Read pending_next first, since once pending_listed is clear, the
+    // next free into pp pushes pp again.
+    per_folio *next = atomic_load(&pp->pending_next);
+    __atomic_exchange_n(&pp->pending_listed, 0, __ATOMIC_SEQ_CST);
+    merge_pending_frees(bin, pp);
+    pp = next;
   }
-  
-  // Add the item to the next list down.
-  
-  per_folio *old_h_below = dsbi.lists.b[dsbi_offset + fullest -1];
-  result_pp->next = old_h_below;
-  if (old_h_below) {
-    old_h_below->prev = result_pp;
-  }
-  dsbi.lists.b[dsbi_offset + fullest -1] = result_pp;
-      
-  // Must also figure out the new fullest.
-  if (fullest > 1) {
-    dsbi.fullest_offset[bin] = fullest-1;
-  } else {
-    // It was the last item in the page, so we must look to see if we have any other pages.
-    int use_new_fullest = 0;
-    for (uint32_t new_fullest = 1; new_fullest < o_per_folio+2u; new_fullest++) {
-      if (dsbi.lists.b[dsbi_offset + new_fullest]) {
-	// If the new fullest is the madvise-done pages then pretend
-	// that the fullest one is the madvise_needed slot.
-	if (new_fullest == o_per_folio+1u) new_fullest = o_per_folio;
-	use_new_fullest = new_fullest;
-	break;
+}
+
+void small_merge_pending_frees() {
+  for (uint32_t shard = 0; shard < n_small_shards; shard++) {
+    for (binnumber_t bin = 0; bin < first_large_bin_number; bin++) {
+      if (atomic_load(&dsbi[shard].pending_folios[bin])) {
+	small_merge_pending(bin, shard);
       }
     }
-    dsbi.fullest_offset[bin] = use_new_fullest;
   }
+}
 
-  // Now set the bitmap
-  uint32_t w_max = ceil(static_bin_info[bin].objects_per_folio, 64);
-  for (uint32_t w = 0; w < w_max; w++) {
-    uint64_t bw = result_pp->inuse_bitmap[w];
-    if (bw != UINT64_MAX) {
-      // Found an empty bit.
-      uint64_t bwbar = ~bw;
-      int      bit_to_set = __builtin_ctzl(bwbar);
-      result_pp->inuse_bitmap[w] = bw | (1ul<<bit_to_set);
-
-      if (0) printf("result_pp  = %p\n", result_pp);
-      if (0) printf("bit_to_set = %d\n", bit_to_set);
-
-      uint64_t chunk_address = reinterpret_cast<uint64_t>(address_2_chunkaddress(result_pp));
-      uint64_t wasted_off   = static_bin_info[bin].overhead_pages_per_chunk * pagesize;
-      uint64_t folio_num     = offset_in_chunk(result_pp)/sizeof(per_folio);
-      uint64_t folio_size   = static_bin_info[bin].folio_size;
-      uint64_t folio_off     = folio_num * folio_size;
-      uint64_t obj_off      = (w * 64 + bit_to_set) * o_size;
-      return reinterpret_cast<void*>(chunk_address + wasted_off + folio_off + obj_off);
+static bool small_malloc_steal(binnumber_t bin,
+			       uint32_t shard,
+			       uint32_t dsbi_offset,
+			       small_batch *b)
+// Effect: Our shard has no free objects in bin.  Before we allocate a
+//  new chunk, try to get an object from one of the other shards.
+//  Record it in b and return true if we got one.
+{
+  for (uint32_t i = 1; i < n_small_shards; i++) {
+    uint32_t s = (shard + i) % n_small_shards;
+    if (atomic_load(&dsbi[s].pending_folios[bin])) {
+      small_merge_pending(bin, s);
+    }
+    // Each failed try moves a stale folio to the full list, so this
+    // loop ends.
+    while (atomic_load(&dsbi[s].nonempty[bin]) != 0) {
+      if (atomically(&small_locks[s][bin], ATOMIC_SITE("small_malloc_steal"),
+		     predo_small_malloc_steal, do_small_malloc_steal,
+		     &dsbi[s], bin, dsbi_offset, b)) {
+	return true;
+      }
     }
   }
-  abort(); // It's bad if we get here, it means that there was no bit in the bitmap, but the data structure said there should be.
+  return false;
 }
 
-//#define MICROTIMING
-
-#ifdef MICROTIMING
-#define WHEN_MICROTIMING(x) x
-#else
-#define WHEN_MICROTIMING(x) (void)(0)
-#endif
-
-#ifdef MICROTIMING
-static uint64_t rdtsc()
+static bool small_malloc_add_chunk(binnumber_t bin, uint32_t shard)
+// Effect: Allocate a new chunk for bin and add its folios to the
+//  shard.  Return false if we are out of memory.
 {
-  uint32_t hi, lo;
+  if (0) printf("Need a chunk\n");
+  void *chunk = mmap_chunk_aligned_block(1);
+  if (chunk == NULL) return false;
+  bin_and_size_t b_and_s = bin_and_size_to_bin_and_size(bin, 0);
+  bassert(b_and_s != 0);
+  chunk_infos[address_2_chunknumber(chunk)].bin_and_size = b_and_s;
 
-  __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
-  return (((uint64_t)lo) | (((uint64_t)hi) << 32));
+  objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+  uint16_t folios_per_chunk = static_bin_info[bin].folios_per_chunk;
+  small_chunk_header *sch = (small_chunk_header*)chunk;
+  for (uint32_t i = 0; i < folios_per_chunk; i++) {
+    for (uint32_t w = 0; w < ceil(o_per_folio, 64); w++) {
+      sch->ll[i].inuse_bitmap[w] = 0;
+    }
+    sch->ll[i].prev = (i   == 0)                ? NULL : &sch->ll[i-1];
+    sch->ll[i].next = (i+1 == folios_per_chunk) ? NULL : &sch->ll[i+1];
+    sch->ll[i].inuse_count = 0;
+    sch->ll[i].owned = 0;
+    sch->ll[i].bucket = madvised_fullness_bucket(o_per_folio);
+    sch->ll[i].n_pending = 0;
+    sch->ll[i].pending_listed = 0;
+    sch->ll[i].pending = NULL;
+    sch->ll[i].pending_next = NULL;
+    sch->ll[i].shard = shard;
+  }
+  atomically(&small_locks[shard][bin], ATOMIC_SITE("small_malloc_add_pages_from_new_chunk"),
+	     predo_small_malloc_add_pages_from_new_chunk,
+	     do_small_malloc_add_pages_from_new_chunk,
+	     &dsbi[shard], bin, dynamic_small_bin_offset(bin), sch);
+  return true;
 }
 
-__thread uint64_t clocks_spent_in_early_small_malloc = 0;
-__thread uint64_t clocks_spent_initializing_small_chunks = 0;
-__thread uint64_t clocks_spent_in_do_small_malloc = 0;
-#endif
+static uint32_t small_batch_objects(binnumber_t bin, small_batch *b, uint32_t n_got, void **objects)
+// Effect: Store the addresses of the n_got objects claimed in b into
+//  objects, and return n_got.
+{
+  uint64_t chunk_address = reinterpret_cast<uint64_t>(address_2_chunkaddress(b->pp));
+  uint64_t wasted_off   = static_bin_info[bin].overhead_pages_per_chunk * pagesize;
+  uint64_t folio_num    = offset_in_chunk(b->pp)/sizeof(per_folio);
+  uint64_t folio_start  = chunk_address + wasted_off + folio_num * static_bin_info[bin].folio_size;
+  uint32_t o_size       = static_bin_info[bin].object_size;
+  uint32_t i = 0;
+  for (uint32_t w = 0; i < n_got; w++) {
+    for (uint64_t bits = b->claimed[w]; bits; bits &= bits-1) {
+      objects[i++] = reinterpret_cast<void*>(folio_start + (w * 64 + __builtin_ctzl(bits)) * o_size);
+    }
+  }
+  return n_got;
+}
 
-void* small_malloc(binnumber_t bin)
-// Effect: Allocate a small object (all the small sizes are
-//  treated the same by all this code.)
-//  Allocate a small object in the fullest possible page.
+static uint32_t small_malloc_batch_in_shard(binnumber_t bin, uint32_t shard, uint32_t n,
+					    void **objects)
+// Effect: Allocate up to n objects (all the small sizes are treated
+//  the same by all this code) out of the shard's owned folio, or else
+//  steal one from another shard.  Return how many we got (0 means we
+//  are out of memory).
 {
-  WHEN_MICROTIMING(uint64_t start_small_malloc = rdtsc());
-  verify_small_invariants();
-  bin_stats_note_malloc(bin);
-  //size_t usable_size = bin_2_size(bin);
   bassert(bin < first_large_bin_number);
+  bassert(n > 0);
+  verify_small_invariants();
+  dsbi_shard *d = &dsbi[shard];
   uint32_t dsbi_offset = dynamic_small_bin_offset(bin);
   objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
-  uint32_t o_size     = static_bin_info[bin].object_size;
-  uint16_t folios_per_chunk = static_bin_info[bin].folios_per_chunk;
+  small_batch b;
+  bool merged = false, purged = false;
   while (1) {
-    WHEN_MICROTIMING(
-	uint64_t end_early_small_malloc = rdtsc();
-	clocks_spent_in_early_small_malloc += end_early_small_malloc - start_small_malloc
-		     );
-    uint32_t fullest = atomic_load(&dsbi.fullest_offset[bin]); // Otherwise it looks racy.
-    if (0) printf(" bin=%d off=%d  fullest=%d\n", bin, dsbi_offset, fullest);
-    if (fullest==0) {
-      if (0) printf("Need a chunk\n");
-      void *chunk = mmap_chunk_aligned_block(1);
-      if (chunk == NULL) return NULL;
-      bin_and_size_t b_and_s = bin_and_size_to_bin_and_size(bin, 0);
-      bassert(b_and_s != 0);
-      chunk_infos[address_2_chunknumber(chunk)].bin_and_size = b_and_s;
-
-      small_chunk_header *sch = (small_chunk_header*)chunk;
-      for (uint32_t i = 0; i < folios_per_chunk; i++) {
-	for (uint32_t w = 0; w < ceil(o_per_folio, 64); w++) {
-	  sch->ll[i].inuse_bitmap[w] = 0;
+    b.pp = atomic_load(&d->owned[bin]);
+    if (b.pp) {
+      uint32_t n_got = claim_in_folio(b.pp, o_per_folio, n, b.claimed);
+      if (n_got > 0) {
+	if (atomic_load(&b.pp->owned)) {
+	  bin_stats_note_malloc(bin, n_got);
+	  return small_batch_objects(bin, &b, n_got, objects);
 	}
-	sch->ll[i].prev = (i   == 0)                ? NULL : &sch->ll[i-1];
-	sch->ll[i].next = (i+1 == folios_per_chunk) ? NULL : &sch->ll[i+1];
+	// The folio was traded in while we were claiming.  Give the
+	// objects back and let the lock holder file the folio.
+	unclaim_in_folio(b.pp, o_per_folio, b.claimed);
+	small_refile_folio(bin, b.pp);
+	continue;
       }
-      atomically(&small_locks[bin], "small_malloc_add_pages_from_new_chunk",
-		 predo_small_malloc_add_pages_from_new_chunk,
-		 do_small_malloc_add_pages_from_new_chunk,
-		 bin, dsbi_offset, sch);
     }
-
-    verify_small_invariants();
-
-    WHEN_MICROTIMING(
-	uint64_t start_do_small_malloc = rdtsc();
-	clocks_spent_initializing_small_chunks += start_do_small_malloc - end_early_small_malloc
-		     );
-    void *result = atomically(&small_locks[bin], "small_malloc",
-			      predo_small_malloc, do_small_malloc,
-			      bin, dsbi_offset, o_size);
-    verify_small_invariants();
-    WHEN_MICROTIMING(
-      uint64_t end_do_small_malloc = rdtsc();
-      clocks_spent_in_do_small_malloc += end_do_small_malloc - start_do_small_malloc;
-      start_small_malloc = end_do_small_malloc // so that the subtraction on the next iteration of the loop will work.
-		     );
-    if (result) {
-      bassert(bin_from_bin_and_size(chunk_infos[address_2_chunknumber(result)].bin_and_size) == bin);
-      return result;
+    // There's no owned folio, or it's used up.  Merging the pending
+    // frees may make room in it, and otherwise we trade it in.
+    if (!merged && atomic_load(&d->pending_folios[bin])) {
+      merged = true;
+      small_merge_pending(bin, shard);
+      continue;
+    }
+    per_folio *madvise_me;
+    per_folio *pp = atomically(&small_locks[shard][bin], ATOMIC_SITE("small_acquire_folio"),
+			       predo_small_acquire_folio, do_small_acquire_folio,
+			       d, bin, dsbi_offset, b.pp, &madvise_me);
+    if (madvise_me) purge_empty_folio(bin, madvise_me);
+    if (pp == NULL) {
+      // Rather than stealing a batch from another shard (which would
+      // then be freed back to that shard), steal just one object.
+      if (small_malloc_steal(bin, shard, dsbi_offset, &b)) {
+	bin_stats_note_malloc(bin, 1);
+	return small_batch_objects(bin, &b, 1, objects);
+      }
+      // Before we map a chunk, get the queued folios onto the lists.
+      if (!purged && atomic_load(&purge_queue)) {
+	purged = true;
+	small_purge();
+	continue;
+      }
+      if (!small_malloc_add_chunk(bin, shard)) return 0;
     }
   }
 }
 
+static void* small_malloc_in_shard(binnumber_t bin, uint32_t shard) {
+  void *result;
+  if (small_malloc_batch_in_shard(bin, shard, 1, &result) == 0) return NULL;
+  bassert(bin_from_bin_and_size(chunk_infos[address_2_chunknumber(result)].bin_and_size) == bin);
+  return result;
+}
+
+void* small_malloc(binnumber_t bin) {
+  return small_malloc_in_shard(bin, cpu_slot(getcpu()) % n_small_shards);
+}
+
+uint32_t small_malloc_batch(binnumber_t bin, uint32_t n, void **objects) {
+  return small_malloc_batch_in_shard(bin, cpu_slot(getcpu()) % n_small_shards, n, objects);
+}
+
 #ifndef NOCPPRUNTIME
 // We want this timing especially when not in test code.
 extern "C" void time_small_malloc(void) {
@@ -359,12 +709,10 @@ extern "C" void time_small_malloc(void) {
   struct timespec start,end;
 
   clock_gettime(CLOCK_MONOTONIC, &start);
-  WHEN_MICROTIMING(uint64_t clocks_in_small_malloc = 0);
   for (int i = 0; i < ncalls; i++) {
-    WHEN_MICROTIMING(uint64_t start_rdtsc = rdtsc());
+    uint64_t start_rdtsc = latency_start();
     void *n = small_malloc(0); // bin 0 is the smallest size
-    WHEN_MICROTIMING(uint64_t end_rdtsc = rdtsc();
-		     clocks_in_small_malloc += end_rdtsc - start_rdtsc);
+    note_latency(latency_malloc_small, start_rdtsc);
     array[i] = n;
   }
   clock_gettime(CLOCK_MONOTONIC, &end);
@@ -372,14 +720,6 @@ extern "C" void time_small_malloc(void) {
   //printf("end  =%ld.%09ld\n", end.tv_sec,   end.tv_nsec);
   //printf("tdiff=%0.9f\n", tdiff(&start, &end));
   printf("%fns/small_malloc\n", tdiff(&start, &end)*1e9/ncalls);
-  WHEN_MICROTIMING( ({
-      printf("%5.1f clocks/small_malloc\n", clocks_in_small_malloc/(double)ncalls);
-      printf("%5.1f clocks/small_malloc spent early small malloc\n", clocks_spent_in_early_small_malloc/(double)ncalls);
-      printf("%5.1f clocks/small_malloc spent initializing small chunks\n", clocks_spent_initializing_small_chunks/(double)ncalls);
-      printf("%5.1f clocks/small_malloc spent in do_small_malloc\n", clocks_spent_in_do_small_malloc/(double)ncalls);
-      printf("%5.1f clocks/small_malloc unaccounted for\n",
-	     (clocks_in_small_malloc - clocks_spent_in_early_small_malloc - clocks_spent_initializing_small_chunks - clocks_spent_in_do_small_malloc)/(double)ncalls);
-      }));
 
   for (int i = 0; i < ncalls; i++) {
     free(array[i]);
@@ -388,197 +728,199 @@ extern "C" void time_small_malloc(void) {
 }
 #endif // !defined NOCPPRUNTIME
 
-static void predo_small_free(binnumber_t bin,
-			     per_folio *pp,
-			     uint64_t objnum,
-			     uint32_t dsbi_offset) {
-  uint16_t o_per_folio = static_bin_info[bin].objects_per_folio;
-  uint32_t old_count = 0;
-  uint32_t imax = ceil(static_bin_info[bin].objects_per_folio, 64);
-  for (uint32_t i = 0; i < imax; i++) old_count += __builtin_popcountl(atomic_load(&pp->inuse_bitmap[i]));
-  // prefetch for clearing the bit.  We know it was just loaded, so we don't have to load it again.
-  bassert(objnum/64 < imax);
-  prefetch_write(&pp->inuse_bitmap[objnum/64]);
-
-  uint32_t old_offset_within = o_per_folio - old_count;
-  uint32_t old_offset_dsbi = dsbi_offset + old_offset_within;
-  uint32_t new_offset = old_offset_dsbi + 1;
-
-  per_folio *pp_next = atomic_load(&pp->next);
-  per_folio *pp_prev = atomic_load(&pp->prev);
-
-  prefetch_write(&pp->next);
-  prefetch_write(&pp->prev);
-  if (pp_prev == NULL) {
-    load_and_prefetch_write(&dsbi.lists.b[old_offset_dsbi]);
-  } else {
-    load_and_prefetch_write(&pp_prev->next);
-  }
-  if (pp_next != NULL) {
-    load_and_prefetch_write(&pp_next->prev);
+void predo_small_free_post_madvise(dsbi_shard *d, per_folio *pp, uint32_t n, binnumber_t bin) {
+  uint32_t madvised = dynamic_small_bin_offset(bin) + madvised_fullness_bucket(static_bin_info[bin].objects_per_folio);
+  per_folio * new_next = atomic_load(&d->lists.b[madvised]);
+  for (uint32_t i = 0; i < n; i++) {
+    prefetch_write(&pp[i].next);
   }
-  // prefetch for fixing up the count
-  uint32_t fullest_off = atomic_load(&dsbi.fullest_offset[bin]);
-  if (old_offset_within == 0
-      || (pp_next == NULL && fullest_off == old_offset_within)) {
-    prefetch_write(&dsbi.fullest_offset[bin]);
-  }
-  per_folio *new_next = atomic_load(&dsbi.lists.b[new_offset]);
   if (new_next) {
     load_and_prefetch_write(&new_next->prev);
   }
-  prefetch_write(&dsbi.lists.b[new_offset]);
+  prefetch_write(&d->lists.b[madvised]);
+  load_and_prefetch_write(&d->nonempty[bin]);
 }
 
-static per_folio* do_small_free(binnumber_t bin,
-				per_folio *pp,
-				uint64_t objnum,
-				uint32_t dsbi_offset)
-// Effect: Free the object specified by objnum and pp (that is the
-// objnum'th object in the folio corresponding to pp).  Returns NULL
-// or else a pointer to a folio that should be freed.
+bool small_free_post_madvise(dsbi_shard *d, per_folio *pp, uint32_t n, binnumber_t bin)
+// Effect: After calling madvise to clear the n adjacent folios
+//  starting at pp, put the folios into the list of madvised folios for
+//  the bin.
+//  The pp is a per-folio linked-list element stored at the beginning of the chunk.
 {
-  uint16_t o_per_folio = static_bin_info[bin].objects_per_folio;
-  uint32_t old_count = 0;
-  uint32_t imax = ceil(static_bin_info[bin].objects_per_folio, 64);
-  for (uint32_t i = 0; i < imax; i++) old_count += __builtin_popcountl(pp->inuse_bitmap[i]);
-  // clear the bit.
-  uint64_t old_bits = pp->inuse_bitmap[objnum/64];
-  bassert(old_bits & (1ul << (objnum%64)));
-  pp->inuse_bitmap[objnum/64] = old_bits & ~ ( 1ul << (objnum%64 ));
-  if (IS_TESTING) bassert(old_count > 0 && old_count <= o_per_folio);
-
-  uint32_t old_offset_within = o_per_folio - old_count;
-  uint32_t new_offset_within = old_offset_within + 1;
-  uint32_t old_offset_dsbi = dsbi_offset + old_offset_within;
-  uint32_t new_offset = old_offset_dsbi + 1;
-
-  // remove from old list
-  per_folio * pp_next = pp->next;  
-  per_folio * pp_prev = pp->prev;
-  if (pp_prev == NULL) {
-    bassert(dsbi.lists.b[old_offset_dsbi] == pp);
-    dsbi.lists.b[old_offset_dsbi] = pp_next;
-  } else {
-    pp_prev->next = pp_next;
-  }
-  if (pp_next != NULL) {
-    pp_next->prev = pp_prev;
-  }
-  // Fix up the old_count
-  if (old_offset_within == 0) {
-    dsbi.fullest_offset[bin] = new_offset_within;
-  } else if (pp_next == NULL && dsbi.fullest_offset[bin] == old_offset_within) {
-    dsbi.fullest_offset[bin] = new_offset_within;
-  }
-  // Add to new list
-  bassert(new_offset < dsbi_offset + o_per_folio + 1);
-  if (new_offset != dsbi_offset + o_per_folio
-      || dsbi.lists.b[new_offset] == NULL) {
-    // Don't madvise the folio, since either it's not empty or there are no folios in the empty slot.
-    // Even if the folio is empty, we want to keep one folio around without madvising() it
-    //  in order to have some hysteresis in the madvise()/commit cycle.
-    per_folio *new_next = dsbi.lists.b[new_offset];
-    pp->prev = NULL;
-    pp->next = new_next;
-    if (new_next) {
-      new_next->prev = pp;
-    }
-    dsbi.lists.b[new_offset] = pp;
-    return NULL;
-  } else {
-    // Ask the caller madvise the folio (by returning the pp) and add
-    // it to the slot later.
-    //
-    // The fullest_offset is still correct, because we do this only if
-    // there is something in the new_offset.
-    return pp;
+  objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+  for (uint32_t i = 0; i < n; i++) {
+    pp[i].inuse_count = folio_inuse(&pp[i], o_per_folio);
+    link_folio(d, bin, dynamic_small_bin_offset(bin), &pp[i], madvised_fullness_bucket(o_per_folio));
   }
+  return true; // cannot return void from a templated function.
 }
 
-void predo_small_free_post_madvise(per_folio * pp, uint32_t total_dsbi_offset) {
-  per_folio * new_next = atomic_load(&dsbi.lists.b[total_dsbi_offset]);
-  prefetch_write(&pp->prev);
-  prefetch_write(&pp->next);
-  if (new_next) {
-    load_and_prefetch_write(&new_next->prev);
+static per_folio* small_object_folio(void *p, binnumber_t bin, uint64_t *objnum)
+// Effect: Return the folio that small object p (in bin) lives in, and
+//  set *objnum to p's index within the folio.
+{
+  small_chunk_header *sch = reinterpret_cast<small_chunk_header*>(address_2_chunkaddress(p));
+  uint64_t wasted_offset =   static_bin_info[bin].overhead_pages_per_chunk * pagesize;
+  uint64_t useful_offset =   offset_in_chunk(p) - wasted_offset;
+  bassert(reinterpret_cast<uint64_t>(p) >= wasted_offset);
+  uint32_t       folio_num = divide_offset_by_foliosize(useful_offset, bin);
+  per_folio            *pp = &sch->ll[folio_num];
+  uint32_t folio_size      = static_bin_info[bin].folio_size;
+  uint32_t offset_in_folio = useful_offset - folio_num * folio_size;
+  *objnum                  = divide_offset_by_objsize(offset_in_folio, bin);
+  if (IS_TESTING) {
+    uint32_t o_size     = static_bin_info[bin].object_size;
+    uint64_t       objnum2 = offset_in_folio / o_size;
+    bassert(*objnum == objnum2);
   }
-  prefetch_write(&dsbi.lists.b[total_dsbi_offset]);
+  if (IS_TESTING) bassert((pp->inuse_bitmap[*objnum/64] >> (*objnum%64)) & 1);
+  return pp;
 }
 
-bool small_free_post_madvise(per_folio * pp, uint32_t total_dsbi_offset)
-// Effect: After calling madvise to clear a folio, put the folio into the free list.
-//  The pp is a per-folio linked-list element stored at the beginning of the chunk.
-//  The total_dsbi_offset is the offset that corresponds to the list of completely
-//  free folios.
+static void madvise_folios(binnumber_t bin, per_folio *pp, uint32_t n)
+// Effect: Give the pages of the n adjacent empty folios starting at
+//  pp back to the operating system (with one madvise), and put the
+//  folios onto the madvised list.
 {
-  per_folio * new_next = dsbi.lists.b[total_dsbi_offset];
-  pp->prev = NULL;
-  pp->next = new_next;
-  if (new_next) {
-    new_next->prev = pp;
+  // We are the only one that holds these pages (they are empty, so no
+  // other thread could free an object into them, and we kept them out
+  // of the dsbi lists, so no other thread can try to allocate out
+  // of them.  A malloc that is slow to see that a folio was traded in
+  // may still set a bit, but it gives the bit back without touching
+  // the object.)
+  uint64_t chunk_address = reinterpret_cast<uint64_t>(address_2_chunkaddress(pp));
+  uint64_t wasted_offset = static_bin_info[bin].overhead_pages_per_chunk * pagesize;
+  uint64_t folio_num     = offset_in_chunk(pp)/sizeof(per_folio);
+  uint32_t folio_size    = static_bin_info[bin].folio_size;
+  uint64_t madvise_address = chunk_address + wasted_offset + folio_num * folio_size;
+  uint64_t start = latency_start();
+  purge_pages(reinterpret_cast<void*>(madvise_address), n * folio_size);
+  note_latency(latency_madvise_small, start);
+  // Now put them back into the list.
+  // Cannot quite do this with a compare-and-swap since we have to update d->lists[new_offset] as well as the prev pointer
+  // in whatever is there.
+  uint32_t shard = pp->shard;
+  atomically(&small_locks[shard][bin], ATOMIC_SITE("small_free_post_madvise"),
+	     predo_small_free_post_madvise, small_free_post_madvise,
+	     &dsbi[shard], pp, n, bin);
+}
+
+static void purge_empty_folio(binnumber_t bin, per_folio *pp)
+// Effect: do_refile_folio (or file_folio) handed us the empty folio
+//  pp.  Madvise it now, or queue it for the purger.
+{
+  if (purger == PURGER_INLINE) {
+    madvise_folios(bin, pp, 1);
+    return;
   }
-  dsbi.lists.b[total_dsbi_offset] = pp;
-  return true; // cannot return void from a templated function.
+  per_folio *old;
+  do {
+    old = atomic_load(&purge_queue);
+    pp->next = old;
+  } while (!__sync_bool_compare_and_swap(&purge_queue, old, pp));
+  if (purger == PURGER_THREAD) start_purge_thread();
+}
+
+uint64_t small_purge() {
+  small_merge_pending_frees();
+  per_folio *pp = __atomic_exchange_n(&purge_queue, (per_folio*)NULL, __ATOMIC_SEQ_CST);
+  uint64_t n_calls = 0;
+  const uint32_t batch_limit = 256;
+  per_folio *batch[batch_limit];
+  while (pp) {
+    // Take the next pointers before madvise_folios() reuses them.
+    uint32_t n = 0;
+    for (; pp && n < batch_limit; pp = pp->next) {
+      batch[n++] = pp;
+    }
+    // The per_folios of adjacent folios in a chunk are adjacent, so
+    // sorting puts the runs of adjacent folios together.
+    std::sort(batch, batch + n);
+    for (uint32_t i = 0; i < n; ) {
+      uint32_t j = i + 1;
+      while (j < n && batch[j] == batch[j-1] + 1) j++;
+      binnumber_t bin = bin_from_bin_and_size(chunk_infos[address_2_chunknumber(batch[i])].bin_and_size);
+      madvise_folios(bin, batch[i], j - i);
+      n_calls++;
+      i = j;
+    }
+  }
+  return n_calls;
 }
 
 void small_free(void* p) {
   verify_small_invariants();
-  void *chunk = address_2_chunkaddress(p);
-  small_chunk_header *sch = reinterpret_cast<small_chunk_header*>(chunk);
   chunknumber_t chunk_num  = address_2_chunknumber(p);
   bin_and_size_t b_and_s   = chunk_infos[chunk_num].bin_and_size;
   bassert(b_and_s != 0);
   binnumber_t   bin        = bin_from_bin_and_size(b_and_s);
-  uint64_t wasted_offset =   static_bin_info[bin].overhead_pages_per_chunk * pagesize;
-  uint64_t useful_offset =   offset_in_chunk(p) - wasted_offset;
-  bassert(reinterpret_cast<uint64_t>(p) >= wasted_offset);
-  uint32_t       folio_num = divide_offset_by_foliosize(useful_offset, bin);
-  per_folio            *pp = &sch->ll[folio_num];
-  uint32_t folio_size      = static_bin_info[bin].folio_size;
-  uint32_t offset_in_folio = useful_offset - folio_num * folio_size;
-  uint64_t        objnum   = divide_offset_by_objsize(offset_in_folio, bin);
-  if (IS_TESTING) {
-    uint32_t o_size     = static_bin_info[bin].object_size;
-    uint64_t       objnum2 = offset_in_folio / o_size;
-    bassert(objnum == objnum2);
+  uint64_t objnum;
+  per_folio *pp = small_object_folio(p, bin, &objnum);
+
+  if (atomic_load(&pp->owned)) {
+    // The folio gets filed when the shard trades it in, unless that
+    // happened before we cleared the bit.
+    uint64_t old_bits = __sync_fetch_and_and(&pp->inuse_bitmap[objnum/64], ~(1ul << (objnum%64)));
+    bassert(old_bits & (1ul << (objnum%64)));
+    if (!atomic_load(&pp->owned)) {
+      small_refile_folio(bin, pp);
+    }
+  } else {
+    push_pending_frees(bin, pp, p, p, 1);
   }
-  if (IS_TESTING) bassert((pp->inuse_bitmap[objnum/64] >> (objnum%64)) & 1);
-  uint32_t dsbi_offset = dynamic_small_bin_offset(bin);
+  bin_stats_note_free(bin, 1);
+  verify_small_invariants();
+}
 
-  per_folio *madvise_me = atomically(&small_locks[bin], "small_free",
-				     predo_small_free, do_small_free,
-				     bin, pp, objnum, dsbi_offset);
-  if (madvise_me) {
-    // We are the only one that holds this page (it is empty, so no
-    // other thread could free an object into it, and we kept it out
-    // of the dsbi lists, so no other thread can try to allocate out
-    // of it.)
-    bassert(madvise_me == pp);
-    uint64_t madvise_address = (chunk_num * chunksize) + wasted_offset + folio_num * folio_size;
-    madvise(reinterpret_cast<void*>(madvise_address), folio_size, MADV_DONTNEED);
-    // Now put it back into the list.
-    // Doing this will not change the fullest offset, since this is fully empty.
-    // Cannot quite do this with a compare-and-swap since we have to update dsbi.lists[new_offset] as well as the prev pointer
-    // in whatever is there.
-    atomically(&small_locks[bin], "small_free_post_madvise",
-	       predo_small_free_post_madvise, small_free_post_madvise,
-	       pp, dsbi_offset + static_bin_info[bin].objects_per_folio + 1);
-  }
-  bin_stats_note_free(bin);
+void small_free_batch(binnumber_t bin, void **objects, uint32_t n) {
+  verify_small_invariants();
+  objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+  // Sorting by address puts the objects in the same folio next to each other.
+  std::sort(objects, objects + n);
+  uint32_t i = 0;
+  while (i < n) {
+    small_batch b;
+    uint64_t objnum;
+    b.pp = small_object_folio(objects[i], bin, &objnum);
+    for (uint32_t w = 0; w < folio_bitmap_n_words; w++) b.claimed[w] = 0;
+    uint32_t first = i;
+    uint32_t n_freed = 0;
+    do {
+      bassert(bin_from_bin_and_size(chunk_infos[address_2_chunknumber(objects[i])].bin_and_size) == bin);
+      b.claimed[objnum/64] |= 1ul << (objnum%64);
+      n_freed++;
+      i++;
+    } while (i < n && small_object_folio(objects[i], bin, &objnum) == b.pp);
+
+    if (atomic_load(&b.pp->owned)) {
+      unclaim_in_folio(b.pp, o_per_folio, b.claimed);
+      if (!atomic_load(&b.pp->owned)) {
+	small_refile_folio(bin, b.pp);
+      }
+    } else {
+      for (uint32_t j = first; j+1 < i; j++) {
+	*reinterpret_cast<void**>(objects[j]) = objects[j+1];
+      }
+      push_pending_frees(bin, b.pp, objects[first], objects[i-1], n_freed);
+    }
+    bin_stats_note_free(bin, n_freed);
+  }
   verify_small_invariants();
 }
 
 #ifdef TESTING
+#include <sched.h>
+#include <thread>
+
 static void test_bin_27() {
   static const int max_n_objects = 256;
   static void *allocated[max_n_objects];
   static int32_t folio_numbers[max_n_objects];
   static per_folio *pps[max_n_objects];
   static int32_t object_numbers_in_folio[max_n_objects];
+  const binnumber_t bin = 27;
   for (int n_objects = 1; n_objects <= max_n_objects; n_objects++) {
     for (int objnum = 0; objnum < n_objects; objnum++) {
-      const binnumber_t bin = 27;
       allocated[objnum] = small_malloc(bin);
       int32_t wasted_offset = static_bin_info[bin].overhead_pages_per_chunk * pagesize;
       int32_t useful_offset = offset_in_chunk(allocated[objnum]) - wasted_offset;
@@ -597,6 +939,7 @@ static void test_bin_27() {
 	  bassert(1 == ((pps[k]->inuse_bitmap[0] >> object_numbers_in_folio[k]) & 1));
       }
       small_free(allocated[objnum]);
+      small_merge_pending(bin, pps[objnum]->shard);
       for (int k = 0; k < n_objects; k++) {
 	if (k <= objnum)
 	  bassert(0 == ((pps[k]->inuse_bitmap[0] >> object_numbers_in_folio[k]) & 1));
@@ -607,6 +950,199 @@ static void test_bin_27() {
   }
 }
 
+static void test_small_shards() {
+  // Objects go back to the shard that owns their folio, and a shard
+  // with nothing free steals from the others.  Run on two fresh shards
+  // so that earlier tests don't leave anything on them.
+  dsbi_shard *old_dsbi = dsbi;
+  lock_t (*old_small_locks)[first_large_bin_number] = small_locks;
+  uint32_t old_n_small_shards = n_small_shards;
+  map_small_shards(2);
+  n_small_shards = 2;
+  const binnumber_t bin = first_large_bin_number - 1;
+  void *a = small_malloc_in_shard(bin, 1);
+  per_folio *pp = &reinterpret_cast<small_chunk_header*>(address_2_chunkaddress(a))->ll[0];
+  bassert(pp->shard == 1);
+  void *b = small_malloc_in_shard(bin, 1);
+  small_free(a);
+  bassert(dsbi[1].nonempty[bin] != 0);
+  // Shard 0 has never allocated, so it owns no folio and has none on
+  // its lists: it must steal from shard 1.
+  bassert(dsbi[0].nonempty[bin] == 0 && dsbi[0].owned[bin] == NULL);
+  void *c = small_malloc_in_shard(bin, 0);
+  bassert(address_2_chunkaddress(c) == address_2_chunkaddress(b));
+  bassert(dsbi[0].nonempty[bin] == 0);
+  small_free(c);
+  small_free(b);
+  dsbi = old_dsbi;
+  small_locks = old_small_locks;
+  n_small_shards = old_n_small_shards;
+}
+
+static void test_small_malloc_batch() {
+  // A batch comes out of one folio, and the objects can be freed one
+  // at a time.
+  const binnumber_t bin = 3;
+  const uint32_t n = 40;
+  void *objects[n];
+  uint32_t n_got = small_malloc_batch_in_shard(bin, 0, n, objects);
+  bassert(n_got > 0 && n_got <= n);
+  per_folio *pp = NULL;
+  for (uint32_t i = 0; i < n_got; i++) {
+    bassert(bin_from_bin_and_size(chunk_infos[address_2_chunknumber(objects[i])].bin_and_size) == bin);
+    uint64_t objnum;
+    per_folio *p_pp = small_object_folio(objects[i], bin, &objnum);
+    if (pp == NULL) pp = p_pp;
+    bassert(pp == p_pp);
+    bassert((pp->inuse_bitmap[objnum/64] >> (objnum%64)) & 1);
+  }
+  objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+  uint32_t inuse = folio_inuse(pp, o_per_folio);
+  for (uint32_t i = 0; i < n_got; i++) {
+    small_free(objects[i]);
+  }
+  bassert(folio_inuse(pp, o_per_folio) == inuse - n_got);
+}
+
+static void test_small_folio_ownership() {
+  // The shard allocates out of its owned folio, which is on no list,
+  // and files the folio when it trades it in.
+  const binnumber_t bin = 4;
+  objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+  dsbi_shard *d = &dsbi[0];
+  static void *objects[max_objects_per_folio + 1];
+  uint32_t n_objects = 0;
+  uint64_t objnum;
+  objects[n_objects++] = small_malloc_in_shard(bin, 0);
+  per_folio *pp = small_object_folio(objects[0], bin, &objnum);
+  bassert(d->owned[bin] == pp && pp->owned && pp->bucket == detached_fullness_bucket);
+  while (1) {
+    bassert(n_objects <= o_per_folio);
+    objects[n_objects] = small_malloc_in_shard(bin, 0);
+    if (small_object_folio(objects[n_objects++], bin, &objnum) != pp) break;
+  }
+  bassert(d->owned[bin] != pp && !pp->owned);
+  bassert(pp->bucket == 0 && pp->inuse_count == o_per_folio);
+  small_free(objects[--n_objects]);
+
+  // Freeing into a folio that isn't owned leaves the bit set until the
+  // pending frees are merged, which refiles the folio.
+  small_free(objects[0]);
+  bassert(pp->pending == objects[0] && d->pending_folios[bin] == pp);
+  bassert(pp->bucket == 0 && folio_inuse(pp, o_per_folio) == o_per_folio);
+  small_merge_pending(bin, 0);
+  bassert(pp->pending == NULL && d->pending_folios[bin] == NULL);
+  bassert(pp->bucket == 1 && pp->inuse_count == o_per_folio - 1);
+  small_free_batch(bin, &objects[1], n_objects - 1);
+  bassert(d->pending_folios[bin] == pp);
+  small_merge_pending_frees();
+  bassert(!pp->owned && pp->bucket != detached_fullness_bucket);
+  bassert(pp->inuse_count == folio_inuse(pp, o_per_folio));
+
+  // A malloc that claims a bit in a folio after it was traded in gives
+  // the bit back, and refiling leaves the folio where it was.
+  uint32_t bucket = pp->bucket, inuse = pp->inuse_count;
+  small_batch b;
+  b.pp = pp;
+  bassert(claim_in_folio(pp, o_per_folio, 1, b.claimed) == 1);
+  bassert(!atomic_load(&pp->owned));
+  unclaim_in_folio(pp, o_per_folio, b.claimed);
+  small_refile_folio(bin, pp);
+  bassert(pp->bucket == bucket && pp->inuse_count == inuse);
+
+  // Threads racing to claim and free in the same folios never get
+  // the same object twice.
+  const int n_threads = 4, n_rounds = 2000, n_batch = 30;
+  std::thread t[n_threads];
+  for (int k = 0; k < n_threads; k++) {
+    t[k] = std::thread([k]() {
+	void *objects[n_batch];
+	for (int r = 0; r < n_rounds; r++) {
+	  uint32_t n_got = (r % 3 == 0)
+	    ? small_malloc_batch_in_shard(bin, 0, n_batch, objects)
+	    : (objects[0] = small_malloc_in_shard(bin, 0), 1);
+	  for (uint32_t i = 0; i < n_got; i++) {
+	    *reinterpret_cast<uint64_t*>(objects[i]) = k * n_rounds + r;
+	  }
+	  sched_yield();
+	  for (uint32_t i = 0; i < n_got; i++) {
+	    bassert(*reinterpret_cast<uint64_t*>(objects[i]) == (uint64_t)(k * n_rounds + r));
+	  }
+	  if (r % 2) {
+	    small_free_batch(bin, objects, n_got);
+	  } else {
+	    for (uint32_t i = 0; i < n_got; i++) small_free(objects[i]);
+	  }
+	}
+      });
+  }
+  for (int k = 0; k < n_threads; k++) t[k].join();
+}
+
+static void test_small_free_batch() {
+  // Free objects from several folios, in an order that interleaves
+  // the folios.
+  const binnumber_t bin = 2;
+  const int n = 1000;
+  static void *objects[n];
+  static void *to_free[n];
+  static per_folio *pps[n];
+  static uint64_t objnums[n];
+  for (int i = 0; i < n; i++) {
+    objects[i] = small_malloc(bin);
+    pps[i] = small_object_folio(objects[i], bin, &objnums[i]);
+  }
+  for (int i = 0; i < n; i++) {
+    to_free[i] = objects[(i%2) ? i/2 : n-1-i/2];
+  }
+  small_free_batch(bin, to_free, n);
+  small_merge_pending(bin, 0);
+  for (int i = 0; i < n; i++) {
+    bassert(((pps[i]->inuse_bitmap[objnums[i]/64] >> (objnums[i]%64)) & 1) == 0);
+  }
+}
+
+static void test_small_purge() {
+  // With the user purger, the freeing thread only queues the empty
+  // folios, and the purge madvises each run of adjacent folios with one
+  // call.
+  purger_t old_purger = purger;
+  purger = PURGER_USER;
+  small_purge();
+  const binnumber_t bin = 6;
+  objects_per_folio_t o_per_folio = static_bin_info[bin].objects_per_folio;
+  const uint32_t n_folios = 6;
+  static void *objects[n_folios * max_objects_per_folio];
+  static per_folio *pps[n_folios];
+  uint32_t n_objects = 0, n_pps = 0;
+  while (1) {
+    objects[n_objects] = small_malloc_in_shard(bin, 0);
+    uint64_t objnum;
+    per_folio *pp = small_object_folio(objects[n_objects++], bin, &objnum);
+    if (n_pps == 0 || pps[n_pps-1] != pp) {
+      if (n_pps == n_folios) break;
+      pps[n_pps++] = pp;
+    }
+  }
+  small_free_batch(bin, objects, n_objects);
+  small_merge_pending_frees();
+  uint32_t n_queued = 0;
+  for (per_folio *pp = purge_queue; pp; pp = pp->next) {
+    bassert(pp->bucket == detached_fullness_bucket && folio_inuse(pp, o_per_folio) == 0);
+    n_queued++;
+  }
+  bassert(n_queued >= n_folios - 2);
+  uint64_t n_calls = small_purge();
+  bassert(n_calls >= 1 && n_calls < n_queued);
+  bassert(purge_queue == NULL);
+  uint32_t n_madvised = 0;
+  for (uint32_t i = 0; i < n_folios; i++) {
+    if (pps[i]->bucket == madvised_fullness_bucket(o_per_folio)) n_madvised++;
+  }
+  bassert(n_madvised >= n_queued);
+  purger = old_purger;
+}
+
 const int n8 = 600000;
 static void* data8[n8];
 const int n16 = n8/2;
@@ -615,11 +1151,16 @@ static void* data16[n16];
 void test_small_malloc(void) {
 
   // test that the dsbi offsets look reasonable.
-  bassert(&dsbi.lists.b0[0] == &dsbi.lists.b[dynamic_small_bin_offset(0)]);
-  bassert(&dsbi.lists.b1[0] == &dsbi.lists.b[dynamic_small_bin_offset(1)]);
-  bassert(&dsbi.lists.b2[0] == &dsbi.lists.b[dynamic_small_bin_offset(2)]);
+  bassert(&dsbi[0].lists.b0[0] == &dsbi[0].lists.b[dynamic_small_bin_offset(0)]);
+  bassert(&dsbi[0].lists.b1[0] == &dsbi[0].lists.b[dynamic_small_bin_offset(1)]);
+  bassert(&dsbi[0].lists.b2[0] == &dsbi[0].lists.b[dynamic_small_bin_offset(2)]);
 
   test_bin_27();
+  test_small_shards();
+  test_small_malloc_batch();
+  test_small_folio_ownership();
+  test_small_free_batch();
+  test_small_purge();
 
   for (int i = 0; i < n8; i++) {
     data8[i] = small_malloc(8);
@@ -1,38 +1,101 @@
 #include <algorithm>
-
-#ifdef ENABLE_STATS
-
+#include <stdio.h>
 
 #include "atomically.h"
+#include "bassert.h"
 #include "malloc_internal.h"
 #include "generated_constants.h"
+#include "stats.h"
 
+bool use_stats = false;
+uint64_t *counters = NULL;
 
-struct bin_stats {
-  uint64_t n_mallocs, net_n_mallocs, highwater_mark;
-};
+void init_counters() {
+  counters = reinterpret_cast<uint64_t*>(mmap_size(ceil(n_cpu_slots*counters_per_slot*sizeof(uint64_t), pagesize)*pagesize));
+  bassert(counters);
+}
 
-static struct stats {
-  bin_stats b[first_huge_bin_number+1]; // the last one is all the huge bin stats
-} stats;
+int64_t counter_read(stat_counter c) {
+  if (counters == NULL) return 0;
+  int64_t sum = 0;
+  for (uint32_t s = 0; s < n_cpu_slots; s++) {
+    sum += counters[s*counters_per_slot + c]; // We don't care if the answer is slightly stale.
+  }
+  return sum;
+}
 
-void bin_stats_note_malloc(binnumber_t b) {
-  b = std::min(first_huge_bin_number, b);
-  __sync_fetch_and_add(&stats.b[b].n_mallocs, 1);
-  uint64_t net = __sync_fetch_and_add(&stats.b[b].net_n_mallocs, 1);
-  fetch_and_max(&stats.b[b].highwater_mark, net);
+static void print_hits(const char *tier, stat_counter hits, stat_counter misses) {
+  int64_t h = counter_read(hits), a = h + counter_read(misses);
+  fprintf(stderr, "%s: %ld/%ld=%.0f%%\n", tier, h, a, a ? 100.0*(double)h/(double)a : 0.0);
 }
 
-void bin_stats_note_free(binnumber_t b) {
-  b = std::min(first_huge_bin_number, b);
-  __sync_fetch_and_add(&stats.b[b].net_n_mallocs, -1);
+static void print_cache_stats() {
+  print_hits("thread cache", counter_thread_cache_hits, counter_thread_cache_misses);
+  print_hits("cpu cache",    counter_cpu_cache_hits,    counter_cpu_cache_misses);
+  print_hits("shared cache", counter_shared_cache_hits, counter_shared_cache_misses);
+  print_hits("cpu cache (free)",    counter_cpu_cache_free_hits,    counter_cpu_cache_free_misses);
+  print_hits("shared cache (free)", counter_shared_cache_free_hits, counter_shared_cache_free_misses);
 }
 
-void print_bin_stats() {
-  printf("bin: n_mallocs net_n_mallocs highwater\n");
+static void print_bin_stats() {
+  fprintf(stderr, "bin: n_mallocs net_n_mallocs\n");
   for (binnumber_t i = 0; i <= first_huge_bin_number; i++) {
-    printf("%d: %lu %lu %lu\n", i, stats.b[i].n_mallocs, stats.b[i].net_n_mallocs, stats.b[i].highwater_mark);
+    int64_t mallocs = counter_read(static_cast<stat_counter>(counter_bin_mallocs + i));
+    int64_t frees   = counter_read(static_cast<stat_counter>(counter_bin_frees + i));
+    if (mallocs == 0) continue;
+    fprintf(stderr, "%d: %ld %ld\n", i, mallocs, mallocs - frees);
   }
 }
 
+static void print_atomic_site_stats() {
+  fprintf(stderr, "atomic site: policy calls aborts fallbacks direct switches"
+	  " conflict capacity lock_held retry other backoff_cycles\n");
+  for (uint32_t i = 1; i <= std::min(n_atomic_sites, max_atomic_sites-1); i++) {
+    atomic_site *site = atomic_load(&atomic_sites[i]);
+    if (site == NULL) continue;
+    atomic_site s;
+    atomic_site_sum(site, &s); // Including the counts of the threads that haven't flushed them.
+    fprintf(stderr, "%s: %s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu\n", s.name, s.use_lock ? "lock" : "elide",
+	    s.n_calls, s.n_aborts, s.n_fallbacks, s.n_direct, s.n_switches,
+	    s.n_causes[abort_conflict], s.n_causes[abort_capacity], s.n_causes[abort_lock_held],
+	    s.n_causes[abort_retry], s.n_causes[abort_other], s.backoff_cycles);
+  }
+}
+
+void print_stats() {
+  flush_thread_cache_stats();
+  fprintf(stderr, "footprint: %ld\n", counter_read(counter_footprint));
+  print_cache_stats();
+  print_bin_stats();
+  print_atomic_site_stats();
+}
+
+// We can't call atexit() from initialize_malloc() (see #22), so the
+// statistics are printed by a destructor.
+__attribute__((destructor))
+static void print_stats_at_exit() {
+  if (use_stats) print_stats();
+}
+
+#ifdef TESTING
+extern "C" void test_stats() {
+  bool saved_use_stats = use_stats;
+  const stat_counter c = counter_thread_cache_hits;
+  int64_t before = counter_read(c);
+  use_stats = false;
+  stat_add(c, 1);
+  bassert(counter_read(c) == before);
+  use_stats = true;
+  stat_add(c, 3);
+  bassert(counter_read(c) == before + 3);
+  // A counter is the sum over the slots, whichever slot did the counting.
+  __sync_fetch_and_add(&counters[(n_cpu_slots-1)*counters_per_slot + c], 5);
+  bassert(counter_read(c) == before + 8);
+  // Each slot's counters start on a cache line of their own.
+  bassert(reinterpret_cast<uint64_t>(&counters[counters_per_slot]) % cacheline_size == 0);
+  int64_t mallocs = counter_read(static_cast<stat_counter>(counter_bin_mallocs + first_huge_bin_number));
+  bin_stats_note_malloc(first_huge_bin_number + 3, 2);
+  bassert(counter_read(static_cast<stat_counter>(counter_bin_mallocs + first_huge_bin_number)) == mallocs + 2);
+  use_stats = saved_use_stats;
+}
 #endif
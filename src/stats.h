@@ -0,0 +1,69 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Counters and statistics.
+//
+// The counters are kept per cpu slot (see topology.h): each slot has
+// its own cache-line-aligned block of counters, so a thread counting
+// only writes lines that the other threads on its cpu write.  A
+// counter's value is the sum over the slots, which we compute only
+// when someone reads it.
+//
+// The footprint is always counted.  The statistics are counted only
+// when SUPERMALLOC_STATS=1, in which case they are printed on stderr
+// when the program exits.  Otherwise a statistic costs a load and a
+// branch that isn't taken.
+
+#include "generated_constants.h"
+#include "malloc_internal.h"
+#include "topology.h"
+
+enum stat_counter {
+  counter_footprint,
+  counter_thread_cache_hits,
+  counter_thread_cache_misses,
+  counter_cpu_cache_hits,
+  counter_cpu_cache_misses,
+  counter_shared_cache_hits,
+  counter_shared_cache_misses,
+  counter_cpu_cache_free_hits,    // A free that put a magazine into the cpu cache.
+  counter_cpu_cache_free_misses,
+  counter_shared_cache_free_hits,
+  counter_shared_cache_free_misses,
+  counter_bin_mallocs, // One for each bin, plus one for all the huge bins.
+  counter_bin_frees = counter_bin_mallocs + first_huge_bin_number + 1,
+  counter_limit     = counter_bin_frees   + first_huge_bin_number + 1
+};
+
+const uint32_t counters_per_slot = (counter_limit + 7) & ~7u; // A whole number of cache lines.
+
+extern bool use_stats;
+extern uint64_t *counters; // n_cpu_slots blocks of counters_per_slot counters.
+
+void init_counters();
+// Effect: Allocate the counters.  Requires: init_cpu_slots() has been called.
+
+static inline void counter_add(stat_counter c, int64_t delta) {
+  __sync_fetch_and_add(&counters[cpu_slot(getcpu())*counters_per_slot + c], delta);
+}
+
+static inline void stat_add(stat_counter c, int64_t delta) {
+  if (__builtin_expect(use_stats, 0)) counter_add(c, delta);
+}
+
+int64_t counter_read(stat_counter c);
+// Effect: Return the sum of counter c over all the slots.  The answer
+//  may be slightly stale.
+
+static inline void bin_stats_note_malloc(binnumber_t b, uint32_t n) {
+  stat_add(static_cast<stat_counter>(counter_bin_mallocs + (b < first_huge_bin_number ? b : first_huge_bin_number)), n);
+}
+
+static inline void bin_stats_note_free(binnumber_t b, uint32_t n) {
+  stat_add(static_cast<stat_counter>(counter_bin_frees + (b < first_huge_bin_number ? b : first_huge_bin_number)), n);
+}
+
+void print_stats();
+// Effect: Print the cache, bin, and atomic site statistics on stderr.
+
+#endif
@@ -18,6 +18,17 @@ void* realloc(void *p, size_t size) __THROW;
 // non_standard API
 size_t malloc_usable_size(const void *ptr);
 
+int supermalloc_write_heap_profile(int fd);
+// Effect: Write the live sampled heap, grouped by stack, to fd in
+//  pprof's heap profile format.  Returns 0, or -1 if the heap profiler
+//  is off (see SUPERMALLOC_HEAP_PROFILE) or the write fails.
+
+void supermalloc_purge(void);
+// Effect: Give the pages of the empty small folios that are waiting
+//  to be purged, and of the free large objects, back to the operating
+//  system.  With SUPERMALLOC_PURGER=user, the freeing threads leave
+//  that to this function (see purge.h).
+
 #ifdef __cplusplus
 }
 #endif
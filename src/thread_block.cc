@@ -0,0 +1,38 @@
+#include "thread_block.h"
+
+#include "bassert.h"
+#include "malloc_internal.h"
+
+static void release_thread_block(void *v)
+// Effect: Called when a thread exits.  Put its block on the free list.
+{
+  thread_block *b = reinterpret_cast<thread_block*>(v);
+  thread_block_pool *pool = b->pool;
+  pool->forget();
+  lockfree_push(&pool->free, b, b);
+}
+
+static void make_thread_block_key(thread_block_pool *pool) {
+  // Once per pool, so a lock is fine.
+  mylock_raii m(&pool->key_lock);
+  if (pool->have_key) return;
+  bassert(pthread_key_create(&pool->key, release_thread_block) == 0);
+  atomic_store(&pool->have_key, true);
+}
+
+void* thread_block_get(thread_block_pool *pool) {
+  thread_block *b = lockfree_pop(&pool->free);
+  if (b == NULL) {
+    b = reinterpret_cast<thread_block*>(mmap_size(ceil(sizeof(thread_block) + pool->size, pagesize)*pagesize));
+    if (b == NULL) return NULL;
+    b->pool = pool;
+    while (1) {
+      thread_block *old = atomic_load(&pool->all);
+      b->next_all = old;
+      if (__sync_bool_compare_and_swap(&pool->all, old, b)) break;
+    }
+  }
+  if (!atomic_load(&pool->have_key)) make_thread_block_key(pool);
+  pthread_setspecific(pool->key, b);
+  return thread_block_data<void>(b);
+}
@@ -0,0 +1,57 @@
+#ifndef THREAD_BLOCK_H
+#define THREAD_BLOCK_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "atomically.h"
+
+// A thread_block_pool gives each thread that asks for one a block of
+// memory (zeroed when it is first mapped) to keep its own counters in.
+// Every block stays on the pool's list of all the blocks, so that a
+// reader can add up the counters of all the threads, living or dead.
+// When a thread exits, its block goes on the pool's free list, counters
+// and all, for the next thread.  The blocks are never unmapped.
+//
+// The caller keeps its thread's block in a __thread variable, and the
+// pool calls forget (in the exiting thread) to clear that variable.
+
+struct thread_block_pool;
+
+struct thread_block {
+  thread_block      *next;     // The next block on the free list.
+  thread_block      *next_all; // The next block on the list of all blocks.
+  thread_block_pool *pool;     // The pool the block goes back to.
+  uint64_t           pad;      // Keeps the caller's part 16-byte aligned.
+  // The caller's part of the block follows.
+};
+
+struct thread_block_pool {
+  size_t                     size;      // The size of the caller's part of each block.
+  void                     (*forget)(); // Clears the calling thread's pointer to its block.
+  thread_block              *all;
+  tagged_head<thread_block*> free;
+  lock_t                     key_lock;
+  bool                       have_key;
+  pthread_key_t              key;
+};
+
+#define THREAD_BLOCK_POOL_INITIALIZER(size, forget) {size, forget, NULL, {NULL, 0}, LOCK_INITIALIZER, false, 0}
+
+void* thread_block_get(thread_block_pool *pool);
+// Effect: Give the calling thread a block from pool (taking one off the
+//  free list, or mapping a new one), and return the caller's part of
+//  it.  Returns NULL if we are out of memory.
+
+static inline thread_block* thread_block_all(thread_block_pool *pool) {
+  return atomic_load(&pool->all);
+}
+
+template <class T>
+static inline T* thread_block_data(thread_block *b)
+// Effect: Return the caller's part of b.
+{
+  return reinterpret_cast<T*>(b + 1);
+}
+
+#endif // THREAD_BLOCK_H
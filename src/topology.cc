@@ -0,0 +1,304 @@
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "bassert.h"
+#include "topology.h"
+
+#ifdef TESTING
+#include <ftw.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#endif
+
+uint32_t n_cpu_slots = 1;
+uint32_t n_mapped_cpus = 0;
+uint16_t *cpu_slot_map = NULL;
+uint16_t *slot_cpu = NULL;
+
+uint32_t n_llc_domains = 1;
+uint8_t *llc_domain_of_slot = NULL;
+uint16_t *llc_next_sibling = NULL;
+
+static const uint32_t cpu_mask_words = cpu_id_limit/64;
+
+static void read_cpu_mask(uint64_t *mask)
+// Effect: Set mask (of cpu_mask_words words) to our affinity mask.  If
+//  we can't get it, pretend we have the first 128 cpus, which is what
+//  we used to assume.  (We don't use sysconf, since it can call malloc.)
+{
+  memset(mask, 0, cpu_mask_words*sizeof(*mask));
+  if (sched_getaffinity(0, cpu_mask_words*sizeof(*mask), reinterpret_cast<cpu_set_t*>(mask)) != 0) {
+    mask[0] = mask[1] = ~0ul;
+  }
+}
+
+static inline bool cpu_in_mask(const uint64_t *mask, uint32_t cpu) {
+  return (mask[cpu/64] >> (cpu%64)) & 1;
+}
+
+static void set_cpu_slots(const uint16_t *cpus, uint32_t n)
+// Effect: Map out n slots, giving slot s to cpus[s], and set up the
+//  per-slot topology (as one domain).
+{
+  uint32_t limit = 0;
+  for (uint32_t s = 0; s < n; s++) limit = std::max(limit, cpus[s] + 1u);
+  // One mapping holds the slot maps and the per-slot topology.
+  size_t map_size  = ceil(limit*sizeof(*cpu_slot_map), cacheline_size)*cacheline_size;
+  size_t cpus_size = ceil(n*sizeof(*slot_cpu), cacheline_size)*cacheline_size;
+  size_t llc_size  = ceil(n*sizeof(*llc_domain_of_slot), cacheline_size)*cacheline_size;
+  size_t next_size = ceil(n*sizeof(*llc_next_sibling), cacheline_size)*cacheline_size;
+  char *p = reinterpret_cast<char*>(mmap_size(ceil(map_size + cpus_size + llc_size + next_size, pagesize)*pagesize));
+  bassert(p);
+  cpu_slot_map       = reinterpret_cast<uint16_t*>(p);
+  slot_cpu           = reinterpret_cast<uint16_t*>(p + map_size);
+  llc_domain_of_slot = reinterpret_cast<uint8_t*>(p + map_size + cpus_size);
+  llc_next_sibling   = reinterpret_cast<uint16_t*>(p + map_size + cpus_size + llc_size);
+  for (uint32_t s = 0; s < n; s++) {
+    slot_cpu[s] = cpus[s];
+    cpu_slot_map[cpus[s]] = s+1;
+    llc_next_sibling[s] = (s+1) % n;
+  }
+  n_mapped_cpus = limit;
+  n_cpu_slots = n;
+  n_llc_domains = 1;
+}
+
+void init_cpu_slots() {
+  uint64_t mask[cpu_mask_words];
+  read_cpu_mask(mask);
+  uint16_t cpus[cpu_id_limit];
+  uint32_t n = 0;
+  for (uint32_t cpu = 0; cpu < cpu_id_limit; cpu++) {
+    if (cpu_in_mask(mask, cpu)) cpus[n++] = cpu;
+  }
+  if (n == 0) cpus[n++] = 0;
+  set_cpu_slots(cpus, n);
+}
+
+bool read_sysfs_file(const char *path, char *buf, size_t bufsize) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  ssize_t n = read(fd, buf, bufsize-1);
+  close(fd);
+  if (n < 0) return false;
+  buf[n] = 0;
+  return true;
+}
+
+static int32_t first_cpu_in_list(const char *list)
+// Effect: Return the lowest-numbered cpu in a cpu list such as
+//  "0-3,8-11", or -1 if there is none.  The kernel prints the ranges in
+//  increasing order, so it's the first number.
+{
+  if (*list < '0' || *list > '9') return -1;
+  int32_t cpu = 0;
+  for (; *list >= '0' && *list <= '9'; list++) {
+    cpu = cpu*10 + (*list - '0');
+  }
+  return cpu;
+}
+
+static int32_t llc_leader(const char *cpu_dir, uint32_t cpu)
+// Effect: Return the lowest-numbered cpu that shares cpu's last-level
+//  cache, or -1 if we can't tell.
+{
+  char path[256];
+  char buf[256];
+  int best_level = 0;
+  int best_index = -1;
+  for (int index = 0; index < 16; index++) {
+    snprintf(path, sizeof(path), "%s/cpu%u/cache/index%d/level", cpu_dir, cpu, index);
+    if (!read_sysfs_file(path, buf, sizeof(buf))) break;
+    int level = first_cpu_in_list(buf); // It's just a number.
+    if (level > best_level) {
+      best_level = level;
+      best_index = index;
+    }
+  }
+  if (best_index < 0) return -1;
+  snprintf(path, sizeof(path), "%s/cpu%u/cache/index%d/shared_cpu_list", cpu_dir, cpu, best_index);
+  if (!read_sysfs_file(path, buf, sizeof(buf))) return -1;
+  return first_cpu_in_list(buf);
+}
+
+void init_llc_domains(const char *cpu_dir) {
+  const uint8_t unknown_domain = 0xff;
+  int32_t leader_of_domain[llc_domain_limit];
+  uint32_t n = 0;
+  for (uint32_t s = 0; s < n_cpu_slots; s++) {
+    int32_t leader = llc_leader(cpu_dir, slot_cpu[s]);
+    uint32_t d = unknown_domain;
+    if (leader >= 0) {
+      d = 0;
+      while (d < n && leader_of_domain[d] != leader) d++;
+      if (d == n) {
+	if (n < llc_domain_limit) {
+	  leader_of_domain[n++] = leader;
+	} else {
+	  d = leader % llc_domain_limit;
+	}
+      }
+    }
+    llc_domain_of_slot[s] = d;
+  }
+  if (n == 0) {
+    // We know nothing, so all the cpus are in one domain.
+    memset(llc_domain_of_slot, 0, n_cpu_slots);
+  }
+  n_llc_domains = n > 0 ? n : 1;
+  // The siblings form a ring of the slots in each domain.  (Slots whose
+  // cpus sysfs doesn't describe are in domain 0, and point into domain
+  // 0's ring without being in it.)
+  for (uint32_t s = 0; s < n_cpu_slots; s++) {
+    uint8_t d = llc_domain_of_slot[s] == unknown_domain ? 0 : llc_domain_of_slot[s];
+    uint32_t next = (s+1) % n_cpu_slots;
+    while (next != s && llc_domain_of_slot[next] != d) {
+      next = (next+1) % n_cpu_slots;
+    }
+    llc_next_sibling[s] = next;
+  }
+  for (uint32_t s = 0; s < n_cpu_slots; s++) {
+    if (llc_domain_of_slot[s] == unknown_domain) llc_domain_of_slot[s] = 0;
+  }
+}
+
+#ifdef TESTING
+static void write_small_file(const char *path, const char *contents) {
+  FILE *f = fopen(path, "w");
+  bassert(f);
+  fputs(contents, f);
+  fclose(f);
+}
+
+void make_fake_cpu_topology(char *dir, uint32_t n_cpus, uint32_t cpus_per_domain) {
+  strcpy(dir, "/tmp/supermalloc-topology-XXXXXX");
+  bassert(mkdtemp(dir));
+  char path[256];
+  char buf[64];
+  for (uint32_t cpu = 0; cpu < n_cpus; cpu++) {
+    snprintf(path, sizeof(path), "%s/cpu%u", dir, cpu);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/cpu%u/cache", dir, cpu);
+    mkdir(path, 0700);
+    // A private L1 and a shared L3, listed in that order.
+    snprintf(path, sizeof(path), "%s/cpu%u/cache/index0", dir, cpu);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/cpu%u/cache/index0/level", dir, cpu);
+    write_small_file(path, "1\n");
+    snprintf(path, sizeof(path), "%s/cpu%u/cache/index0/shared_cpu_list", dir, cpu);
+    snprintf(buf, sizeof(buf), "%u\n", cpu);
+    write_small_file(path, buf);
+    snprintf(path, sizeof(path), "%s/cpu%u/cache/index1", dir, cpu);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/cpu%u/cache/index1/level", dir, cpu);
+    write_small_file(path, "3\n");
+    snprintf(path, sizeof(path), "%s/cpu%u/cache/index1/shared_cpu_list", dir, cpu);
+    uint32_t first = cpu - cpu % cpus_per_domain;
+    snprintf(buf, sizeof(buf), "%u-%u\n", first, first + cpus_per_domain - 1);
+    write_small_file(path, buf);
+  }
+}
+
+static uint32_t real_n_cpu_slots, real_n_mapped_cpus, real_n_llc_domains;
+static uint16_t *real_cpu_slot_map, *real_slot_cpu, *real_llc_next_sibling;
+static uint8_t *real_llc_domain_of_slot;
+
+void use_fake_cpu_slots(uint32_t n_cpus) {
+  bassert(real_cpu_slot_map == NULL);
+  real_n_cpu_slots = n_cpu_slots;
+  real_n_mapped_cpus = n_mapped_cpus;
+  real_n_llc_domains = n_llc_domains;
+  real_cpu_slot_map = cpu_slot_map;
+  real_slot_cpu = slot_cpu;
+  real_llc_next_sibling = llc_next_sibling;
+  real_llc_domain_of_slot = llc_domain_of_slot;
+  uint16_t cpus[cpu_id_limit];
+  uint32_t n = n_cpu_slots;
+  memcpy(cpus, slot_cpu, n*sizeof(cpus[0]));
+  for (uint32_t cpu = 0; cpu < n_cpus; cpu++) {
+    if (exact_cpu_slot(cpu) < 0) cpus[n++] = cpu;
+  }
+  set_cpu_slots(cpus, n);
+}
+
+void use_real_cpu_slots() {
+  bassert(real_cpu_slot_map != NULL);
+  // (We leave the fake maps mapped.)
+  n_cpu_slots = real_n_cpu_slots;
+  n_mapped_cpus = real_n_mapped_cpus;
+  n_llc_domains = real_n_llc_domains;
+  cpu_slot_map = real_cpu_slot_map;
+  slot_cpu = real_slot_cpu;
+  llc_next_sibling = real_llc_next_sibling;
+  llc_domain_of_slot = real_llc_domain_of_slot;
+  real_cpu_slot_map = NULL;
+}
+
+static int remove_one(const char *path, const struct stat *sb __attribute__((unused)),
+		      int flag __attribute__((unused)), struct FTW *ftw __attribute__((unused))) {
+  return remove(path);
+}
+
+void remove_fake_sysfs_tree(const char *dir) {
+  nftw(dir, remove_one, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+extern "C" void test_topology() {
+  bassert(n_cpu_slots >= 1 && n_mapped_cpus >= 1);
+  for (uint32_t cpu = 0; cpu < n_mapped_cpus; cpu++) {
+    int32_t s = exact_cpu_slot(cpu);
+    bassert(s < static_cast<int32_t>(n_cpu_slots));
+    bassert(s < 0 || slot_cpu[s] == cpu);
+  }
+  // Cpus that weren't in the mask share a slot.
+  bassert(exact_cpu_slot(n_mapped_cpus) == -1);
+  bassert(cpu_slot(n_mapped_cpus) == n_mapped_cpus % n_cpu_slots);
+  bassert(cpu_slot(cpu_id_limit+3) < n_cpu_slots);
+
+  // A fake machine keeps the slots of the cpus we really have, so that
+  // the per-slot arrays stay big enough for the running threads.
+  uint32_t real_slots = n_cpu_slots;
+  uint16_t cpu0 = slot_cpu[0];
+  use_fake_cpu_slots(test_cpu_slots);
+  bassert(n_cpu_slots >= test_cpu_slots && n_cpu_slots <= real_slots + test_cpu_slots);
+  bassert(slot_cpu[0] == cpu0);
+  for (uint32_t cpu = 0; cpu < test_cpu_slots; cpu++) {
+    bassert(exact_cpu_slot(cpu) >= 0 && slot_cpu[cpu_slot(cpu)] == cpu);
+  }
+
+  bassert(first_cpu_in_list("0-3,8-11\n") == 0);
+  bassert(first_cpu_in_list("12,14\n") == 12);
+  bassert(first_cpu_in_list("\n") == -1);
+
+  char dir[64];
+  make_fake_cpu_topology(dir, 8, 4);
+  init_llc_domains(dir);
+  bassert(n_llc_domains == 2);
+  for (uint32_t cpu = 0; cpu < 8; cpu++) {
+    bassert(llc_domain_of_slot[cpu_slot(cpu)] == cpu/4);
+  }
+  // Following the siblings from cpu 0 visits cpus 1, 2 and 3, and back.
+  uint32_t s = cpu_slot(0);
+  for (uint32_t i = 1; i <= 4; i++) {
+    s = llc_next_sibling[s];
+    bassert(slot_cpu[s] == i % 4);
+  }
+  bassert(slot_cpu[llc_next_sibling[cpu_slot(7)]] == 4);
+  bassert(llc_domain_of_slot[cpu_slot(8)] == 0);
+  remove_fake_sysfs_tree(dir);
+
+  // A directory with no topology in it is one domain.
+  init_llc_domains("/nonexistent");
+  bassert(n_llc_domains == 1);
+  bassert(llc_next_sibling[5] == 6);
+  bassert(llc_next_sibling[n_cpu_slots-1] == 0);
+
+  use_real_cpu_slots();
+  bassert(n_cpu_slots == real_slots && slot_cpu[0] == cpu0);
+}
+#endif
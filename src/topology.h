@@ -0,0 +1,100 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+// Cpu slots.
+//
+// The per-cpu data (the cpu caches, the footprint counters, the
+// topology below, and the numa nodes) is indexed by a slot number
+// rather than by the cpu number.  There is one slot for each cpu in
+// the affinity mask we start with, which is the cgroup cpuset if there
+// is one.  So a 256-cpu machine gets 256 slots, and a container
+// pinned to cpus 200-203 gets four.  A cpu that wasn't in the mask
+// (because the affinity was widened later) shares slot
+// cpu % n_cpu_slots with another cpu.
+//
+// The slot maps are made by init_cpu_slots(), which initialize_malloc()
+// calls before anything else needs them.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "malloc_internal.h"
+
+const uint32_t cpu_id_limit = 8192; // The kernel's CONFIG_NR_CPUS is at most this.
+
+extern uint32_t n_cpu_slots;
+extern uint32_t n_mapped_cpus; // One more than the largest cpu in the mask.
+extern uint16_t *cpu_slot_map; // For cpu < n_mapped_cpus, the cpu's slot plus one, or 0 if it has none.
+extern uint16_t *slot_cpu;     // The cpu of each slot.
+
+static inline int32_t exact_cpu_slot(uint32_t cpu)
+// Effect: Return cpu's own slot, or -1 if it shares one.
+{
+  return cpu < n_mapped_cpus ? static_cast<int32_t>(cpu_slot_map[cpu]) - 1 : -1;
+}
+
+static inline uint32_t cpu_slot(uint32_t cpu) {
+  int32_t s = exact_cpu_slot(cpu);
+  return s >= 0 ? s : cpu % n_cpu_slots;
+}
+
+void init_cpu_slots();
+// Effect: Read our affinity mask and set up the slot maps (and the
+//  per-slot arrays below).  This doesn't call malloc.
+
+// Which cpus share a last-level cache.
+//
+// On a multi-socket machine (or a chip with several L3 slices, such
+// as the AMD parts) a cache line that moves between two cpus in
+// different last-level-cache domains is much slower than one that
+// stays inside a domain.  So the cache has a tier for each domain
+// between the cpu caches and the global cache (see cache.cc).
+//
+// We read the topology out of sysfs at initialization time: for each
+// cpu, the cache with the highest level under
+//   cpuN/cache/indexK/level
+// and its
+//   cpuN/cache/indexK/shared_cpu_list.
+// The cpus in that list form a domain.  If there is no such information
+// (no sysfs, for example) all the cpus are in one domain.
+
+const uint32_t llc_domain_limit = 16; // Machines with more domains than this share the tiers among domains.
+
+extern uint32_t n_llc_domains;
+extern uint8_t *llc_domain_of_slot;
+extern uint16_t *llc_next_sibling;
+// llc_next_sibling[slot] is the next slot (wrapping around) in the
+// same domain as slot.  If slot is alone in its domain, it is slot.
+
+bool read_sysfs_file(const char *path, char *buf, size_t bufsize);
+// Effect: Read the (small) file at path into buf as a null-terminated
+//  string.  We use read() rather than stdio, since we may be inside the
+//  first call to malloc.  Return false if we can't.
+
+void init_llc_domains(const char *cpu_dir);
+// Effect: Read the last-level cache domains from cpu_dir (which is
+//  normally /sys/devices/system/cpu), and set n_llc_domains,
+//  llc_domain_of_slot and llc_next_sibling.  This doesn't call malloc.
+//  Requires: init_cpu_slots() has been called.
+
+#ifdef TESTING
+const uint32_t test_cpu_slots = 16; // The unit tests fake machines with up to this many cpus.
+
+void use_fake_cpu_slots(uint32_t n_cpus);
+// Effect: Give cpus 0 to n_cpus-1 slots (after the slots of the cpus
+//  we really have, which keep theirs), as if they were all in our
+//  affinity mask.  The llc domains go back to one domain.
+void use_real_cpu_slots();
+// Effect: Undo use_fake_cpu_slots().
+
+void make_fake_cpu_topology(char *dir, uint32_t n_cpus, uint32_t cpus_per_domain);
+// Effect: Make a directory that looks like /sys/devices/system/cpu
+//  for a machine with n_cpus cpus, in which each run of
+//  cpus_per_domain cpus shares an L3 cache, and store its name in dir
+//  (which must have room for 64 bytes).
+void remove_fake_sysfs_tree(const char *dir);
+// Effect: Remove a directory made by make_fake_cpu_topology() or
+//  make_fake_numa_nodes().
+#endif
+
+#endif
@@ -5,6 +5,14 @@ extern "C" {
 #endif
 
   void test_cache_early(void);
+  void test_rseq(void);
+  void test_topology(void);
+  void test_numa(void);
+  void test_atomic_sites(void);
+  void test_stats(void);
+  void test_heap_profile(void);
+  void test_latency(void);
+  void test_queue_mutex(void);
   void initialize_malloc(void);
   void test_hyperceil(void);
   void test_size_2_bin(void);